@@ -19,19 +19,29 @@
 
 #include "common.h"
 #include "x-set-keys.h"
+#include "latency.h"
+#include "metrics.h"
+#include "trace.h"
 
+/* Key combinations are stored in the keys of the tree themselves, so that
+ * neither inserting nor freeing actions allocates memory for keys. */
 #define _list_new()                                                     \
-  g_tree_new_full(_compare_key_combination, NULL, g_free, _free_action)
-#define _list_free(list) g_tree_destroy(list)
+  g_tree_new_full(_compare_key_combination, NULL, NULL, _free_node)
+#define _list_free(list) g_tree_unref(list)
 #define _list_insert(list, key_combination, action)                     \
-  g_tree_insert((list),                                                 \
-                g_memdup(&(key_combination), sizeof (KeyCombination)),   \
-                (action))
+  (metrics_gauge_add(METRICS_LIVE_ACTION_NODES, 1),                     \
+   g_tree_insert((list), GUINT_TO_POINTER((key_combination).i), (action)))
 #define _list_get_length(action_list) g_tree_nnodes(action_list)
 #define _list_lookup(list, key_combination) \
-  g_tree_lookup((list), &(key_combination))
+  g_tree_lookup((list), GUINT_TO_POINTER((key_combination).i))
 
+static Action *_new_action(ActionType type,
+                           gboolean (*run)(XSetKeys *xsk,
+                                           const Action *action),
+                           void (*free_data)(Action *action));
 static void _free_action(gpointer action);
+static void _free_node(gpointer action);
+static gboolean _merge_action(gpointer key, gpointer value, gpointer user_data);
 static gint _compare_key_combination(gconstpointer a,
                                      gconstpointer b,
                                      gpointer user_data);
@@ -50,9 +60,14 @@ ActionList *action_list_new()
   return _list_new();
 }
 
-void action_list_free(ActionList *action_list)
+ActionList *action_list_ref(ActionList *action_list)
 {
-  return _list_free(action_list);
+  return g_tree_ref(action_list);
+}
+
+void action_list_free(gpointer action_list)
+{
+  _list_free(action_list);
 }
 
 gboolean action_list_add_key_action(ActionList *actions_list,
@@ -61,10 +76,9 @@ gboolean action_list_add_key_action(ActionList *actions_list,
 {
   Action *action;
 
-  action = g_new(Action, 1);
-  action->type = ACTION_TYPE_KEY_EVENTS;
-  action->run = _send_key_events;
-  action->free_data = _free_key_arrays;
+  action = _new_action(ACTION_TYPE_KEY_EVENTS,
+                       _send_key_events,
+                       _free_key_arrays);
   action->data.key_arrays = key_code_array_array_deprive(output_keys);
   if (!_add_action(actions_list,
                    &key_combination_array_get_at(input_keys, 0),
@@ -81,10 +95,7 @@ gboolean action_list_add_select_action(ActionList *actions_list,
 {
   Action *action;
 
-  action = g_new(Action, 1);
-  action->type = ACTION_TYPE_SELECTION;
-  action->run = _toggle_selection_mode;
-  action->free_data = NULL;
+  action = _new_action(ACTION_TYPE_SELECTION, _toggle_selection_mode, NULL);
   if (!_add_action(actions_list,
                    &key_combination_array_get_at(input_keys, 0),
                    key_combination_array_get_length(input_keys),
@@ -95,6 +106,14 @@ gboolean action_list_add_select_action(ActionList *actions_list,
   return TRUE;
 }
 
+/* Adds the actions of `from' which are not defined in `action_list'.
+ * The added actions are shared with `from', only multi stroke actions
+ * defined in both lists are merged recursively. */
+void action_list_merge(ActionList *action_list, const ActionList *from)
+{
+  g_tree_foreach((ActionList *)from, _merge_action, action_list);
+}
+
 gint action_list_get_length(const ActionList *action_list)
 {
   return _list_get_length((ActionList *)action_list);
@@ -106,22 +125,67 @@ const Action *action_list_lookup(const ActionList *action_list,
   return _list_lookup((ActionList *)action_list, key_combination);
 }
 
+static Action *_new_action(ActionType type,
+                           gboolean (*run)(XSetKeys *xsk,
+                                           const Action *action),
+                           void (*free_data)(Action *action))
+{
+  Action *action = g_new(Action, 1);
+
+  metrics_gauge_add(METRICS_LIVE_ACTIONS, 1);
+  action->type = type;
+  action->ref_count = 1;
+  action->run = run;
+  action->free_data = free_data;
+  return action;
+}
+
 static void _free_action(gpointer action_)
 {
   Action *action = action_;
 
+  if (--action->ref_count > 0) {
+    return;
+  }
   if (action->free_data) {
     action->free_data(action);
   }
+  metrics_gauge_add(METRICS_LIVE_ACTIONS, -1);
   g_free(action);
 }
 
+/* Called by GTree for each entry removed from an action list */
+static void _free_node(gpointer action)
+{
+  metrics_gauge_add(METRICS_LIVE_ACTION_NODES, -1);
+  _free_action(action);
+}
+
+static gboolean _merge_action(gpointer key, gpointer value, gpointer user_data)
+{
+  ActionList *action_list = user_data;
+  Action *from_action = value;
+  KeyCombination key_combination;
+  Action *action;
+
+  key_combination.i = GPOINTER_TO_UINT(key);
+  action = _list_lookup(action_list, key_combination);
+  if (!action) {
+    from_action->ref_count++;
+    _list_insert(action_list, key_combination, from_action);
+  } else if (action->type == ACTION_TYPE_MULTI_STROKE &&
+             from_action->type == ACTION_TYPE_MULTI_STROKE) {
+    action_list_merge(action->data.action_list,
+                      from_action->data.action_list);
+  }
+  return FALSE;
+}
+
 static gint _compare_key_combination(gconstpointer a,
                                      gconstpointer b,
                                      gpointer user_data)
 {
-  return key_combination_compare(*(const KeyCombination *)a,
-                                 *(const KeyCombination *)b);
+  return (gint)GPOINTER_TO_UINT(a) - (gint)GPOINTER_TO_UINT(b);
 }
 
 static gboolean _add_action(ActionList *action_list,
@@ -139,10 +203,9 @@ static gboolean _add_action(ActionList *action_list,
     Action *parent_action = _list_lookup(action_list, *input_keys);
 
     if (!parent_action) {
-      parent_action = g_new(Action, 1);
-      parent_action->type = ACTION_TYPE_MULTI_STROKE;
-      parent_action->run = _set_current_actions;
-      parent_action->free_data = _free_action_list;
+      parent_action = _new_action(ACTION_TYPE_MULTI_STROKE,
+                                  _set_current_actions,
+                                  _free_action_list);
       parent_action->data.action_list = _list_new();
       _list_insert(action_list, *input_keys, parent_action);
     } else if (parent_action->type != ACTION_TYPE_MULTI_STROKE) {
@@ -167,8 +230,13 @@ static gboolean _send_key_events(XSetKeys *xsk, const Action *action)
     debug_print("Empty key action");
     return TRUE;
   }
-  debug_print("Executing key action, number of key combinations=%d",
-              key_code_array_array_get_length(key_arrays));
+  metrics_count(METRICS_KEY_ACTIONS);
+  trace_record(TRACE_KEY_ACTION,
+               0,
+               0,
+               key_code_array_array_get_length(key_arrays));
+  latency_set_class(key_code_array_array_get_length(key_arrays) == 1
+                    ? LATENCY_CLASS_REMAP : LATENCY_CLASS_MULTI_EVENT);
   return xsk_send_key_events(xsk, key_arrays);
 }
 
@@ -179,7 +247,8 @@ static void _free_key_arrays(Action *action)
 
 static gboolean _set_current_actions(XSetKeys *xsk, const Action *action)
 {
-  debug_print("Multi stroke action");
+  metrics_count(METRICS_MULTI_STROKE_ACTIONS);
+  trace_record(TRACE_MULTI_STROKE_ACTION, 0, 0, 0);
   xsk_set_current_actions(xsk, action->data.action_list);
   return TRUE;
 }
@@ -191,6 +260,8 @@ static void _free_action_list(Action *action)
 
 static gboolean _toggle_selection_mode(XSetKeys *xsk, const Action *action)
 {
+  metrics_count(METRICS_SELECTION_ACTIONS);
+  latency_set_class(LATENCY_CLASS_SELECTION);
   xsk_toggle_selection_mode(xsk);
   return TRUE;
 }
@@ -35,6 +35,7 @@ typedef enum ActionType_ {
 
 typedef struct Action_ {
   ActionType type;
+  gint ref_count;
   gboolean (*run)(struct XSetKeys_ *xsk, const struct Action_ *action);
   void (*free_data)(struct Action_ *action);
   union ActionData_ {
@@ -44,12 +45,14 @@ typedef struct Action_ {
 } Action;
 
 ActionList *action_list_new();
-void action_list_free(ActionList *action_list);
+ActionList *action_list_ref(ActionList *action_list);
+void action_list_free(gpointer action_list);
 gboolean action_list_add_key_action(ActionList *actions_list,
                                     const KeyCombinationArray *input_keys,
                                     KeyCodeArrayArray *output_keys);
 gboolean action_list_add_select_action(ActionList *actions_list,
                                        const KeyCombinationArray *input_keys);
+void action_list_merge(ActionList *action_list, const ActionList *from);
 gint action_list_get_length(const ActionList *action_list);
 const Action *action_list_lookup(const ActionList *action_list,
                                  KeyCombination key_combination);
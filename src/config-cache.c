@@ -0,0 +1,437 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+#include "common.h"
+#include "config-cache.h"
+
+#define _MAGIC "XSKC"
+#define _VERSION 3
+#define _DIRECTORY_NAME "x-set-keys"
+#define _FILE_SUFFIX ".cache"
+#define _align(size) (((size) + 3) & ~3)
+#define _DATA_OFFSET _align(sizeof (_Header) + sizeof (KeyInformation))
+#define _get_source_offset(num_words)                   \
+  _align(_DATA_OFFSET + (num_words) * sizeof (guint16))
+
+/* The cache file consists of the header, the KeyInformation, the compiled
+ * records of the configuration file encoded as an array of 16 bit words
+ * and the source records given by config.c as an array of 32 bit words.
+ * Section record:      type, number of names, { length, chars... }...
+ * Key action record:   type, number of inputs, inputs...,
+ *                      number of outputs, { length, key codes... }...
+ * Select action record: type, number of inputs, inputs...
+ * It is valid only for the same configuration file contents, keyboard
+ * mapping, modifier mapping, file format and tables of key names, which
+ * are identified by the digest.  The file is written by the user, so that
+ * every value read from it is checked before use. */
+typedef struct _Header_ {
+  gchar magic[4];
+  guint32 version;
+  guint32 key_information_size;
+  guint32 num_words;
+  guint32 num_source_words;
+  guint8 digest[32];
+} _Header;
+
+static void _update_keymap_digest(GChecksum *checksum,
+                                  const KIKeyboardMapping *mapping);
+static void _update_format_digest(GChecksum *checksum);
+static gboolean _is_valid_key_information(const KeyInformation *key_info);
+static gchar *_get_cache_filepath(const gchar config_filepath[]);
+static void _add_word(ConfigCache *cache, guint16 word);
+static void _add_string(ConfigCache *cache, const gchar *string);
+static void _add_inputs(ConfigCache *cache, const KeyCombinationArray *inputs);
+static gboolean _read_word(ConfigCache *cache, guint16 *word);
+static gchar *_read_string(ConfigCache *cache);
+static gboolean _read_inputs(ConfigCache *cache, KeyCombinationArray *inputs);
+static gboolean _read_outputs(ConfigCache *cache, KeyCodeArrayArray *outputs);
+
+ConfigCache *config_cache_new(const KIKeyboardMapping *mapping,
+                              const gchar config_filepath[],
+                              const gchar *contents,
+                              gsize length)
+{
+  ConfigCache *cache = g_new0(ConfigCache, 1);
+  GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+  gsize digest_length = sizeof (cache->digest);
+
+  g_checksum_update(checksum, (const guchar *)contents, length);
+  _update_keymap_digest(checksum, mapping);
+  _update_format_digest(checksum);
+  g_checksum_get_digest(checksum, cache->digest, &digest_length);
+  g_checksum_free(checksum);
+
+  cache->filepath = _get_cache_filepath(config_filepath);
+  cache->records = g_array_new(FALSE, FALSE, sizeof (guint16));
+  return cache;
+}
+
+void config_cache_free(ConfigCache *cache)
+{
+  if (cache->mapped_file) {
+    g_mapped_file_unref(cache->mapped_file);
+  }
+  g_array_free(cache->records, TRUE);
+  g_free(cache->filepath);
+  g_free(cache);
+}
+
+gboolean config_cache_open(ConfigCache *cache, KeyInformation *key_info)
+{
+  GError *error = NULL;
+  const _Header *header;
+  gsize length;
+
+  cache->mapped_file = g_mapped_file_new(cache->filepath, FALSE, &error);
+  if (!cache->mapped_file) {
+    debug_print("No cache file: %s", error->message);
+    g_error_free(error);
+    return FALSE;
+  }
+
+  header = (const _Header *)g_mapped_file_get_contents(cache->mapped_file);
+  length = g_mapped_file_get_length(cache->mapped_file);
+  if (length < _DATA_OFFSET ||
+      memcmp(header->magic, _MAGIC, sizeof (header->magic)) ||
+      header->version != _VERSION ||
+      header->key_information_size != sizeof (KeyInformation) ||
+      length != _get_source_offset(header->num_words) +
+      header->num_source_words * sizeof (guint32) ||
+      memcmp(header->digest, cache->digest, sizeof (cache->digest)) ||
+      !_is_valid_key_information((const KeyInformation *)(header + 1))) {
+    debug_print("Cache file is out of date: %s", cache->filepath);
+    g_mapped_file_unref(cache->mapped_file);
+    cache->mapped_file = NULL;
+    return FALSE;
+  }
+
+  memcpy(key_info, header + 1, sizeof (KeyInformation));
+  cache->next_word =
+    (const guint16 *)((const gchar *)header + _DATA_OFFSET);
+  cache->end_word = cache->next_word + header->num_words;
+  cache->source_words =
+    (const guint32 *)((const gchar *)header +
+                      _get_source_offset(header->num_words));
+  cache->num_source_words = header->num_source_words;
+  debug_print("Cache file hit: %s", cache->filepath);
+  return TRUE;
+}
+
+ConfigCacheRecordType config_cache_next(ConfigCache *cache,
+                                        GPtrArray *names,
+                                        KeyCombinationArray *inputs,
+                                        KeyCodeArrayArray *outputs)
+{
+  guint16 type;
+  guint16 count;
+
+  if (!_read_word(cache, &type)) {
+    return CONFIG_CACHE_RECORD_END;
+  }
+  switch (type) {
+  case CONFIG_CACHE_RECORD_SECTION:
+    g_ptr_array_set_size(names, 0);
+    if (!_read_word(cache, &count) ||
+        count > cache->end_word - cache->next_word) {
+      break;
+    }
+    for ( ; count > 0; count--) {
+      gchar *name = _read_string(cache);
+      if (!name) {
+        return CONFIG_CACHE_RECORD_ERROR;
+      }
+      g_ptr_array_add(names, name);
+    }
+    return type;
+  case CONFIG_CACHE_RECORD_KEY_ACTION:
+    if (!_read_inputs(cache, inputs) || !_read_outputs(cache, outputs)) {
+      break;
+    }
+    return type;
+  case CONFIG_CACHE_RECORD_SELECT_ACTION:
+    if (!_read_inputs(cache, inputs)) {
+      break;
+    }
+    return type;
+  }
+  return CONFIG_CACHE_RECORD_ERROR;
+}
+
+void config_cache_add_section(ConfigCache *cache, const GPtrArray *names)
+{
+  guint index;
+
+  _add_word(cache, CONFIG_CACHE_RECORD_SECTION);
+  _add_word(cache, names->len);
+  for (index = 0; index < names->len; index++) {
+    _add_string(cache, g_ptr_array_index(names, index));
+  }
+}
+
+void config_cache_add_key_action(ConfigCache *cache,
+                                 const KeyCombinationArray *inputs,
+                                 const KeyCodeArrayArray *outputs)
+{
+  gint index;
+  gint key_index;
+
+  _add_word(cache, CONFIG_CACHE_RECORD_KEY_ACTION);
+  _add_inputs(cache, inputs);
+  _add_word(cache, key_code_array_array_get_length(outputs));
+  for (index = 0;
+       index < key_code_array_array_get_length(outputs);
+       index++) {
+    const KeyCodeArray *array = key_code_array_array_get_at(outputs, index);
+
+    _add_word(cache, key_code_array_get_length(array));
+    for (key_index = 0;
+         key_index < key_code_array_get_length(array);
+         key_index++) {
+      _add_word(cache, key_code_array_get_at(array, key_index));
+    }
+  }
+}
+
+void config_cache_add_select_action(ConfigCache *cache,
+                                    const KeyCombinationArray *inputs)
+{
+  _add_word(cache, CONFIG_CACHE_RECORD_SELECT_ACTION);
+  _add_inputs(cache, inputs);
+}
+
+gboolean config_cache_save(ConfigCache *cache,
+                           const KeyInformation *key_info,
+                           const GArray *source_words)
+{
+  const guint8 padding[4] = { 0 };
+  _Header header = { { 0 } };
+  GByteArray *data;
+  gchar *directory;
+  GError *error = NULL;
+  gboolean result = TRUE;
+
+  memcpy(header.magic, _MAGIC, sizeof (header.magic));
+  header.version = _VERSION;
+  header.key_information_size = sizeof (KeyInformation);
+  header.num_words = cache->records->len;
+  header.num_source_words = source_words->len;
+  memcpy(header.digest, cache->digest, sizeof (header.digest));
+
+  data = g_byte_array_sized_new(_get_source_offset(cache->records->len) +
+                                source_words->len * sizeof (guint32));
+  g_byte_array_append(data, (const guint8 *)&header, sizeof (header));
+  g_byte_array_append(data, (const guint8 *)key_info, sizeof (KeyInformation));
+  g_byte_array_append(data, padding, _DATA_OFFSET - data->len);
+  g_byte_array_append(data,
+                      (const guint8 *)cache->records->data,
+                      cache->records->len * sizeof (guint16));
+  g_byte_array_append(data,
+                      padding,
+                      _get_source_offset(cache->records->len) - data->len);
+  g_byte_array_append(data,
+                      (const guint8 *)source_words->data,
+                      source_words->len * sizeof (guint32));
+
+  directory = g_path_get_dirname(cache->filepath);
+  if (g_mkdir_with_parents(directory, 0700) < 0) {
+    print_error("Failed to create cache directory(%s)", directory);
+    result = FALSE;
+  } else if (!g_file_set_contents(cache->filepath,
+                                  (const gchar *)data->data,
+                                  data->len,
+                                  &error)) {
+    g_warning("Failed to write cache file(%s): %s",
+              cache->filepath,
+              error->message);
+    g_error_free(error);
+    result = FALSE;
+  } else {
+    debug_print("Cache file written: %s", cache->filepath);
+  }
+
+  g_free(directory);
+  g_byte_array_free(data, TRUE);
+  return result;
+}
+
+static void _update_keymap_digest(GChecksum *checksum,
+                                  const KIKeyboardMapping *mapping)
+{
+  g_checksum_update(checksum,
+                    (const guchar *)&mapping->min_key_code,
+                    sizeof (mapping->min_key_code));
+  g_checksum_update(checksum,
+                    (const guchar *)&mapping->key_syms_per_key_code,
+                    sizeof (mapping->key_syms_per_key_code));
+  g_checksum_update(checksum,
+                    (const guchar *)mapping->key_syms,
+                    mapping->num_key_codes *
+                    mapping->key_syms_per_key_code * sizeof (KeySym));
+  g_checksum_update(checksum,
+                    (const guchar *)mapping->modmap->modifiermap,
+                    8 * mapping->modmap->max_keypermod);
+}
+
+static void _update_format_digest(GChecksum *checksum)
+{
+  const guint32 format[] = { _VERSION, sizeof (KeyInformation) };
+
+  g_checksum_update(checksum, (const guchar *)_MAGIC, strlen(_MAGIC));
+  g_checksum_update(checksum, (const guchar *)format, sizeof (format));
+  ki_update_checksum(checksum);
+}
+
+static gboolean _is_valid_key_information(const KeyInformation *key_info)
+{
+  gint index;
+
+  for (index = 0; index < KI_NUM_MODIFIER; index++) {
+    if (key_info->modifier_key_code[index] &&
+        !ki_is_valid_key_code(key_info->modifier_key_code[index])) {
+      return FALSE;
+    }
+  }
+  for (index = 0; index < ENGINE_NUM_KEY_CODES; index++) {
+    if (key_info->modifier_mask_or_key_kind[index] > KI_KIND_CURSOR) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+static gchar *_get_cache_filepath(const gchar config_filepath[])
+{
+  gchar *digest;
+  gchar *name;
+  gchar *result;
+
+  digest = g_compute_checksum_for_string(G_CHECKSUM_MD5, config_filepath, -1);
+  name = g_strconcat(digest, _FILE_SUFFIX, NULL);
+  result = g_build_filename(g_get_user_cache_dir(),
+                            _DIRECTORY_NAME,
+                            name,
+                            NULL);
+  g_free(name);
+  g_free(digest);
+  return result;
+}
+
+static void _add_word(ConfigCache *cache, guint16 word)
+{
+  g_array_append_val(cache->records, word);
+}
+
+static void _add_string(ConfigCache *cache, const gchar *string)
+{
+  gsize length = strlen(string);
+  guint start = cache->records->len;
+
+  _add_word(cache, length);
+  g_array_set_size(cache->records, start + 1 + (length + 1) / 2);
+  memset(&g_array_index(cache->records, guint16, start + 1),
+         0,
+         (length + 1) / 2 * sizeof (guint16));
+  memcpy(&g_array_index(cache->records, guint16, start + 1), string, length);
+}
+
+static void _add_inputs(ConfigCache *cache, const KeyCombinationArray *inputs)
+{
+  gint index;
+
+  _add_word(cache, key_combination_array_get_length(inputs));
+  for (index = 0; index < key_combination_array_get_length(inputs); index++) {
+    _add_word(cache, key_combination_array_get_at(inputs, index).i);
+  }
+}
+
+static gboolean _read_word(ConfigCache *cache, guint16 *word)
+{
+  if (cache->next_word >= cache->end_word) {
+    return FALSE;
+  }
+  *word = *cache->next_word++;
+  return TRUE;
+}
+
+static gchar *_read_string(ConfigCache *cache)
+{
+  guint16 length;
+  const gchar *string;
+
+  if (!_read_word(cache, &length) ||
+      cache->end_word - cache->next_word < (length + 1) / 2) {
+    return NULL;
+  }
+  string = (const gchar *)cache->next_word;
+  cache->next_word += (length + 1) / 2;
+  return g_strndup(string, length);
+}
+
+static gboolean _read_inputs(ConfigCache *cache, KeyCombinationArray *inputs)
+{
+  guint16 count;
+  KeyCombination kc;
+
+  key_combination_array_clear(inputs);
+  if (!_read_word(cache, &count) || !count) {
+    return FALSE;
+  }
+  for ( ; count > 0; count--) {
+    if (!_read_word(cache, &kc.i) ||
+        !ki_is_valid_key_code(kc.s.key_code) ||
+        kc.s.modifiers >= 1 << KI_NUM_MODIFIER) {
+      return FALSE;
+    }
+    key_combination_array_add(inputs, kc);
+  }
+  return TRUE;
+}
+
+static gboolean _read_outputs(ConfigCache *cache, KeyCodeArrayArray *outputs)
+{
+  guint16 count;
+  guint16 length;
+  guint16 word;
+
+  key_code_array_array_clear(outputs);
+  if (!_read_word(cache, &count) || !count) {
+    return FALSE;
+  }
+  for ( ; count > 0; count--) {
+    KeyCodeArray *array;
+
+    if (!_read_word(cache, &length) ||
+        length > KEY_CODE_ARRAY_MAX_LENGTH ||
+        length > cache->end_word - cache->next_word) {
+      return FALSE;
+    }
+    array = key_code_array_new(length);
+    key_code_array_array_add(outputs, array);
+    for ( ; length > 0; length--) {
+      KeyCode key_code;
+
+      if (!_read_word(cache, &word) || !ki_is_valid_key_code(word)) {
+        return FALSE;
+      }
+      key_code = word;
+      key_code_array_add(array, key_code);
+    }
+  }
+  return TRUE;
+}
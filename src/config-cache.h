@@ -0,0 +1,71 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+#ifndef _CONFIG_CACHE_H
+#define _CONFIG_CACHE_H
+
+#include <X11/Xlib.h>
+#include <glib.h>
+
+#include "key-information.h"
+#include "key-combination.h"
+#include "key-code-array.h"
+
+typedef enum ConfigCacheRecordType_ {
+  CONFIG_CACHE_RECORD_END,
+  CONFIG_CACHE_RECORD_SECTION,
+  CONFIG_CACHE_RECORD_KEY_ACTION,
+  CONFIG_CACHE_RECORD_SELECT_ACTION,
+  CONFIG_CACHE_RECORD_ERROR
+} ConfigCacheRecordType;
+
+typedef struct ConfigCache_ {
+  gchar *filepath;
+  guint8 digest[32];
+  GArray *records;
+  GMappedFile *mapped_file;
+  const guint16 *next_word;
+  const guint16 *end_word;
+  const guint32 *source_words;
+  guint num_source_words;
+} ConfigCache;
+
+ConfigCache *config_cache_new(const KIKeyboardMapping *mapping,
+                              const gchar config_filepath[],
+                              const gchar *contents,
+                              gsize length);
+void config_cache_free(ConfigCache *cache);
+
+gboolean config_cache_open(ConfigCache *cache, KeyInformation *key_info);
+ConfigCacheRecordType config_cache_next(ConfigCache *cache,
+                                        GPtrArray *names,
+                                        KeyCombinationArray *inputs,
+                                        KeyCodeArrayArray *outputs);
+
+void config_cache_add_section(ConfigCache *cache, const GPtrArray *names);
+void config_cache_add_key_action(ConfigCache *cache,
+                                 const KeyCombinationArray *inputs,
+                                 const KeyCodeArrayArray *outputs);
+void config_cache_add_select_action(ConfigCache *cache,
+                                    const KeyCombinationArray *inputs);
+gboolean config_cache_save(ConfigCache *cache,
+                           const KeyInformation *key_info,
+                           const GArray *source_words);
+
+#endif /* _CONFIG_CACHE_H */
@@ -0,0 +1,135 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+#include <limits.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "config-monitor.h"
+#include "config.h"
+#include "probes.h"
+
+/* Editors write a file in several steps, so the events are coalesced */
+#define _RELOAD_DELAY 200
+#define _EVENT_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)
+#define _EVENT_BUFFER_SIZE (sizeof (struct inotify_event) + NAME_MAX + 1)
+
+static gboolean _handle_event(gpointer user_data);
+static gboolean _reload(gpointer user_data);
+
+/* The directory is watched instead of the file itself, because editors
+ * often replace the file by renaming a new one. */
+ConfigMonitor *config_monitor_initialize(XSetKeys *xsk,
+                                         const gchar filepath[])
+{
+  gint fd;
+  gchar *directory;
+  ConfigMonitor *monitor;
+
+  fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0) {
+    print_error("inotify_init1 failed");
+    return NULL;
+  }
+  directory = g_path_get_dirname(filepath);
+  if (inotify_add_watch(fd, directory, _EVENT_MASK) < 0) {
+    print_error("Failed to watch directory %s", directory);
+    g_free(directory);
+    close(fd);
+    return NULL;
+  }
+  g_free(directory);
+
+  monitor = (ConfigMonitor *)device_initialize(fd,
+                                               "configuration file monitor",
+                                               sizeof (ConfigMonitor),
+                                               _handle_event,
+                                               xsk);
+  monitor->filepath = g_strdup(filepath);
+  monitor->basename = g_path_get_basename(filepath);
+  return monitor;
+}
+
+void config_monitor_finalize(XSetKeys *xsk)
+{
+  ConfigMonitor *monitor = xsk_get_config_monitor(xsk);
+
+  if (monitor->reload_timeout_id) {
+    g_source_remove(monitor->reload_timeout_id);
+  }
+  g_free(monitor->filepath);
+  g_free(monitor->basename);
+  device_close(&monitor->device);
+  device_finalize(&monitor->device);
+}
+
+static gboolean _handle_event(gpointer user_data)
+{
+  XSetKeys *xsk = user_data;
+  ConfigMonitor *monitor = xsk_get_config_monitor(xsk);
+  union {
+    struct inotify_event event;
+    gchar bytes[_EVENT_BUFFER_SIZE * 4];
+  } buffer;
+  gssize length;
+  gchar *pointer;
+  gboolean is_changed = FALSE;
+
+  length = device_read(&monitor->device, &buffer, sizeof (buffer));
+  if (length < 0) {
+    return FALSE;
+  }
+  for (pointer = buffer.bytes; pointer < buffer.bytes + length; ) {
+    const struct inotify_event *event = (const struct inotify_event *)pointer;
+
+    if (event->len && !strcmp(event->name, monitor->basename)) {
+      is_changed = TRUE;
+    }
+    pointer += sizeof (struct inotify_event) + event->len;
+  }
+
+  if (is_changed) {
+    debug_print("Configuration file changed: %s", monitor->filepath);
+    if (monitor->reload_timeout_id) {
+      g_source_remove(monitor->reload_timeout_id);
+    }
+    monitor->reload_timeout_id = g_timeout_add(_RELOAD_DELAY, _reload, xsk);
+  }
+  return TRUE;
+}
+
+/* The new actions replace the current ones only if the whole file is
+ * loaded successfully, otherwise the current ones are kept running. */
+static gboolean _reload(gpointer user_data)
+{
+  XSetKeys *xsk = user_data;
+  ConfigMonitor *monitor = xsk_get_config_monitor(xsk);
+  gboolean result;
+
+  monitor->reload_timeout_id = 0;
+  g_message("Reloading configuration file: %s", monitor->filepath);
+  probe0(reload_config);
+  result = config_load(xsk, monitor->filepath);
+  probe1(reload_config_done, result);
+  if (!result) {
+    g_warning("Keep the current configuration");
+  }
+  return G_SOURCE_REMOVE;
+}
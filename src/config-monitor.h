@@ -0,0 +1,37 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+#ifndef _CONFIG_MONITOR_H
+#define _CONFIG_MONITOR_H
+
+#include "x-set-keys.h"
+#include "device.h"
+
+typedef struct ConfigMonitor_ {
+  Device device;
+  gchar *filepath;
+  gchar *basename;
+  guint reload_timeout_id;
+} ConfigMonitor;
+
+ConfigMonitor *config_monitor_initialize(XSetKeys *xsk,
+                                         const gchar filepath[]);
+void config_monitor_finalize(XSetKeys *xsk);
+
+#endif  /* _CONFIG_MONITOR_H */
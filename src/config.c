@@ -17,89 +17,329 @@
  *
  ***************************************************************************/
 
+#include <sys/resource.h>
+
 #include "common.h"
 #include "config.h"
+#include "config-cache.h"
 #include "action.h"
+#include "window-system.h"
+#include "recorder.h"
+
+#define _SECTION_START '['
+#define _SECTION_END ']'
+#define _DEFAULT_SECTION "*"
+
+#define _get_record_at(config, index)                   \
+  g_array_index((config)->records, guint32, (index))
+
+/* Records of Config, an array of 32 bit words:
+ * Section record:       type, line number, number of names,
+ *                       { length, chars... }...
+ * Key action record:    type, line number, number of inputs, key specs...,
+ *                       number of outputs, key specs...
+ * Select action record: type, line number, number of inputs, key specs...
+ * A key spec is two words, modifiers with key code and key symbol. */
+typedef enum _RecordType_ {
+  _RECORD_SECTION = 1,
+  _RECORD_KEY_ACTION,
+  _RECORD_SELECT_ACTION
+} _RecordType;
 
-static gboolean _parse_line(XSetKeys *xsk,
-                            KeyCombinationArray *inputs,
-                            KeyCodeArrayArray *outputs,
-                            gchar *line);
+typedef struct _Loader_ {
+  XSetKeys *xsk;
+  Config *config;
+  KIKeyboardMapping mapping;
+  KeyInformation key_information;
+  ActionList *default_actions;
+  GHashTable *profile_actions;
+  ActionList *actions;
+  GPtrArray *profiles;
+  GPtrArray *names;
+  KeyCombinationArray *inputs;
+  KeyCodeArrayArray *outputs;
+  ConfigCache *cache;
+  const guint32 *next_word;
+  const guint32 *end_word;
+  gint line_number;
+  gint num_actions;
+  gint64 start_time;
+} _Loader;
+
+static Config *_new_config(const gchar filepath[]);
+static void _free_config(Config *config);
+static gboolean _initialize_loader(_Loader *loader,
+                                   XSetKeys *xsk,
+                                   Config *config);
+static void _reset_loader(_Loader *loader);
+static gboolean _finalize_loader(_Loader *loader, gboolean result);
+static gboolean _load_cache(_Loader *loader);
+static gboolean _parse_contents(_Loader *loader, gchar *contents);
+static gboolean _parse_line(_Loader *loader, gchar *line);
+static gboolean _parse_section(_Loader *loader, gchar *line);
+static gboolean _resolve(_Loader *loader);
+static gboolean _resolve_record(_Loader *loader, guint32 type);
+static gboolean _resolve_inputs(_Loader *loader);
+static gboolean _resolve_outputs(_Loader *loader);
+static gboolean _start_section(_Loader *loader);
+static void _add_word(Config *config, guint32 word);
+static void _add_string(Config *config, const gchar *string);
+static void _add_key_spec(Config *config, const KIKeySpec *key_spec);
+static gboolean _read_word(_Loader *loader, guint32 *word);
+static gchar *_read_string(_Loader *loader);
+static gboolean _read_key_spec(_Loader *loader, KIKeySpec *key_spec);
 static gchar *_get_next_word(gchar **line_pointer);
+static void _print_statistics(const _Loader *loader, const gchar *what);
 
 gboolean config_load(XSetKeys *xsk, const gchar filepath[])
 {
   gboolean result = TRUE;
+  gboolean is_cached;
   GError *error = NULL;
-  GIOChannel *channel;
-  gint line_number;
-  KeyCombinationArray *inputs;
-  KeyCodeArrayArray *outputs;
+  gchar *contents;
+  gsize length;
+  Config *config;
+  _Loader loader;
 
-  channel = g_io_channel_new_file(filepath, "r", &error);
-  if (!channel) {
-    g_critical("Failed to open configuration file(%s): %s",
+  if (!g_file_get_contents(filepath, &contents, &length, &error)) {
+    g_critical("Failed to read configuration file(%s): %s",
                filepath,
                error->message);
     g_error_free(error);
     return FALSE;
   }
 
-  inputs = key_combination_array_new(6);
-  outputs = key_code_array_array_new(6);
-
-  for (line_number = 1; result; line_number++) {
-    gchar *line;
-    GIOStatus status = g_io_channel_read_line(channel,
-                                              &line,
-                                              NULL,
-                                              NULL,
-                                              &error);
-    if (status == G_IO_STATUS_ERROR) {
-      g_critical("Failed to read configuration file(%s) at line %d: %s",
-                 filepath,
-                 line_number,
-                 error->message);
-      g_error_free(error);
-      result = FALSE;
-      break;
-    }
-    if (status == G_IO_STATUS_EOF) {
-      break;
-    }
-    if (!_parse_line(xsk, inputs, outputs, line)) {
-      g_critical("Configuration file(%s) error at line %d",
-                 filepath,
-                 line_number);
-      result = FALSE;
+  config = _new_config(filepath);
+  if (!_initialize_loader(&loader, xsk, config)) {
+    _free_config(config);
+    g_free(contents);
+    return FALSE;
+  }
+  loader.cache = config_cache_new(&loader.mapping, filepath, contents, length);
+
+  is_cached = config_cache_open(loader.cache, &loader.key_information);
+  if (is_cached && !_load_cache(&loader)) {
+    g_warning("Broken cache file: %s", loader.cache->filepath);
+    _reset_loader(&loader);
+    is_cached = FALSE;
+  }
+  if (!is_cached) {
+    result = _parse_contents(&loader, contents) && _resolve(&loader);
+    if (result) {
+      config_cache_save(loader.cache,
+                        &loader.key_information,
+                        config->records);
     }
-    g_free(line);
+  }
+  g_free(contents);
+  if (result) {
+    _print_statistics(&loader, is_cached ? "Cache loaded" : "Config loaded");
   }
 
-  key_combination_array_free(inputs);
-  key_code_array_array_free(outputs);
+  if (!_finalize_loader(&loader, result)) {
+    _free_config(config);
+    return FALSE;
+  }
+  if (xsk_get_config(xsk)) {
+    _free_config(xsk_get_config(xsk));
+  }
+  xsk->config = config;
+  return TRUE;
+}
 
-  if (g_io_channel_shutdown(channel, FALSE, &error) == G_IO_STATUS_ERROR) {
-    g_critical("Failed to close configuration file(%s): %s",
-               filepath,
-               error->message);
-    g_error_free(error);
+/* Resolves the parsed configuration file again against the current
+ * keyboard mapping.  The actions in use are replaced only on success. */
+gboolean config_reload_mapping(XSetKeys *xsk)
+{
+  _Loader loader;
+
+  gboolean result;
+
+  if (!_initialize_loader(&loader, xsk, xsk_get_config(xsk))) {
+    return FALSE;
+  }
+  result = _resolve(&loader);
+  if (result) {
+    _print_statistics(&loader, "Config resolved");
+  }
+  return _finalize_loader(&loader, result);
+}
+
+void config_finalize(XSetKeys *xsk)
+{
+  _free_config(xsk_get_config(xsk));
+  xsk->config = NULL;
+}
+
+static Config *_new_config(const gchar filepath[])
+{
+  Config *config = g_new(Config, 1);
+
+  config->filepath = g_strdup(filepath);
+  config->records = g_array_new(FALSE, FALSE, sizeof (guint32));
+  return config;
+}
+
+static void _free_config(Config *config)
+{
+  g_array_free(config->records, TRUE);
+  g_free(config->filepath);
+  g_free(config);
+}
+
+/* The actions are built into new lists, so that the lists in use stay
+ * available until they are replaced at once by _finalize_loader(). */
+static gboolean _initialize_loader(_Loader *loader,
+                                   XSetKeys *xsk,
+                                   Config *config)
+{
+  memset(loader, 0, sizeof (*loader));
+  loader->start_time = g_get_monotonic_time();
+  if (!ki_get_keyboard_mapping(xsk_get_display(xsk), &loader->mapping)) {
+    return FALSE;
   }
+  loader->xsk = xsk;
+  loader->config = config;
+  loader->default_actions = action_list_new();
+  loader->profile_actions = g_hash_table_new_full(g_direct_hash,
+                                                  g_direct_equal,
+                                                  NULL,
+                                                  action_list_free);
+  loader->actions = loader->default_actions;
+  loader->profiles = g_ptr_array_new_with_free_func(action_list_free);
+  loader->names = g_ptr_array_new_with_free_func(g_free);
+  loader->inputs = key_combination_array_new(6);
+  loader->outputs = key_code_array_array_new(6);
+  return TRUE;
+}
+
+static void _reset_loader(_Loader *loader)
+{
+  g_hash_table_remove_all(loader->profile_actions);
+  action_list_free(loader->default_actions);
+  loader->default_actions = action_list_new();
+  loader->actions = loader->default_actions;
+  g_ptr_array_set_size(loader->profiles, 0);
+  g_array_set_size(loader->config->records, 0);
+  loader->num_actions = 0;
+}
 
-  if (result && !action_list_get_length(xsk_get_root_actions(xsk))) {
-    g_critical("No data in configuration file: %s", filepath);
+static gboolean _finalize_loader(_Loader *loader, gboolean result)
+{
+  XSetKeys *xsk = loader->xsk;
+  guint index;
+
+  /* Each profile inherits the default bindings it does not override */
+  for (index = 0; index < loader->profiles->len; index++) {
+    action_list_merge(g_ptr_array_index(loader->profiles, index),
+                      loader->default_actions);
+  }
+  g_ptr_array_free(loader->profiles, TRUE);
+
+  if (result &&
+      !action_list_get_length(loader->default_actions) &&
+      !g_hash_table_size(loader->profile_actions)) {
+    g_critical("No data in configuration file: %s", loader->config->filepath);
     result = FALSE;
   }
+  if (result) {
+    xsk_replace_actions(xsk,
+                        &loader->key_information,
+                        loader->default_actions,
+                        loader->profile_actions);
+    recorder_keep_keyboard_mapping(&loader->mapping);
+    if (xsk_get_window_system(xsk)) {
+      window_system_keep_keyboard_mapping(xsk, &loader->mapping);
+    }
+  } else {
+    g_hash_table_destroy(loader->profile_actions);
+    action_list_free(loader->default_actions);
+  }
 
+  ki_free_keyboard_mapping(&loader->mapping);
+  key_combination_array_free(loader->inputs);
+  key_code_array_array_free(loader->outputs);
+  g_ptr_array_free(loader->names, TRUE);
+  if (loader->cache) {
+    config_cache_free(loader->cache);
+  }
   return result;
 }
 
-static gboolean _parse_line(XSetKeys *xsk,
-                            KeyCombinationArray *inputs,
-                            KeyCodeArrayArray *outputs,
-                            gchar *line)
+/* Rebuilds the action lists from the compiled records of the cache file
+ * without parsing the configuration file nor looking up the key codes. */
+static gboolean _load_cache(_Loader *loader)
 {
+  for (;;) {
+    switch (config_cache_next(loader->cache,
+                              loader->names,
+                              loader->inputs,
+                              loader->outputs)) {
+    case CONFIG_CACHE_RECORD_END:
+      g_array_append_vals(loader->config->records,
+                          loader->cache->source_words,
+                          loader->cache->num_source_words);
+      return TRUE;
+    case CONFIG_CACHE_RECORD_SECTION:
+      if (!_start_section(loader)) {
+        return FALSE;
+      }
+      break;
+    case CONFIG_CACHE_RECORD_KEY_ACTION:
+      loader->num_actions++;
+      if (!action_list_add_key_action(loader->actions,
+                                      loader->inputs,
+                                      loader->outputs)) {
+        return FALSE;
+      }
+      break;
+    case CONFIG_CACHE_RECORD_SELECT_ACTION:
+      loader->num_actions++;
+      if (!action_list_add_select_action(loader->actions, loader->inputs)) {
+        return FALSE;
+      }
+      break;
+    default:
+      return FALSE;
+    }
+  }
+}
+
+/* Parses the configuration file into the records of Config */
+static gboolean _parse_contents(_Loader *loader, gchar *contents)
+{
+  gchar *line;
+  gchar *next_line;
+
+  for (line = contents, loader->line_number = 1;
+       line;
+       line = next_line, loader->line_number++) {
+    next_line = strchr(line, '\n');
+    if (next_line) {
+      *next_line++ = '\0';
+    }
+    if (!_parse_line(loader, line)) {
+      g_critical("Configuration file(%s) error at line %d",
+                 loader->config->filepath,
+                 loader->line_number);
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+static gboolean _parse_line(_Loader *loader, gchar *line)
+{
+  Config *config = loader->config;
+  guint type_index;
+  guint count_index;
   gchar *word;
+  KIKeySpec key_spec;
+
+  g_strchug(line);
+  if (*line == _SECTION_START) {
+    return _parse_section(loader, line + 1);
+  }
 
   word = _get_next_word(&line);
   if (!word || *word == '#') {
@@ -108,19 +348,18 @@ static gboolean _parse_line(XSetKeys *xsk,
 
   debug_print("Parsing: %s %s", word, line);
 
-  key_combination_array_clear(inputs);
-  key_code_array_array_clear(outputs);
+  type_index = config->records->len;
+  _add_word(config, _RECORD_KEY_ACTION);
+  _add_word(config, loader->line_number);
 
+  count_index = config->records->len;
+  _add_word(config, 0);
   do {
-    KeyCombination kc;
-
-    kc = ki_string_to_key_combination(xsk_get_display(xsk),
-                                      xsk_get_key_information(xsk),
-                                      word);
-    if (key_combination_is_null(kc)) {
+    if (!ki_string_to_key_spec(word, &key_spec)) {
       return FALSE;
     }
-    key_combination_array_add(inputs, kc);
+    _add_key_spec(config, &key_spec);
+    _get_record_at(config, count_index)++;
 
     word = _get_next_word(&line);
     if (!word) {
@@ -128,29 +367,280 @@ static gboolean _parse_line(XSetKeys *xsk,
     }
   } while (strcmp(word, "::"));
 
-  if (!key_combination_array_get_length(inputs)) {
+  count_index = config->records->len;
+  _add_word(config, 0);
+  while ((word = _get_next_word(&line))) {
+    if (!strcmp(word, "$select")) {
+      g_array_set_size(config->records, count_index);
+      _get_record_at(config, type_index) = _RECORD_SELECT_ACTION;
+      return TRUE;
+    }
+    if (!ki_string_to_key_spec(word, &key_spec)) {
+      return FALSE;
+    }
+    _add_key_spec(config, &key_spec);
+    _get_record_at(config, count_index)++;
+  }
+
+  return _get_record_at(config, count_index) > 0;
+}
+
+static gboolean _parse_section(_Loader *loader, gchar *line)
+{
+  Config *config = loader->config;
+  gchar *end = strchr(line, _SECTION_END);
+  guint count_index;
+  gchar *word;
+
+  if (!end) {
+    g_critical("Section header is not closed with '%c'", _SECTION_END);
+    return FALSE;
+  }
+  *end++ = '\0';
+  word = _get_next_word(&end);
+  if (word && *word != '#') {
+    g_critical("Unexpected word after section header: %s", word);
     return FALSE;
   }
 
-  while ((word = _get_next_word(&line))) {
+  word = _get_next_word(&line);
+  if (!word) {
+    g_critical("Empty section header");
+    return FALSE;
+  }
+
+  _add_word(config, _RECORD_SECTION);
+  _add_word(config, loader->line_number);
+  count_index = config->records->len;
+  _add_word(config, 0);
+  if (strcmp(word, _DEFAULT_SECTION)) {
+    do {
+      _add_string(config, word);
+      _get_record_at(config, count_index)++;
+    } while ((word = _get_next_word(&line)));
+  } else if (_get_next_word(&line)) {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* Resolves the records of Config to the key codes of the current keyboard
+ * mapping, and records the result to the cache file if any. */
+static gboolean _resolve(_Loader *loader)
+{
+  GArray *records = loader->config->records;
+  guint32 type;
+
+  ki_initialize(&loader->key_information, &loader->mapping);
+
+  loader->next_word = (const guint32 *)records->data;
+  loader->end_word = loader->next_word + records->len;
+  while (_read_word(loader, &type)) {
+    guint32 line_number = 0;
+
+    if (!_read_word(loader, &line_number) ||
+        !_resolve_record(loader, type)) {
+      g_critical("Configuration file(%s) error at line %d",
+                 loader->config->filepath,
+                 line_number);
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+static gboolean _resolve_record(_Loader *loader, guint32 type)
+{
+  guint32 count;
+
+  switch (type) {
+  case _RECORD_SECTION:
+    g_ptr_array_set_size(loader->names, 0);
+    if (!_read_word(loader, &count)) {
+      return FALSE;
+    }
+    for ( ; count > 0; count--) {
+      gchar *name = _read_string(loader);
+      if (!name) {
+        return FALSE;
+      }
+      g_ptr_array_add(loader->names, name);
+    }
+    if (loader->cache) {
+      config_cache_add_section(loader->cache, loader->names);
+    }
+    return _start_section(loader);
+
+  case _RECORD_KEY_ACTION:
+    if (!_resolve_inputs(loader) || !_resolve_outputs(loader)) {
+      return FALSE;
+    }
+    if (loader->cache) {
+      config_cache_add_key_action(loader->cache,
+                                  loader->inputs,
+                                  loader->outputs);
+    }
+    loader->num_actions++;
+    return action_list_add_key_action(loader->actions,
+                                      loader->inputs,
+                                      loader->outputs);
+
+  case _RECORD_SELECT_ACTION:
+    if (!_resolve_inputs(loader)) {
+      return FALSE;
+    }
+    if (loader->cache) {
+      config_cache_add_select_action(loader->cache, loader->inputs);
+    }
+    loader->num_actions++;
+    return action_list_add_select_action(loader->actions, loader->inputs);
+  }
+  return FALSE;
+}
+
+static gboolean _resolve_inputs(_Loader *loader)
+{
+  guint32 count;
+  KIKeySpec key_spec;
+
+  key_combination_array_clear(loader->inputs);
+  if (!_read_word(loader, &count) || !count) {
+    return FALSE;
+  }
+  for ( ; count > 0; count--) {
+    KeyCombination kc;
+
+    if (!_read_key_spec(loader, &key_spec)) {
+      return FALSE;
+    }
+    kc = ki_key_spec_to_key_combination(&loader->mapping,
+                                        &loader->key_information,
+                                        &key_spec);
+    if (key_combination_is_null(kc)) {
+      return FALSE;
+    }
+    key_combination_array_add(loader->inputs, kc);
+  }
+  return TRUE;
+}
+
+static gboolean _resolve_outputs(_Loader *loader)
+{
+  guint32 count;
+  KIKeySpec key_spec;
+
+  key_code_array_array_clear(loader->outputs);
+  if (!_read_word(loader, &count) || !count) {
+    return FALSE;
+  }
+  for ( ; count > 0; count--) {
     KeyCodeArray *key_array;
 
-    if (!strcmp(word, "$select")) {
-      return action_list_add_select_action(xsk_get_root_actions(xsk), inputs);
+    if (!_read_key_spec(loader, &key_spec)) {
+      return FALSE;
     }
-    key_array = ki_string_to_key_code_array(xsk_get_display(xsk),
-                                            xsk_get_key_information(xsk),
-                                            word);
+    key_array = ki_key_spec_to_key_code_array(&loader->mapping,
+                                              &loader->key_information,
+                                              &key_spec);
     if (!key_array) {
       return FALSE;
     }
-    key_code_array_array_add(outputs, key_array);
+    key_code_array_array_add(loader->outputs, key_array);
+  }
+  return TRUE;
+}
+
+/* Switches the destination of the following bindings to the default
+ * actions if `names' is empty, otherwise to a new profile for them. */
+static gboolean _start_section(_Loader *loader)
+{
+  ActionList *profile;
+  guint index;
+
+  if (!loader->names->len) {
+    debug_print("Section: default");
+    loader->actions = loader->default_actions;
+    return TRUE;
+  }
+
+  profile = action_list_new();
+  g_ptr_array_add(loader->profiles, profile);
+  for (index = 0; index < loader->names->len; index++) {
+    const gchar *name = g_ptr_array_index(loader->names, index);
+    GQuark quark = g_quark_from_string(name);
+
+    debug_print("Section: %s", name);
+    if (g_hash_table_contains(loader->profile_actions,
+                              GUINT_TO_POINTER(quark))) {
+      g_critical("Duplicate section: %s", name);
+      return FALSE;
+    }
+    g_hash_table_insert(loader->profile_actions,
+                        GUINT_TO_POINTER(quark),
+                        action_list_ref(profile));
+  }
+  loader->actions = profile;
+  return TRUE;
+}
+
+static void _add_word(Config *config, guint32 word)
+{
+  g_array_append_val(config->records, word);
+}
+
+static void _add_string(Config *config, const gchar *string)
+{
+  gsize length = strlen(string);
+  guint start = config->records->len;
+  guint num_words = (length + 3) / 4;
+
+  _add_word(config, length);
+  g_array_set_size(config->records, start + 1 + num_words);
+  memset(&_get_record_at(config, start + 1), 0, num_words * sizeof (guint32));
+  memcpy(&_get_record_at(config, start + 1), string, length);
+}
+
+static void _add_key_spec(Config *config, const KIKeySpec *key_spec)
+{
+  _add_word(config, key_spec->modifiers | (key_spec->key_code << 8));
+  _add_word(config, key_spec->key_sym);
+}
+
+static gboolean _read_word(_Loader *loader, guint32 *word)
+{
+  if (loader->next_word >= loader->end_word) {
+    return FALSE;
+  }
+  *word = *loader->next_word++;
+  return TRUE;
+}
+
+static gchar *_read_string(_Loader *loader)
+{
+  guint32 length;
+  const gchar *string;
+
+  if (!_read_word(loader, &length) ||
+      (guint32)(loader->end_word - loader->next_word) < (length + 3) / 4) {
+    return NULL;
   }
+  string = (const gchar *)loader->next_word;
+  loader->next_word += (length + 3) / 4;
+  return g_strndup(string, length);
+}
+
+static gboolean _read_key_spec(_Loader *loader, KIKeySpec *key_spec)
+{
+  guint32 modifiers;
+  guint32 key_sym;
 
-  if (!key_code_array_array_get_length(outputs)) {
+  if (!_read_word(loader, &modifiers) || !_read_word(loader, &key_sym)) {
     return FALSE;
   }
-  return action_list_add_key_action(xsk_get_root_actions(xsk), inputs, outputs);
+  key_spec->modifiers = modifiers & 0xff;
+  key_spec->key_code = modifiers >> 8;
+  key_spec->key_sym = key_sym;
+  return TRUE;
 }
 
 static gchar *_get_next_word(gchar **line_pointer)
@@ -179,3 +669,26 @@ static gchar *_get_next_word(gchar **line_pointer)
   *line_pointer = pointer;
   return result;
 }
+
+/* Elapsed time includes getting the keyboard mapping from X server.
+ * Maximum resident set size is of the whole process, so it shows the peak
+ * while the old and the new actions coexist. */
+static void _print_statistics(const _Loader *loader, const gchar *what)
+{
+  struct rusage usage;
+
+  if (!is_debug) {
+    return;
+  }
+  if (getrusage(RUSAGE_SELF, &usage)) {
+    usage.ru_maxrss = 0;
+  }
+  debug_print("%s: %s, actions=%d, records=%u words, time=%" G_GINT64_FORMAT
+              " us, max RSS=%ld KB",
+              what,
+              loader->config->filepath,
+              loader->num_actions,
+              loader->config->records->len,
+              g_get_monotonic_time() - loader->start_time,
+              usage.ru_maxrss);
+}
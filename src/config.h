@@ -22,6 +22,15 @@
 
 #include "x-set-keys.h"
 
+/* Configuration file parsed into key symbols, so that it can be resolved
+ * to key codes again when the keyboard mapping is changed */
+typedef struct Config_ {
+  gchar *filepath;
+  GArray *records;
+} Config;
+
 gboolean config_load(XSetKeys *xsk, const gchar filepath[]);
+gboolean config_reload_mapping(XSetKeys *xsk);
+void config_finalize(XSetKeys *xsk);
 
 #endif /* _CONFIG_H */
@@ -23,6 +23,7 @@
 
 #include "common.h"
 #include "device.h"
+#include "metrics.h"
 
 static gboolean _prepare(GSource *source, gint *timeout);
 static gboolean _check(GSource *source);
@@ -73,6 +74,7 @@ gssize device_read(Device *device, gpointer buffer, gsize count)
 
   do {
     length = read(device->poll_fd.fd, buffer, count);
+    metrics_count(METRICS_SYSCALLS);
   } while (length < 0 && errno == EINTR);
   if (length < 0) {
     print_error("Failed to read %s", g_source_get_name(&device->source));
@@ -86,6 +88,7 @@ gboolean device_write(Device *device, gconstpointer buffer, gsize length)
 
   while (rest > 0) {
     gssize written = write(device->poll_fd.fd, buffer, rest);
+    metrics_count(METRICS_SYSCALLS);
     if (written < 0) {
       if (errno == EINTR) {
         continue;
@@ -101,15 +104,20 @@ gboolean device_write(Device *device, gconstpointer buffer, gsize length)
 
 static gboolean _prepare(GSource *source, gint *timeout)
 {
+  Device *device = (Device *)source;
+
   *timeout = -1;
-  return FALSE;
+  return device->has_pending && device->has_pending(device);
 }
 
 static gboolean _check(GSource *source)
 {
   Device *device = (Device *)source;
 
-  return (device->poll_fd.revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) != 0;
+  if (device->poll_fd.revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) {
+    return TRUE;
+  }
+  return device->has_pending && device->has_pending(device);
 }
 
 static gboolean _dispatch(GSource *source,
@@ -124,7 +132,8 @@ static gboolean _dispatch(GSource *source,
   } else if (device->poll_fd.revents & G_IO_ERR) {
     print_error("I/O Error on %s", g_source_get_name(&device->source));
     notify_error();
-  } else if (device->poll_fd.revents & G_IO_IN) {
+  } else if ((device->poll_fd.revents & G_IO_IN) ||
+             (device->has_pending && device->has_pending(device))) {
     if (!callback(user_data)) {
       notify_error();
     }
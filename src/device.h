@@ -25,6 +25,7 @@
 typedef struct Device_ {
   GSource source;
   GPollFD poll_fd;
+  gboolean (*has_pending)(struct Device_ *device);
 } Device;
 
 Device *device_initialize(gint fd,
@@ -36,6 +37,10 @@ void device_finalize(Device *device);
 
 #define device_get_fd(device) ((device)->poll_fd.fd)
 
+/* For data already read from the fd and buffered, which the fd does not
+ * tell any more */
+#define device_set_pending_func(device, func) ((device)->has_pending = (func))
+
 void device_close(Device *device);
 gssize device_read(Device *device, gpointer buffer, gsize length);
 gboolean device_write(Device *device, gconstpointer buffer, gsize length);
@@ -0,0 +1,133 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+#include "engine.h"
+
+static int _emit_nested_keys(const uint8_t *keys,
+                             EngineEmitFunc emit,
+                             void *user_data);
+
+/* Returns the modifier mask of the regular modifiers pressed with
+ * `key_code'. */
+uint8_t engine_fold_modifiers(const EngineKeyTable *table,
+                              uint8_t key_code,
+                              const uint8_t *pressing_keys)
+{
+  const uint8_t *pointer;
+  uint8_t modifiers = 0;
+  uint8_t mask;
+
+  for (pointer = pressing_keys; *pointer; pointer++) {
+    if (*pointer == key_code) {
+      continue;
+    }
+    mask = table->modifier_mask_or_key_kind[*pointer];
+    if (!mask || mask >= ENGINE_KIND_MODIFIER_OTHER) {
+      continue;
+    }
+    modifiers |= mask;
+  }
+  return modifiers;
+}
+
+int engine_has_modifier(const EngineKeyTable *table,
+                        const uint8_t *keys,
+                        int modifier)
+{
+  const uint8_t *pointer;
+
+  for (pointer = keys; *pointer; pointer++) {
+    if (table->modifier_mask_or_key_kind[*pointer] == (1 << modifier)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Cursor keys are shifted while selection mode, and any other key except
+ * modifiers cancels it. */
+EngineSelection engine_check_selection_key(const EngineKeyTable *table,
+                                           uint8_t key_code,
+                                           const uint8_t *pressing_keys,
+                                           int shift_modifier)
+{
+  if (engine_is_cursor(table, key_code)) {
+    return engine_has_modifier(table, pressing_keys, shift_modifier)
+      ? ENGINE_SELECTION_KEEP : ENGINE_SELECTION_ADD_SHIFT;
+  }
+  return engine_is_modifier(table, key_code)
+    ? ENGINE_SELECTION_KEEP : ENGINE_SELECTION_CANCEL;
+}
+
+int engine_emit_regular_modifiers(const EngineKeyTable *table,
+                                  const uint8_t *pressing_keys,
+                                  int is_press,
+                                  EngineEmitFunc emit,
+                                  void *user_data)
+{
+  const uint8_t *pointer;
+
+  for (pointer = pressing_keys; *pointer; pointer++) {
+    if (!engine_is_regular_modifier(table, *pointer)) {
+      continue;
+    }
+    if (!emit(user_data, *pointer, is_press)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Presses `keys' in order and releases them in reverse order, within
+ * a press and a release of `shift_key_code' unless it is 0. */
+int engine_emit_keys(const uint8_t *keys,
+                     uint8_t shift_key_code,
+                     EngineEmitFunc emit,
+                     void *user_data)
+{
+  if (shift_key_code && !emit(user_data, shift_key_code, 1)) {
+    return 0;
+  }
+  if (!_emit_nested_keys(keys, emit, user_data)) {
+    return 0;
+  }
+  if (shift_key_code && !emit(user_data, shift_key_code, 0)) {
+    return 0;
+  }
+  return 1;
+}
+
+static int _emit_nested_keys(const uint8_t *keys,
+                             EngineEmitFunc emit,
+                             void *user_data)
+{
+  if (!*keys) {
+    return 1;
+  }
+  if (!emit(user_data, *keys, 1)) {
+    return 0;
+  }
+  if (!_emit_nested_keys(keys + 1, emit, user_data)) {
+    return 0;
+  }
+  if (!emit(user_data, *keys, 0)) {
+    return 0;
+  }
+  return 1;
+}
@@ -0,0 +1,83 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+#ifndef _ENGINE_H
+#define _ENGINE_H
+
+/* Key handling which depends on neither X, GLib, evdev nor uinput, so that
+ * it can be built and measured apart from the rest of x-set-keys.  Key
+ * codes are X key codes, and lists of key codes are terminated by 0 like
+ * the data of KeyCodeArray. */
+
+#include <stdint.h>
+
+#define ENGINE_NUM_MODIFIERS 6
+#define ENGINE_NUM_KEY_CODES 255
+
+/* Values of `modifier_mask_or_key_kind' other than modifier masks */
+#define ENGINE_KIND_MODIFIER_OTHER (1 << ENGINE_NUM_MODIFIERS)
+#define ENGINE_KIND_CURSOR (ENGINE_KIND_MODIFIER_OTHER + 1)
+
+typedef struct EngineKeyTable_ {
+  uint8_t modifier_key_code[ENGINE_NUM_MODIFIERS];
+  uint8_t modifier_mask_or_key_kind[ENGINE_NUM_KEY_CODES];
+} EngineKeyTable;
+
+/* What selection mode does with a pressed key */
+typedef enum EngineSelection_ {
+  ENGINE_SELECTION_KEEP,
+  ENGINE_SELECTION_ADD_SHIFT,
+  ENGINE_SELECTION_CANCEL
+} EngineSelection;
+
+/* Called for each output key event, returns 0 on failure */
+typedef int (*EngineEmitFunc)(void *user_data, uint8_t key_code, int is_press);
+
+uint8_t engine_fold_modifiers(const EngineKeyTable *table,
+                              uint8_t key_code,
+                              const uint8_t *pressing_keys);
+int engine_has_modifier(const EngineKeyTable *table,
+                        const uint8_t *keys,
+                        int modifier);
+EngineSelection engine_check_selection_key(const EngineKeyTable *table,
+                                           uint8_t key_code,
+                                           const uint8_t *pressing_keys,
+                                           int shift_modifier);
+int engine_emit_regular_modifiers(const EngineKeyTable *table,
+                                  const uint8_t *pressing_keys,
+                                  int is_press,
+                                  EngineEmitFunc emit,
+                                  void *user_data);
+int engine_emit_keys(const uint8_t *keys,
+                     uint8_t shift_key_code,
+                     EngineEmitFunc emit,
+                     void *user_data);
+
+#define engine_is_modifier(table, key_code)                             \
+  ((table)->modifier_mask_or_key_kind[key_code] &&                      \
+   (table)->modifier_mask_or_key_kind[key_code] <= ENGINE_KIND_MODIFIER_OTHER)
+
+#define engine_is_regular_modifier(table, key_code)                     \
+  ((table)->modifier_mask_or_key_kind[key_code] &&                      \
+   (table)->modifier_mask_or_key_kind[key_code] < ENGINE_KIND_MODIFIER_OTHER)
+
+#define engine_is_cursor(table, key_code)                               \
+  ((table)->modifier_mask_or_key_kind[key_code] == ENGINE_KIND_CURSOR)
+
+#endif /* _ENGINE_H */
@@ -23,9 +23,15 @@
 
 #include "common.h"
 #include "fcitx.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
 
 #define _BUS_NAME "org.fcitx.Fcitx"
 #define _OBJECT_PATH "/inputmethod"
+#define _INTERFACE_NAME _BUS_NAME ".InputMethod"
+#define _CALL_TIMEOUT 1000
+#define _CURRENT_IM_PROPERTY "CurrentIM"
 
 static void _handle_name_appeared(GDBusConnection *connection,
                                   const gchar *name,
@@ -41,9 +47,13 @@ static void _handle_signal(GDBusConnection *connection,
                            const gchar *signal_name,
                            GVariant *parameters,
                            gpointer user_data);
+static const gchar *_lookup_current_input_method(GVariant *parameters);
 static void _update(GDBusConnection *connection, XSetKeys *xsk);
-static gboolean _get_is_excluded(gchar **excluded_input_methods,
-                                 const gchar *current_input_method);
+static void _handle_current_input_method(GObject *source,
+                                         GAsyncResult *result,
+                                         gpointer user_data);
+static void _set_current_input_method(XSetKeys *xsk,
+                                      const gchar *current_input_method);
 
 Fcitx *fcitx_initialize(XSetKeys *xsk, gchar *excluded_input_methods[])
 {
@@ -65,19 +75,28 @@ Fcitx *fcitx_initialize(XSetKeys *xsk, gchar *excluded_input_methods[])
   }
 
   fcitx = g_new0(Fcitx, 1);
-  fcitx->excluded_input_methods = excluded_input_methods;
+  fcitx->excluded_input_methods = g_hash_table_new(g_str_hash, g_str_equal);
+  for (; *excluded_input_methods; excluded_input_methods++) {
+    g_hash_table_add(fcitx->excluded_input_methods, *excluded_input_methods);
+  }
+  fcitx->cancellable = g_cancellable_new();
   fcitx->connection = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
   if (error) {
     g_critical("g_bus_get_sync failed: %s", error->message);
     g_critical("Maybe you need to take over the environment variable"
                " DBUS_SESSION_BUS_ADDRESS before sudo");
     g_error_free(error);
+    g_object_unref(fcitx->cancellable);
+    g_hash_table_destroy(fcitx->excluded_input_methods);
     g_free(fcitx);
     return NULL;
   }
 
   if (seteuid(original_euid) < 0) {
     print_error("seteuid(%d) failed", original_euid);
+    g_object_unref(fcitx->connection);
+    g_object_unref(fcitx->cancellable);
+    g_hash_table_destroy(fcitx->excluded_input_methods);
     g_free(fcitx);
     return NULL;
   }
@@ -102,7 +121,12 @@ void fcitx_finalize(XSetKeys *xsk)
                                          fcitx->subscription_id);
   }
   g_bus_unwatch_name(fcitx->watch_id);
+  /* The callback of a pending call is invoked later with G_IO_ERROR_CANCELLED
+     and must not touch `fcitx' any more */
+  g_cancellable_cancel(fcitx->cancellable);
+  g_object_unref(fcitx->cancellable);
   g_object_unref(fcitx->connection);
+  g_hash_table_destroy(fcitx->excluded_input_methods);
   g_free(fcitx);
 }
 
@@ -155,67 +179,152 @@ static void _handle_signal(GDBusConnection *connection,
                            GVariant *parameters,
                            gpointer user_data)
 {
-  _update(connection, user_data);
+  XSetKeys *xsk = user_data;
+  Fcitx *fcitx = xsk_get_fcitx(xsk);
+  const gchar *current_input_method;
+
+  if (is_debug) {
+    fcitx->signal_time = g_get_monotonic_time();
+  }
+  current_input_method = _lookup_current_input_method(parameters);
+  if (!current_input_method) {
+    _update(connection, xsk);
+    debug_print("Signal handled in %" G_GINT64_FORMAT " us, waiting reply",
+                g_get_monotonic_time() - fcitx->signal_time);
+    return;
+  }
+  /* The result of a GetCurrentIM call in flight is older than this */
+  fcitx->serial++;
+  _set_current_input_method(xsk, current_input_method);
+}
+
+/* Returns the new value of CurrentIM property carried by the
+ * PropertiesChanged signal, or NULL if the signal does not carry it. */
+static const gchar *_lookup_current_input_method(GVariant *parameters)
+{
+  const gchar *interface_name;
+  GVariant *changed_properties;
+  GVariant *value;
+  const gchar *result = NULL;
+
+  if (!g_variant_is_of_type(parameters, G_VARIANT_TYPE("(sa{sv}as)"))) {
+    return NULL;
+  }
+  g_variant_get(parameters, "(&s@a{sv}@as)", &interface_name,
+                &changed_properties, NULL);
+  if (!g_strcmp0(interface_name, _INTERFACE_NAME)) {
+    value = g_variant_lookup_value(changed_properties,
+                                   _CURRENT_IM_PROPERTY,
+                                   G_VARIANT_TYPE_STRING);
+    if (value) {
+      /* The string is owned by `parameters' which outlives the caller */
+      result = g_variant_get_string(value, NULL);
+      g_variant_unref(value);
+    }
+  }
+  g_variant_unref(changed_properties);
+  return result;
 }
 
+/* At most one GetCurrentIM call is outstanding.  Signals received while
+ * it is in flight are coalesced into a single call issued after it. */
 static void _update(GDBusConnection *connection, XSetKeys *xsk)
 {
   Fcitx *fcitx = xsk_get_fcitx(xsk);
+
+  if (fcitx->is_updating) {
+    fcitx->needs_update = TRUE;
+    return;
+  }
+  fcitx->is_updating = TRUE;
+  fcitx->needs_update = FALSE;
+  fcitx->call_serial = fcitx->serial;
+  metrics_count(METRICS_FCITX_CALLS);
+  g_dbus_connection_call(connection,
+                         _BUS_NAME,
+                         _OBJECT_PATH,
+                         _INTERFACE_NAME,
+                         "GetCurrentIM",
+                         NULL,
+                         NULL,
+                         G_DBUS_CALL_FLAGS_NONE,
+                         _CALL_TIMEOUT,
+                         fcitx->cancellable,
+                         _handle_current_input_method,
+                         xsk);
+}
+
+static void _handle_current_input_method(GObject *source,
+                                         GAsyncResult *async_result,
+                                         gpointer user_data)
+{
+  GDBusConnection *connection = G_DBUS_CONNECTION(source);
+  XSetKeys *xsk = user_data;
+  Fcitx *fcitx;
   GVariant *result;
   GError *error = NULL;
   gchar *current_input_method = NULL;
 
-  result = g_dbus_connection_call_sync(connection,
-                                       _BUS_NAME,
-                                       _OBJECT_PATH,
-                                       _BUS_NAME ".InputMethod",
-                                       "GetCurrentIM",
-                                       NULL,
-                                       NULL,
-                                       G_DBUS_CALL_FLAGS_NONE,
-                                       -1,
-                                       NULL,
-                                       &error);
-  if (error) {
-    g_critical("Failed g_dbus_connection_call_sync(GetCurrentIM): %s",
-               error->message);
+  result = g_dbus_connection_call_finish(connection, async_result, &error);
+  if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
     g_error_free(error);
     return;
   }
 
-  g_variant_get(result, "(s)", &current_input_method);
-  if (!current_input_method) {
-    gchar *result_string = g_variant_print(result, TRUE);
+  fcitx = xsk_get_fcitx(xsk);
+  fcitx->is_updating = FALSE;
 
-    g_critical("Unexpected result: g_dbus_connection_call_sync(GetCurrentIM):"
-               " %s",
-               result_string);
-    g_free(result_string);
+  if (error) {
+    g_critical("Failed g_dbus_connection_call(GetCurrentIM): %s",
+               error->message);
+    g_error_free(error);
   } else {
-    gboolean is_excluded = _get_is_excluded(fcitx->excluded_input_methods,
-                                            current_input_method);
+    g_variant_get(result, "(s)", &current_input_method);
+    if (!current_input_method) {
+      gchar *result_string = g_variant_print(result, TRUE);
 
-    if (is_excluded && !xsk_is_excluded(xsk)) {
-      xsk_reset_state(xsk);
+      g_critical("Unexpected result: g_dbus_connection_call(GetCurrentIM):"
+                 " %s",
+                 result_string);
+      g_free(result_string);
+    } else {
+      if (fcitx->call_serial == fcitx->serial) {
+        _set_current_input_method(xsk, current_input_method);
+      }
+      g_free(current_input_method);
     }
-    fcitx->is_excluded = is_excluded;
-
-    debug_print("Input method changed: %s, excluded: %s",
-                current_input_method,
-                is_excluded ? "true" : "false");
-    g_free(current_input_method);
+    g_variant_unref(result);
   }
 
-  g_variant_unref(result);
+  if (fcitx->needs_update) {
+    _update(connection, xsk);
+  }
 }
 
-static gboolean _get_is_excluded(gchar **excluded_input_methods,
-                                 const gchar *current_input_method)
+static void _set_current_input_method(XSetKeys *xsk,
+                                      const gchar *current_input_method)
 {
-  for (; *excluded_input_methods; excluded_input_methods++) {
-    if (!g_strcmp0(*excluded_input_methods, current_input_method)) {
-      return TRUE;
-    }
+  Fcitx *fcitx = xsk_get_fcitx(xsk);
+  gboolean is_excluded = g_hash_table_contains(fcitx->excluded_input_methods,
+                                               current_input_method);
+
+  if (is_excluded && !xsk_is_excluded(xsk)) {
+    xsk_reset_state(xsk);
   }
-  return FALSE;
+  if (is_excluded != fcitx->is_excluded) {
+    metrics_count(METRICS_EXCLUSION_CHANGES);
+    trace_record(TRACE_EXCLUSION, TRACE_EXCLUSION_FCITX, 0, is_excluded);
+  }
+  fcitx->is_excluded = is_excluded;
+  probe1(fcitx_exclusion, is_excluded);
+
+  /* Elapsed time from the receipt of the signal, including the round trip
+     of GetCurrentIM if the signal did not carry the value.  The main loop
+     is blocked only while the handlers run, not while waiting the reply. */
+  debug_print("Input method changed: %s, excluded: %s, latency: %"
+              G_GINT64_FORMAT " us",
+              current_input_method,
+              is_excluded ? "true" : "false",
+              fcitx->signal_time
+              ? g_get_monotonic_time() - fcitx->signal_time : 0);
 }
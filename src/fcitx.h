@@ -25,10 +25,16 @@
 #include "x-set-keys.h"
 
 typedef struct Fcitx_ {
-  gchar **excluded_input_methods;
+  GHashTable *excluded_input_methods;
   GDBusConnection *connection;
   guint watch_id;
   guint subscription_id;
+  GCancellable *cancellable;
+  gboolean is_updating;
+  gboolean needs_update;
+  guint serial;
+  guint call_serial;
+  gint64 signal_time;
   gboolean is_excluded;
 } Fcitx;
 
@@ -18,11 +18,19 @@
  ***************************************************************************/
 
 #include "key-code-array.h"
+#include "metrics.h"
 
 static void _add_to_array_array(gpointer array, gpointer array_array);
 
+KeyCodeArray *key_code_array_new(guint reserved_size)
+{
+  metrics_gauge_add(METRICS_LIVE_KEY_CODE_ARRAYS, 1);
+  return g_array_sized_new(TRUE, FALSE, sizeof (KeyCode), reserved_size);
+}
+
 void key_code_array_free(gpointer array)
 {
+  metrics_gauge_add(METRICS_LIVE_KEY_CODE_ARRAYS, -1);
   g_array_free(array, TRUE);
 }
 
@@ -25,15 +25,19 @@
 
 typedef GArray KeyCodeArray;
 
-#define key_code_array_new(reserved_size)                               \
-  g_array_sized_new(TRUE, FALSE, sizeof (KeyCode), (reserved_size))
+/* Reserved size for arrays of pressed keys, which then never grow since
+ * they hold each valid key code at most once */
+#define KEY_CODE_ARRAY_MAX_LENGTH G_MAXUINT8
+
 #define key_code_array_add(array, key_code)             \
   (key_code_array_contains((array), (key_code))         \
    ? FALSE : g_array_append_val((array), (key_code)))
+#define key_code_array_clear(array) g_array_set_size((array), 0)
 #define key_code_array_get_at(array, index)   \
   g_array_index((array), KeyCode, (index))
 #define key_code_array_get_length(array) ((array)->len)
 
+KeyCodeArray *key_code_array_new(guint reserved_size);
 void key_code_array_free(gpointer array);
 gboolean key_code_array_remove(KeyCodeArray *array, KeyCode key_code);
 gboolean key_code_array_contains(const KeyCodeArray *array, KeyCode key_code);
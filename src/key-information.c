@@ -17,14 +17,38 @@
  *
  ***************************************************************************/
 
+#include <stdlib.h>
 #include <X11/keysym.h>
 #include <linux/input.h>
+#ifdef USE_XKBCOMMON
+#include <X11/Xatom.h>
+#include <xkbcommon/xkbcommon.h>
+#endif
 
 #include "common.h"
 #include "key-information.h"
+#include "metrics.h"
 
 #define _KEY_CODE_OFFSET 8
 #define _MODIFIER_PUNCTUATION '-'
+#define _KEY_CODE_NAME_PREFIX "KEY_"
+#define _RULES_NAMES_ATOM_NAME "_XKB_RULES_NAMES"
+#define _MAX_RULES_NAMES_LENGTH 1024
+
+G_STATIC_ASSERT(KI_NUM_MODIFIER == ENGINE_NUM_MODIFIERS);
+
+typedef struct _KeySymName_ {
+  const gchar *name;
+  KeySym key_sym;
+} _KeySymName;
+
+typedef struct _KeyCodeName_ {
+  const gchar *name;
+  guint16 key_code;
+} _KeyCodeName;
+
+/* _key_sym_names and _key_code_names generated by Makefile */
+#include "keysym-table.h"
 
 static const gchar *_modifier_names[] = {
   "alt",
@@ -36,26 +60,377 @@ static const gchar *_modifier_names[] = {
   "(unknown)"
 };
 
-static void _initialize_modifier_info(Display *display,
-                                      KeyInformation *key_info);
-static KIModifier _get_modifier_for_modmap_row(Display *display,
-                                               KeyInformation *key_info,
-                                               XModifierKeymap *modmap,
-                                               gint row);
-static KIModifier _get_modifier_for_key_code(Display *display,
+static const KIKeyboardMapping *_fixed_mapping;
+
+static gboolean _copy_keyboard_mapping(const KIKeyboardMapping *from,
+                                       KIKeyboardMapping *to);
+#ifdef USE_XKBCOMMON
+static gboolean _compile_keyboard_mapping(Display *display,
+                                          KIKeyboardMapping *mapping);
+static guchar *_get_rules_names(Display *display,
+                                struct xkb_rule_names *names);
+static gboolean _set_compiled_key_syms(struct xkb_keymap *keymap,
+                                       KIKeyboardMapping *mapping);
+static gboolean _set_compiled_modmap(struct xkb_keymap *keymap,
+                                     KIKeyboardMapping *mapping);
+#endif
+static void _initialize_modifier_info(KeyInformation *key_info,
+                                      const KIKeyboardMapping *mapping);
+static KIModifier
+_get_modifier_for_modmap_row(KeyInformation *key_info,
+                             const KIKeyboardMapping *mapping,
+                             gint row);
+static KIModifier _get_modifier_for_key_code(const KIKeyboardMapping *mapping,
                                              KeyCode key_code);
 static KIModifier _get_modifier_for_key_sym(KeySym key_sym);
 static KIModifier _get_modifier_for_char(char modifier_char);
 static void _set_modifier_info(KeyInformation *key_info,
                                KIModifier modifier,
-                               XModifierKeymap *modmap,
+                               const XModifierKeymap *modmap,
                                gint row);
-static void _initialize_cursor_info(Display *display, KeyInformation *key_info);
+static void _initialize_cursor_info(KeyInformation *key_info);
+static gint _compare_name(gconstpointer name, gconstpointer member);
+static KeySym _string_to_key_sym(const gchar *string);
+static KeyCode _string_to_key_code(const gchar *string);
+static KIModifier _get_defined_modifier(const KeyInformation *key_info,
+                                        KIModifier modifier);
+static KeyCode _key_sym_to_valid_key_code(const KIKeyboardMapping *mapping,
+                                          KeySym key_sym);
+static KeyCode _key_sym_to_key_code(const KIKeyboardMapping *mapping,
+                                    KeySym key_sym);
+
+/* Gets the whole keyboard mapping and the modifier mapping, so that the
+ * following functions need no more requests to X server. */
+gboolean ki_get_keyboard_mapping(Display *display, KIKeyboardMapping *mapping)
+{
+  if (_fixed_mapping) {
+    return _copy_keyboard_mapping(_fixed_mapping, mapping);
+  }
+#ifdef USE_XKBCOMMON
+  memset(mapping, 0, sizeof (*mapping));
+  if (_compile_keyboard_mapping(display, mapping)) {
+    mapping->is_local = TRUE;
+    return TRUE;
+  }
+  ki_free_keyboard_mapping(mapping);
+  g_warning("Use keyboard mapping of X server instead of compiled keymap");
+#endif
+  return ki_get_server_keyboard_mapping(display, mapping);
+}
+
+/* Gets the mappings by the core protocol requests even if the keymap can
+ * be compiled locally, for what is given back to X server. */
+gboolean ki_get_server_keyboard_mapping(Display *display,
+                                        KIKeyboardMapping *mapping)
+{
+  gint max_key_code;
+
+  memset(mapping, 0, sizeof (*mapping));
+  debug_print("Get keyboard mapping");
+
+  XDisplayKeycodes(display, &mapping->min_key_code, &max_key_code);
+  mapping->num_key_codes = max_key_code - mapping->min_key_code + 1;
+  metrics_counters[METRICS_X_ROUND_TRIPS] += 2;
+  mapping->key_syms = XGetKeyboardMapping(display,
+                                          mapping->min_key_code,
+                                          mapping->num_key_codes,
+                                          &mapping->key_syms_per_key_code);
+  if (!mapping->key_syms) {
+    print_error("XGetKeyboardMapping failed!");
+    return FALSE;
+  }
+  mapping->modmap = XGetModifierMapping(display);
+  if (!mapping->modmap) {
+    print_error("XGetModifierMapping failed!");
+    ki_free_keyboard_mapping(mapping);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* Makes ki_get_keyboard_mapping() return copies of `mapping' instead of
+ * the keyboard mapping of X server until it is called with NULL, so that
+ * replay.c resolves the configuration file as it was recorded. */
+void ki_set_fixed_keyboard_mapping(const KIKeyboardMapping *mapping)
+{
+  _fixed_mapping = mapping;
+}
+
+void ki_free_keyboard_mapping(KIKeyboardMapping *mapping)
+{
+  if (mapping->key_syms) {
+    XFree(mapping->key_syms);
+    mapping->key_syms = NULL;
+  }
+  if (mapping->modmap) {
+    XFreeModifiermap(mapping->modmap);
+    mapping->modmap = NULL;
+  }
+}
+
+static gboolean _copy_keyboard_mapping(const KIKeyboardMapping *from,
+                                       KIKeyboardMapping *to)
+{
+  gsize size = (gsize)from->num_key_codes * from->key_syms_per_key_code *
+    sizeof (KeySym);
+
+  *to = *from;
+  to->is_local = TRUE;
+  /* Allocated by malloc(3) and XNewModifiermap to be freed by XFree and
+     XFreeModifiermap as the ones got from X server */
+  to->key_syms = malloc(size);
+  to->modmap = XNewModifiermap(from->modmap->max_keypermod);
+  if (!to->key_syms || !to->modmap) {
+    print_error("Failed to copy keyboard mapping");
+    ki_free_keyboard_mapping(to);
+    return FALSE;
+  }
+  memcpy(to->key_syms, from->key_syms, size);
+  memcpy(to->modmap->modifiermap,
+         from->modmap->modifiermap,
+         8 * from->modmap->max_keypermod);
+  return TRUE;
+}
+
+#ifdef USE_XKBCOMMON
+/* Compiles the keymap named by the root window property locally with
+ * libxkbcommon, and converts it to the same tables as the core protocol
+ * requests return. */
+static gboolean _compile_keyboard_mapping(Display *display,
+                                          KIKeyboardMapping *mapping)
+{
+  struct xkb_rule_names names;
+  guchar *data;
+  struct xkb_context *context = NULL;
+  struct xkb_keymap *keymap = NULL;
+  gboolean result = FALSE;
+
+  data = _get_rules_names(display, &names);
+  if (!data) {
+    return FALSE;
+  }
+  debug_print("Compile keymap: rules=%s model=%s layout=%s variant=%s "
+              "options=%s",
+              names.rules,
+              names.model,
+              names.layout,
+              names.variant,
+              names.options);
+
+  context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+  if (!context) {
+    print_error("xkb_context_new failed!");
+    goto FINISH;
+  }
+  keymap = xkb_keymap_new_from_names(context,
+                                     &names,
+                                     XKB_KEYMAP_COMPILE_NO_FLAGS);
+  if (!keymap) {
+    print_error("xkb_keymap_new_from_names failed!");
+    goto FINISH;
+  }
+  result = _set_compiled_key_syms(keymap, mapping) &&
+    _set_compiled_modmap(keymap, mapping);
+
+ FINISH:
+  if (keymap) {
+    xkb_keymap_unref(keymap);
+  }
+  if (context) {
+    xkb_context_unref(context);
+  }
+  XFree(data);
+  return result;
+}
+
+/* Splits the value of _XKB_RULES_NAMES, which is rules, model, layout,
+ * variant and options separated by null characters. Returns the data to
+ * be freed by XFree, or NULL if the property is not available. */
+static guchar *_get_rules_names(Display *display,
+                                struct xkb_rule_names *names)
+{
+  Atom atom;
+  Atom type;
+  gint format;
+  gulong num_items;
+  gulong bytes_after;
+  guchar *data = NULL;
+  const gchar **fields[] = {
+    &names->rules,
+    &names->model,
+    &names->layout,
+    &names->variant,
+    &names->options
+  };
+  gulong offset = 0;
+  gint index;
+
+  metrics_counters[METRICS_X_ROUND_TRIPS] += 2;
+  atom = XInternAtom(display, _RULES_NAMES_ATOM_NAME, True);
+  if (atom == None) {
+    g_warning("%s is not defined", _RULES_NAMES_ATOM_NAME);
+    return NULL;
+  }
+  if (XGetWindowProperty(display,
+                         DefaultRootWindow(display),
+                         atom,
+                         0,
+                         _MAX_RULES_NAMES_LENGTH / 4,
+                         False,
+                         XA_STRING,
+                         &type,
+                         &format,
+                         &num_items,
+                         &bytes_after,
+                         &data) != Success || !data) {
+    g_warning("Can not get %s", _RULES_NAMES_ATOM_NAME);
+    return NULL;
+  }
+  if (type != XA_STRING || format != 8) {
+    g_warning("Unexpected type of %s", _RULES_NAMES_ATOM_NAME);
+    XFree(data);
+    return NULL;
+  }
 
-void ki_initialize(Display *display, KeyInformation *key_info)
+  /* XGetWindowProperty always appends a null character to the data */
+  for (index = 0; index < G_N_ELEMENTS(fields); index++) {
+    const gchar *field = offset < num_items ? (gchar *)data + offset : "";
+    *fields[index] = *field ? field : NULL;
+    offset += strlen(field) + 1;
+  }
+  return data;
+}
+
+/* The key symbols of all layouts are arranged in the order of layouts and
+ * then levels. Unlike the core protocol, the second and later layouts
+ * follow all levels of the first one, which affects only the preference
+ * among key codes having the same key symbol. */
+static gboolean _set_compiled_key_syms(struct xkb_keymap *keymap,
+                                       KIKeyboardMapping *mapping)
 {
-  _initialize_modifier_info(display, key_info);
-  _initialize_cursor_info(display, key_info);
+  xkb_keycode_t min_key_code = xkb_keymap_min_keycode(keymap);
+  xkb_keycode_t max_key_code = MIN(xkb_keymap_max_keycode(keymap),
+                                   G_MAXUINT8);
+  xkb_keycode_t key_code;
+
+  if (min_key_code > max_key_code) {
+    print_error("Compiled keymap has no key codes");
+    return FALSE;
+  }
+  mapping->min_key_code = min_key_code;
+  mapping->num_key_codes = max_key_code - min_key_code + 1;
+  mapping->key_syms_per_key_code = 1;
+  for (key_code = min_key_code; key_code <= max_key_code; key_code++) {
+    xkb_layout_index_t num_layouts =
+      xkb_keymap_num_layouts_for_key(keymap, key_code);
+    xkb_layout_index_t layout;
+    gint num_levels = 0;
+
+    for (layout = 0; layout < num_layouts; layout++) {
+      num_levels += xkb_keymap_num_levels_for_key(keymap, key_code, layout);
+    }
+    mapping->key_syms_per_key_code = MAX(mapping->key_syms_per_key_code,
+                                         num_levels);
+  }
+
+  /* Allocated by calloc(3) to be freed by XFree as XGetKeyboardMapping */
+  mapping->key_syms = calloc(mapping->num_key_codes *
+                             mapping->key_syms_per_key_code,
+                             sizeof (KeySym));
+  if (!mapping->key_syms) {
+    print_error("Failed to allocate key symbols");
+    return FALSE;
+  }
+  for (key_code = min_key_code; key_code <= max_key_code; key_code++) {
+    KeySym *key_syms = mapping->key_syms +
+      (key_code - min_key_code) * mapping->key_syms_per_key_code;
+    xkb_layout_index_t num_layouts =
+      xkb_keymap_num_layouts_for_key(keymap, key_code);
+    xkb_layout_index_t layout;
+
+    for (layout = 0; layout < num_layouts; layout++) {
+      xkb_level_index_t num_levels =
+        xkb_keymap_num_levels_for_key(keymap, key_code, layout);
+      xkb_level_index_t level;
+
+      for (level = 0; level < num_levels; level++) {
+        const xkb_keysym_t *syms;
+        if (xkb_keymap_key_get_syms_by_level(keymap,
+                                             key_code,
+                                             layout,
+                                             level,
+                                             &syms) > 0) {
+          *key_syms = syms[0];
+        }
+        key_syms++;
+      }
+    }
+  }
+  return TRUE;
+}
+
+/* Presses each key on a fresh keyboard state, and takes the real modifiers
+ * it activates as the row of the modifier mapping. */
+static gboolean _set_compiled_modmap(struct xkb_keymap *keymap,
+                                     KIKeyboardMapping *mapping)
+{
+  static const gchar *real_modifier_names[] = {
+    XKB_MOD_NAME_SHIFT,
+    XKB_MOD_NAME_CAPS,
+    XKB_MOD_NAME_CTRL,
+    "Mod1",
+    "Mod2",
+    "Mod3",
+    "Mod4",
+    "Mod5"
+  };
+  xkb_mod_index_t mod_indexes[G_N_ELEMENTS(real_modifier_names)];
+  gint row;
+  gint index;
+
+  for (row = 0; row < G_N_ELEMENTS(real_modifier_names); row++) {
+    mod_indexes[row] = xkb_keymap_mod_get_index(keymap,
+                                                real_modifier_names[row]);
+  }
+
+  mapping->modmap = XNewModifiermap(0);
+  if (!mapping->modmap) {
+    print_error("XNewModifiermap failed!");
+    return FALSE;
+  }
+  for (index = 0; index < mapping->num_key_codes; index++) {
+    KeyCode key_code = mapping->min_key_code + index;
+    struct xkb_state *state;
+    xkb_mod_mask_t mods;
+
+    state = xkb_state_new(keymap);
+    if (!state) {
+      print_error("xkb_state_new failed!");
+      return FALSE;
+    }
+    xkb_state_update_key(state, key_code, XKB_KEY_DOWN);
+    mods = xkb_state_serialize_mods(state, XKB_STATE_MODS_EFFECTIVE);
+    xkb_state_unref(state);
+
+    for (row = 0; row < G_N_ELEMENTS(mod_indexes); row++) {
+      if (mod_indexes[row] == XKB_MOD_INVALID ||
+          !(mods & (1 << mod_indexes[row]))) {
+        continue;
+      }
+      /* XInsertModifiermapEntry works locally without any requests */
+      mapping->modmap = XInsertModifiermapEntry(mapping->modmap,
+                                                key_code,
+                                                row);
+    }
+  }
+  return TRUE;
+}
+#endif
+
+void ki_initialize(KeyInformation *key_info, const KIKeyboardMapping *mapping)
+{
+  _initialize_modifier_info(key_info, mapping);
+  _initialize_cursor_info(key_info);
 }
 
 KeyCombination
@@ -64,79 +439,74 @@ ki_pressing_keys_to_key_combination(const KeyInformation *key_info,
                                     const KeyCodeArray *pressing_keys)
 {
   KeyCombination result;
-  KeyCode *pointer;
-  guchar modifiers = 0;
-  guchar mask;
-
-  for (pointer = &key_code_array_get_at(pressing_keys, 0);
-       *pointer;
-       pointer++) {
-    if (*pointer == key_code) {
-      continue;
-    }
-    mask = key_info->modifier_mask_or_key_kind[*pointer];
-    if (!mask || mask >= KI_KIND_MODIFIER_OTHER) {
-      continue;
-    }
-    modifiers |= mask;
-  }
+  guchar modifiers;
 
+  modifiers = engine_fold_modifiers(key_info,
+                                    key_code,
+                                    &key_code_array_get_at(pressing_keys, 0));
   key_combination_set_value(result, key_code, modifiers);
   return result;
 }
 
-KeyCombination ki_string_to_key_combination(Display *display,
-                                            const KeyInformation *key_info,
-                                            const gchar *string)
+/* Parses a key string such as "C-M-a" without the keyboard mapping, so
+ * that the result can be resolved again when the mapping is changed. */
+gboolean ki_string_to_key_spec(const gchar *string, KIKeySpec *key_spec)
 {
-  KeyCombination result;
-  KeyCode key_code;
-  guchar masks = 0;
   const gchar *pointer = string;
   gint length = strlen(string);
-  KeySym key_sym;
 
+  key_spec->modifiers = 0;
   while (length > 2 && pointer[1] == _MODIFIER_PUNCTUATION) {
     KIModifier modifier = _get_modifier_for_char(*pointer);
     if (modifier == KI_MODIFIER_OTHER) {
       g_critical("Illegal modifier character: %c", *pointer);
-      goto ERROR;
+      return FALSE;
     }
-    if (!key_info->modifier_key_code[modifier]) {
-      if (modifier == KI_MODIFIER_ALT &&
-          key_info->modifier_key_code[KI_MODIFIER_META]) {
-        modifier = KI_MODIFIER_META;
-      } else if (modifier == KI_MODIFIER_META &&
-                 key_info->modifier_key_code[KI_MODIFIER_ALT]) {
-        modifier = KI_MODIFIER_ALT;
-      } else {
-        g_critical("Modifier '%s' is not defined on your system",
-                   _modifier_names[modifier]);
-        goto ERROR;
-      }
-    }
-    masks |= (1 << modifier);
+    key_spec->modifiers |= (1 << modifier);
     pointer += 2;
     length -= 2;
   }
 
-  key_sym = XStringToKeysym(pointer);
-  if (key_sym == NoSymbol) {
+  key_spec->key_code = 0;
+  key_spec->key_sym = NoSymbol;
+  if (g_str_has_prefix(pointer, _KEY_CODE_NAME_PREFIX)) {
+    key_spec->key_code = _string_to_key_code(pointer);
+  } else {
+    key_spec->key_sym = _string_to_key_sym(pointer);
+  }
+  if (!key_spec->key_code && key_spec->key_sym == NoSymbol) {
     g_critical("Invalid key string: '%s'", pointer);
-    goto ERROR;
+    return FALSE;
   }
-  key_code = XKeysymToKeycode(display, key_sym);
-  if (!key_code) {
-    g_critical("Key '%s' is not defined on your system", pointer);
-    goto ERROR;
+  return TRUE;
+}
+
+KeyCombination
+ki_key_spec_to_key_combination(const KIKeyboardMapping *mapping,
+                               const KeyInformation *key_info,
+                               const KIKeySpec *key_spec)
+{
+  KeyCombination result;
+  KeyCode key_code;
+  guchar masks = 0;
+  KIModifier modifier;
+
+  for (modifier = 0; modifier < KI_NUM_MODIFIER; modifier++) {
+    if (key_spec->modifiers & (1 << modifier)) {
+      KIModifier defined = _get_defined_modifier(key_info, modifier);
+      if (defined == KI_MODIFIER_OTHER) {
+        goto ERROR;
+      }
+      masks |= (1 << defined);
+    }
   }
-  if (key_code <= _KEY_CODE_OFFSET) {
-    g_critical("Key code of '%s' is  out of range, key-code=%d",
-               pointer,
-               key_code);
+
+  key_code = key_spec->key_code
+    ? key_spec->key_code
+    : _key_sym_to_valid_key_code(mapping, key_spec->key_sym);
+  if (!key_code) {
     goto ERROR;
   }
-  key_code -= _KEY_CODE_OFFSET;
 
   key_combination_set_value(result, key_code, masks);
   return result;
@@ -146,57 +516,30 @@ KeyCombination ki_string_to_key_combination(Display *display,
   return result;
 }
 
-KeyCodeArray *ki_string_to_key_code_array(Display *display,
-                                          const KeyInformation *key_info,
-                                          const gchar *string)
+KeyCodeArray *ki_key_spec_to_key_code_array(const KIKeyboardMapping *mapping,
+                                            const KeyInformation *key_info,
+                                            const KIKeySpec *key_spec)
 {
   KeyCodeArray *result = key_code_array_new(4);
-  const gchar *pointer = string;
-  gint length = strlen(string);
   KeyCode key_code;
-  KeySym key_sym;
+  KIModifier modifier;
 
-  while (length > 2 && pointer[1] == _MODIFIER_PUNCTUATION) {
-    KIModifier modifier = _get_modifier_for_char(*pointer);
-    if (modifier == KI_MODIFIER_OTHER) {
-      g_critical("Illegal modifier character: %c", *pointer);
-      goto ERROR;
-    }
-    if (!key_info->modifier_key_code[modifier]) {
-      if (modifier == KI_MODIFIER_ALT &&
-          key_info->modifier_key_code[KI_MODIFIER_META]) {
-        modifier = KI_MODIFIER_META;
-      } else if (modifier == KI_MODIFIER_META &&
-                 key_info->modifier_key_code[KI_MODIFIER_ALT]) {
-        modifier = KI_MODIFIER_ALT;
-      } else {
-        g_critical("Modifier '%s' is not defined on your system",
-                   _modifier_names[modifier]);
+  for (modifier = 0; modifier < KI_NUM_MODIFIER; modifier++) {
+    if (key_spec->modifiers & (1 << modifier)) {
+      KIModifier defined = _get_defined_modifier(key_info, modifier);
+      if (defined == KI_MODIFIER_OTHER) {
         goto ERROR;
       }
+      key_code_array_add(result, key_info->modifier_key_code[defined]);
     }
-    key_code_array_add(result, key_info->modifier_key_code[modifier]);
-    pointer += 2;
-    length -= 2;
   }
 
-  key_sym = XStringToKeysym(pointer);
-  if (key_sym == NoSymbol) {
-    g_critical("Invalid key string: '%s'", pointer);
-    goto ERROR;
-  }
-  key_code = XKeysymToKeycode(display, key_sym);
+  key_code = key_spec->key_code
+    ? key_spec->key_code
+    : _key_sym_to_valid_key_code(mapping, key_spec->key_sym);
   if (!key_code) {
-    g_critical("Key '%s' is not defined on your system", pointer);
-    goto ERROR;
-  }
-  if (key_code <= _KEY_CODE_OFFSET) {
-    g_critical("Key code of '%s' is  out of range, key-code=%d",
-               pointer,
-               key_code);
     goto ERROR;
   }
-  key_code -= _KEY_CODE_OFFSET;
 
   key_code_array_add(result, key_code);
   return result;
@@ -210,26 +553,41 @@ gboolean ki_contains_modifier(const KeyInformation *key_info,
                               const KeyCodeArray *keys,
                               KIModifier modifier)
 {
-  KeyCode *pointer;
+  return engine_has_modifier(key_info,
+                             &key_code_array_get_at(keys, 0),
+                             modifier);
+}
 
-  for (pointer = &key_code_array_get_at(keys, 0); *pointer; pointer++) {
-    if (key_info->modifier_mask_or_key_kind[*pointer] == (1 << modifier)) {
-      return TRUE;
-    }
+/* The tables of key names are generated at build time from the headers of
+ * the build host, so that key names may resolve differently in another
+ * build. */
+void ki_update_checksum(GChecksum *checksum)
+{
+  gsize index;
+
+  for (index = 0; index < array_num(_key_sym_names); index++) {
+    g_checksum_update(checksum,
+                      (const guchar *)_key_sym_names[index].name,
+                      strlen(_key_sym_names[index].name) + 1);
+    g_checksum_update(checksum,
+                      (const guchar *)&_key_sym_names[index].key_sym,
+                      sizeof (_key_sym_names[index].key_sym));
+  }
+  for (index = 0; index < array_num(_key_code_names); index++) {
+    g_checksum_update(checksum,
+                      (const guchar *)_key_code_names[index].name,
+                      strlen(_key_code_names[index].name) + 1);
+    g_checksum_update(checksum,
+                      (const guchar *)&_key_code_names[index].key_code,
+                      sizeof (_key_code_names[index].key_code));
   }
-  return FALSE;
 }
 
-static void _initialize_modifier_info(Display *display,
-                                      KeyInformation *key_info)
+static void _initialize_modifier_info(KeyInformation *key_info,
+                                      const KIKeyboardMapping *mapping)
 {
   gint row;
-  XModifierKeymap *modmap = XGetModifierMapping(display);
-
-  if (!modmap) {
-    print_error("XGetModifierMapping failed!");
-    return;
-  }
+  const XModifierKeymap *modmap = mapping->modmap;
 
   if (!modmap->max_keypermod) {
     g_warning("Max number of keys per modifier is zero!");
@@ -240,22 +598,20 @@ static void _initialize_modifier_info(Display *display,
     _set_modifier_info(key_info, KI_MODIFIER_CONTROL, modmap, 2);
 
     for (row = 3; row < 8; row++) {
-      KIModifier modifier = _get_modifier_for_modmap_row(display,
-                                                         key_info,
-                                                         modmap,
+      KIModifier modifier = _get_modifier_for_modmap_row(key_info,
+                                                         mapping,
                                                          row);
       _set_modifier_info(key_info, modifier, modmap, row);
     }
   }
-
-  XFreeModifiermap(modmap);
 }
 
-static KIModifier _get_modifier_for_modmap_row(Display *display,
-                                               KeyInformation *key_info,
-                                               XModifierKeymap *modmap,
-                                               gint row)
+static KIModifier
+_get_modifier_for_modmap_row(KeyInformation *key_info,
+                             const KIKeyboardMapping *mapping,
+                             gint row)
 {
+  const XModifierKeymap *modmap = mapping->modmap;
   KIModifier modifier;
   gint col;
 
@@ -264,7 +620,7 @@ static KIModifier _get_modifier_for_modmap_row(Display *display,
     if (!key_code) {
       continue;
     }
-    modifier = _get_modifier_for_key_code(display, key_code);
+    modifier = _get_modifier_for_key_code(mapping, key_code);
     if (modifier == KI_MODIFIER_OTHER) {
       continue;
     }
@@ -279,18 +635,20 @@ static KIModifier _get_modifier_for_modmap_row(Display *display,
   return KI_MODIFIER_OTHER;
 }
 
-static KIModifier _get_modifier_for_key_code(Display *display, KeyCode key_code)
+static KIModifier _get_modifier_for_key_code(const KIKeyboardMapping *mapping,
+                                             KeyCode key_code)
 {
   KIModifier modifier = KI_MODIFIER_OTHER;
-  KeySym *key_syms;
-  gint num_key_sym;
+  const KeySym *key_syms;
   gint index;
 
-  key_syms = XGetKeyboardMapping(display, key_code, 1, &num_key_sym);
-  if (!key_syms) {
+  if (key_code < mapping->min_key_code ||
+      key_code >= mapping->min_key_code + mapping->num_key_codes) {
     return modifier;
   }
-  for (index = 0; index < num_key_sym; index++) {
+  key_syms = mapping->key_syms +
+    (key_code - mapping->min_key_code) * mapping->key_syms_per_key_code;
+  for (index = 0; index < mapping->key_syms_per_key_code; index++) {
     if (key_syms[index] != NoSymbol) {
       modifier = _get_modifier_for_key_sym(key_syms[index]);
       if (modifier != KI_MODIFIER_OTHER) {
@@ -298,7 +656,6 @@ static KIModifier _get_modifier_for_key_code(Display *display, KeyCode key_code)
       }
     }
   }
-  XFree(key_syms);
   return modifier;
 }
 
@@ -346,7 +703,7 @@ static KIModifier _get_modifier_for_char(char modifier_char)
 
 static void _set_modifier_info(KeyInformation *key_info,
                                KIModifier modifier,
-                               XModifierKeymap *modmap,
+                               const XModifierKeymap *modmap,
                                gint row)
 {
   gint col;
@@ -376,7 +733,7 @@ static void _set_modifier_info(KeyInformation *key_info,
   }
 }
 
-static void _initialize_cursor_info(Display *display, KeyInformation *key_info)
+static void _initialize_cursor_info(KeyInformation *key_info)
 {
   KeyCode key_codes[] = {
     KEY_HOME,
@@ -395,3 +752,95 @@ static void _initialize_cursor_info(Display *display, KeyInformation *key_info)
     key_info->modifier_mask_or_key_kind[*pointer] = KI_KIND_CURSOR;
   }
 }
+
+static gint _compare_name(gconstpointer name, gconstpointer member)
+{
+  return strcmp(name, *(const gchar * const *)member);
+}
+
+/* The generated table is searched first, which is much faster than
+ * XStringToKeysym().  The latter is still used for the other names such
+ * as "XF86AudioMute" or "U20AC". */
+static KeySym _string_to_key_sym(const gchar *string)
+{
+  const _KeySymName *found = bsearch(string,
+                                     _key_sym_names,
+                                     array_num(_key_sym_names),
+                                     sizeof (*_key_sym_names),
+                                     _compare_name);
+
+  return found ? found->key_sym : XStringToKeysym(string);
+}
+
+/* Linux input event code such as "KEY_F13", independent of the keyboard
+ * mapping of X */
+static KeyCode _string_to_key_code(const gchar *string)
+{
+  const _KeyCodeName *found = bsearch(string,
+                                      _key_code_names,
+                                      array_num(_key_code_names),
+                                      sizeof (*_key_code_names),
+                                      _compare_name);
+
+  if (!found || !ki_is_valid_key_code(found->key_code)) {
+    return 0;
+  }
+  return found->key_code;
+}
+
+/* Alt and Meta substitute for each other if only one of them is defined */
+static KIModifier _get_defined_modifier(const KeyInformation *key_info,
+                                        KIModifier modifier)
+{
+  if (key_info->modifier_key_code[modifier]) {
+    return modifier;
+  }
+  if (modifier == KI_MODIFIER_ALT &&
+      key_info->modifier_key_code[KI_MODIFIER_META]) {
+    return KI_MODIFIER_META;
+  }
+  if (modifier == KI_MODIFIER_META &&
+      key_info->modifier_key_code[KI_MODIFIER_ALT]) {
+    return KI_MODIFIER_ALT;
+  }
+  g_critical("Modifier '%s' is not defined on your system",
+             _modifier_names[modifier]);
+  return KI_MODIFIER_OTHER;
+}
+
+static KeyCode _key_sym_to_valid_key_code(const KIKeyboardMapping *mapping,
+                                          KeySym key_sym)
+{
+  KeyCode key_code = _key_sym_to_key_code(mapping, key_sym);
+
+  if (!key_code) {
+    g_critical("Key '%s' is not defined on your system",
+               XKeysymToString(key_sym));
+    return 0;
+  }
+  if (key_code <= _KEY_CODE_OFFSET) {
+    g_critical("Key code of '%s' is  out of range, key-code=%d",
+               XKeysymToString(key_sym),
+               key_code);
+    return 0;
+  }
+  return key_code - _KEY_CODE_OFFSET;
+}
+
+/* Same order as XKeysymToKeycode(), the first column is searched first */
+static KeyCode _key_sym_to_key_code(const KIKeyboardMapping *mapping,
+                                    KeySym key_sym)
+{
+  gint col;
+  gint index;
+
+  for (col = 0; col < mapping->key_syms_per_key_code; col++) {
+    for (index = 0; index < mapping->num_key_codes; index++) {
+      if (mapping->key_syms[index * mapping->key_syms_per_key_code + col]
+          == key_sym) {
+        return mapping->min_key_code + index;
+      }
+    }
+  }
+  return 0;
+}
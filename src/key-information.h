@@ -23,6 +23,7 @@
 #include <X11/Xlib.h>
 #include <glib.h>
 
+#include "engine.h"
 #include "key-combination.h"
 #include "key-code-array.h"
 
@@ -37,43 +38,66 @@ typedef enum KIModifier_ {
   KI_MODIFIER_OTHER = 6
 } KIModifier;
 
-#define KI_KIND_MODIFIER_OTHER (1 << KI_MODIFIER_OTHER)
-#define KI_KIND_CURSOR (KI_KIND_MODIFIER_OTHER + 1)
-
-typedef struct KeyInformation_ {
-  KeyCode modifier_key_code[KI_NUM_MODIFIER];
-  guchar modifier_mask_or_key_kind[G_MAXUINT8];
-} KeyInformation;
-
-void ki_initialize(Display *display, KeyInformation *key_info);
+#define KI_KIND_MODIFIER_OTHER ENGINE_KIND_MODIFIER_OTHER
+#define KI_KIND_CURSOR ENGINE_KIND_CURSOR
+
+/* Local copy of the keyboard mapping and the modifier mapping of X */
+typedef struct KIKeyboardMapping_ {
+  gint min_key_code;
+  gint num_key_codes;
+  gint key_syms_per_key_code;
+  KeySym *key_syms;
+  XModifierKeymap *modmap;
+  /* Compiled locally or given by ki_set_fixed_keyboard_mapping(), which is
+     not what X server has */
+  gboolean is_local;
+} KIKeyboardMapping;
+
+/* Key string of the configuration file before resolved to key codes.
+ * `key_code' is given instead of `key_sym' for a "KEY_*" name. */
+typedef struct KIKeySpec_ {
+  KeySym key_sym;
+  KeyCode key_code;
+  guchar modifiers;
+} KIKeySpec;
+
+typedef EngineKeyTable KeyInformation;
+
+gboolean ki_get_keyboard_mapping(Display *display, KIKeyboardMapping *mapping);
+gboolean ki_get_server_keyboard_mapping(Display *display,
+                                        KIKeyboardMapping *mapping);
+void ki_set_fixed_keyboard_mapping(const KIKeyboardMapping *mapping);
+void ki_free_keyboard_mapping(KIKeyboardMapping *mapping);
+
+void ki_initialize(KeyInformation *key_info, const KIKeyboardMapping *mapping);
 
 KeyCombination
 ki_pressing_keys_to_key_combination(const KeyInformation *key_info,
                                     KeyCode key_code,
                                     const KeyCodeArray *pressing_keys);
 
-KeyCombination ki_string_to_key_combination(Display *display,
-                                            const KeyInformation *key_info,
-                                            const gchar *string);
+gboolean ki_string_to_key_spec(const gchar *string, KIKeySpec *key_spec);
 
-KeyCodeArray *ki_string_to_key_code_array(Display *display,
-                                          const KeyInformation *key_info,
-                                          const gchar *string);
+KeyCombination
+ki_key_spec_to_key_combination(const KIKeyboardMapping *mapping,
+                               const KeyInformation *key_info,
+                               const KIKeySpec *key_spec);
+
+KeyCodeArray *ki_key_spec_to_key_code_array(const KIKeyboardMapping *mapping,
+                                            const KeyInformation *key_info,
+                                            const KIKeySpec *key_spec);
 
 gboolean ki_contains_modifier(const KeyInformation *key_info,
                               const KeyCodeArray *keys,
                               KIModifier modifier);
-
-#define ki_is_modifier(key_info, key_code)                              \
-  ((key_info)->modifier_mask_or_key_kind[key_code] &&                   \
-   (key_info)->modifier_mask_or_key_kind[key_code] <= KI_KIND_MODIFIER_OTHER)
-
-#define ki_is_regular_modifier(key_info, key_code)                      \
-  ((key_info)->modifier_mask_or_key_kind[key_code] &&                   \
-   (key_info)->modifier_mask_or_key_kind[key_code] < KI_KIND_MODIFIER_OTHER)
-
-#define ki_is_cursor(key_info, key_code)                                \
-  ((key_info)->modifier_mask_or_key_kind[key_code] == KI_KIND_CURSOR)
+void ki_update_checksum(GChecksum *checksum);
+
+#define ki_is_modifier(key_info, key_code)      \
+  engine_is_modifier((key_info), (key_code))
+#define ki_is_regular_modifier(key_info, key_code)      \
+  engine_is_regular_modifier((key_info), (key_code))
+#define ki_is_cursor(key_info, key_code)        \
+  engine_is_cursor((key_info), (key_code))
 
 #define ki_get_modifier_key_code(key_info, modifier)    \
   ((key_info)->modifier_key_code[modifier])
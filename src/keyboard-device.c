@@ -19,6 +19,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -26,6 +27,11 @@
 #include "common.h"
 #include "keyboard-device.h"
 #include "uinput-device.h"
+#include "latency.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
+#include "recorder.h"
 
 #define _USEC_PER_SEC  1000000ul
 #define _USEC_PER_MSEC    1000ul
@@ -42,8 +48,11 @@ static gboolean _get_ev_bits(gint fd, guint8 ev_bits[]);
 static gboolean _get_key_bits(gint fd, guint8 key_bits[]);
 static gboolean _handle_input(gpointer user_data);
 static gboolean _handle_event(XSetKeys *xsk, struct input_event *event);
-static gboolean _is_after_repeat_delay(Display *display,
-                                       XkbDescPtr xkb,
+static void _update_repeat_controls(Display *display, KeyboardDevice *device);
+static void _set_repeat_controls(KeyboardDevice *device,
+                                 guint repeat_delay,
+                                 guint repeat_interval);
+static gboolean _is_after_repeat_delay(KeyboardDevice *device,
                                        struct timeval *t1,
                                        const struct timeval *t2);
 
@@ -51,6 +60,7 @@ KeyboardDevice *kd_initialize(XSetKeys *xsk, const gchar *device_filepath)
 {
   gint fd;
   KeyboardDevice *device;
+  clockid_t clock_id = CLOCK_MONOTONIC;
 
   fd = _open_device_file(device_filepath);
   if (fd < 0) {
@@ -66,6 +76,13 @@ KeyboardDevice *kd_initialize(XSetKeys *xsk, const gchar *device_filepath)
     device_finalize(&device->device);
     return NULL;
   }
+  /* Timestamps of input events are compared with the monotonic clock to
+     record the latency, see latency.c */
+  if (ioctl(fd, EVIOCSCLOCKID, &clock_id) < 0) {
+    g_warning("Failed to set clock of keyboard device to monotonic");
+  } else {
+    latency_set_clock(clock_id);
+  }
   if (ioctl(fd, EVIOCGRAB, 1) < 0) {
     print_error("Failed to grab keyboard device");
     device_finalize(&device->device);
@@ -77,7 +94,32 @@ KeyboardDevice *kd_initialize(XSetKeys *xsk, const gchar *device_filepath)
     device_finalize(&device->device);
     return NULL;
   }
-  device->pressing_keys = key_code_array_new(6);
+  device->pressing_keys = key_code_array_new(KEY_CODE_ARRAY_MAX_LENGTH);
+  _update_repeat_controls(xsk_get_display(xsk), device);
+  return device;
+}
+
+/* Keyboard device fed by kd_replay_event() instead of a device file.  The
+ * eventfd only keeps the source of the main loop, it never gets readable.
+ * No X display is used, the repeat controls are given by
+ * kd_set_repeat_controls(). */
+KeyboardDevice *kd_initialize_replay(XSetKeys *xsk)
+{
+  gint fd;
+  KeyboardDevice *device;
+
+  fd = eventfd(0, EFD_CLOEXEC);
+  if (fd < 0) {
+    print_error("Failed to create eventfd for replay");
+    return NULL;
+  }
+  device = (KeyboardDevice *)device_initialize(fd,
+                                               "replayed keyboard device",
+                                               sizeof (KeyboardDevice),
+                                               _handle_input,
+                                               xsk);
+  device->is_replay = TRUE;
+  device->pressing_keys = key_code_array_new(KEY_CODE_ARRAY_MAX_LENGTH);
   return device;
 }
 
@@ -85,7 +127,8 @@ void kd_finalize(XSetKeys *xsk)
 {
   KeyboardDevice *device = xsk_get_keyboard_device(xsk);
 
-  if (ioctl(device_get_fd(&device->device), EVIOCGRAB, 0) < 0) {
+  if (!device->is_replay &&
+      ioctl(device_get_fd(&device->device), EVIOCGRAB, 0) < 0) {
     print_error("Failed to ungrab keyboard device");
   }
   if (device->pressing_keys) {
@@ -112,6 +155,40 @@ gboolean kd_get_key_bits(XSetKeys *xsk, guint8 key_bits[])
   return _get_key_bits(device_get_fd(&device->device), key_bits);
 }
 
+/* Handles a recorded event as if it were read from the device.  The
+ * latency is not recorded, since the timestamp is the one of recording.
+ * The event is recorded again with --record-file, so that a replay makes
+ * a record file of the outputs of this build. */
+gboolean kd_replay_event(XSetKeys *xsk, struct input_event *event)
+{
+  gboolean result;
+
+  metrics_count(METRICS_EVENTS_READ);
+  trace_record(TRACE_EVENT_READ, event->type, event->code, event->value);
+  recorder_record(RECORDER_DIRECTION_INPUT, event);
+  probe3(handle_event, event->type, event->code, event->value);
+  result = _handle_event(xsk, event);
+  probe1(handle_event_done, result);
+  return result;
+}
+
+/* Called on XkbControlsNotify, see window-system.c */
+void kd_update_repeat_controls(XSetKeys *xsk)
+{
+  _update_repeat_controls(xsk_get_display(xsk),
+                          xsk_get_keyboard_device(xsk));
+}
+
+/* Sets the repeat controls saved in a record file, see replay.c */
+void kd_set_repeat_controls(XSetKeys *xsk,
+                            guint repeat_delay,
+                            guint repeat_interval)
+{
+  _set_repeat_controls(xsk_get_keyboard_device(xsk),
+                       repeat_delay,
+                       repeat_interval);
+}
+
 gboolean kd_get_led_bits(XSetKeys *xsk, guint8 led_bits[])
 {
   KeyboardDevice *device = xsk_get_keyboard_device(xsk);
@@ -240,6 +317,7 @@ static gboolean _handle_input(gpointer user_data)
   KeyboardDevice *device;
   gssize length;
   struct input_event event;
+  gboolean result;
 
   xsk = user_data;
   device = xsk_get_keyboard_device(xsk);
@@ -254,14 +332,16 @@ static gboolean _handle_input(gpointer user_data)
                sizeof (event));
     return FALSE;
   }
-
-#ifdef TRACE
-  debug_print("Read from keyboard : type=%02x code=%d value=%d",
-              event.type,
-              event.code,
-              event.value);
-#endif
-  return _handle_event(xsk, &event);
+  metrics_count(METRICS_EVENTS_READ);
+  trace_record(TRACE_EVENT_READ, event.type, event.code, event.value);
+  recorder_record(RECORDER_DIRECTION_INPUT, &event);
+
+  latency_begin();
+  probe3(handle_event, event.type, event.code, event.value);
+  result = _handle_event(xsk, &event);
+  probe1(handle_event_done, result);
+  latency_end(&event.time);
+  return result;
 }
 
 static gboolean _handle_event(XSetKeys *xsk, struct input_event *event)
@@ -294,8 +374,7 @@ static gboolean _handle_event(XSetKeys *xsk, struct input_event *event)
       }
       break;
     default:
-      is_after_repeat_delay = _is_after_repeat_delay(xsk_get_display(xsk),
-                                                     device->xkb,
+      is_after_repeat_delay = _is_after_repeat_delay(device,
                                                      &device->press_start_time,
                                                      &event->time);
       switch (xsk_handle_key_repeat(xsk, event->code, is_after_repeat_delay)) {
@@ -312,28 +391,51 @@ static gboolean _handle_event(XSetKeys *xsk, struct input_event *event)
   return ud_send_event(xsk, event);
 }
 
-static gboolean _is_after_repeat_delay(Display *display,
-                                       XkbDescPtr xkb,
-                                       struct timeval *t1,
-                                       const struct timeval *t2)
+/* The repeat controls are kept in `device', so that repeated key events
+ * are handled without a round trip to X server. */
+static void _update_repeat_controls(Display *display, KeyboardDevice *device)
 {
+  XkbDescPtr xkb = device->xkb;
+
+  metrics_count(METRICS_X_ROUND_TRIPS);
   if (XkbGetControls(display,
                      XkbRepeatKeysMask|XkbControlsEnabledMask,
                      xkb) != Success) {
     g_warning("XkbGetControls() failed");
-    return FALSE;
+    _set_repeat_controls(device, 0, 0);
+    return;
   }
+  _set_repeat_controls(device,
+                       xkb->ctrls->enabled_ctrls & XkbRepeatKeysMask
+                       ? xkb->ctrls->repeat_delay : 0,
+                       xkb->ctrls->repeat_interval);
+}
 
-  if (!(xkb->ctrls->enabled_ctrls & XkbRepeatKeysMask)) {
+/* A delay of 0 turns autorepeat off, which X server never sets otherwise.
+ * The controls are kept in the record file for replay.c. */
+static void _set_repeat_controls(KeyboardDevice *device,
+                                 guint repeat_delay,
+                                 guint repeat_interval)
+{
+  device->repeat_delay = repeat_delay;
+  device->repeat_interval = repeat_interval;
+  recorder_keep_repeat_controls(repeat_delay, repeat_interval);
+}
+
+static gboolean _is_after_repeat_delay(KeyboardDevice *device,
+                                       struct timeval *t1,
+                                       const struct timeval *t2)
+{
+  if (!device->repeat_delay) {
     return FALSE;
   }
 
   if (t2->tv_sec < t1->tv_sec ||
       (t2->tv_sec == t1->tv_sec && t2->tv_usec < t1->tv_usec) ||
-      _ELAPSED_USEC(t1, t2) < xkb->ctrls->repeat_delay * _USEC_PER_MSEC) {
+      _ELAPSED_USEC(t1, t2) < device->repeat_delay * _USEC_PER_MSEC) {
     return FALSE;
   }
-  t1->tv_usec += xkb->ctrls->repeat_interval * _USEC_PER_MSEC;
+  t1->tv_usec += device->repeat_interval * _USEC_PER_MSEC;
   while (t1->tv_usec >= _USEC_PER_SEC) {
     t1->tv_sec++;
     t1->tv_usec -= _USEC_PER_SEC;
@@ -31,10 +31,19 @@ typedef struct KeyboardDevice_ {
   KeyCodeArray *pressing_keys;
   struct timeval press_start_time;
   XkbDescPtr xkb;
+  guint repeat_delay;
+  guint repeat_interval;
+  gboolean is_replay;
 } KeyboardDevice;
 
 KeyboardDevice *kd_initialize(XSetKeys *xsk, const gchar *device_filepath);
+KeyboardDevice *kd_initialize_replay(XSetKeys *xsk);
 void kd_finalize(XSetKeys *xsk);
+gboolean kd_replay_event(XSetKeys *xsk, struct input_event *event);
+void kd_update_repeat_controls(XSetKeys *xsk);
+void kd_set_repeat_controls(XSetKeys *xsk,
+                            guint repeat_delay,
+                            guint repeat_interval);
 
 #define KD_EV_BITS_LENGTH (EV_MAX/8 + 1)
 gboolean kd_get_ev_bits(XSetKeys *xsk, guint8 ev_bits[]);
@@ -0,0 +1,206 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+#include "common.h"
+#include "latency.h"
+
+/* Log-linear buckets like HDR histograms: values below _NUM_SUB_BUCKETS
+ * have a bucket each, and every power of two above is divided into
+ * _NUM_SUB_BUCKETS buckets, so the relative error is at most 1/8. */
+#define _SUB_BUCKET_BITS 3
+#define _NUM_SUB_BUCKETS (1 << _SUB_BUCKET_BITS)
+#define _NUM_BUCKETS ((32 - _SUB_BUCKET_BITS + 1) * _NUM_SUB_BUCKETS)
+
+typedef struct _Histogram_ {
+  guint64 counts[_NUM_BUCKETS];
+  guint64 total_count;
+  guint64 total_value;
+  guint32 max_value;
+} _Histogram;
+
+static const gchar *_class_names[] = {
+  "passthrough",
+  "remap",
+  "multi-event",
+  "selection"
+};
+
+const gdouble latency_percentiles[LATENCY_NUM_PERCENTILES] = {
+  50.0, 90.0, 99.0, 99.9
+};
+
+/* Only the main loop touches these, so no locking is needed */
+static _Histogram _histograms[LATENCY_NUM_CLASSES];
+static clockid_t _clock_id = CLOCK_REALTIME;
+static LatencyClass _current_class;
+static gboolean _is_written;
+
+static guint _get_bucket(guint32 value);
+static guint32 _get_bucket_upper_bound(guint bucket);
+static void _print_histogram(LatencyClass latency_class);
+
+/* Sets the clock of the timestamps of input events */
+void latency_set_clock(clockid_t clock_id)
+{
+  _clock_id = clock_id;
+}
+
+/* Starts handling an input event, which is passed through unless
+ * latency_set_class() is called */
+void latency_begin()
+{
+  _current_class = LATENCY_CLASS_PASSTHROUGH;
+  _is_written = FALSE;
+}
+
+void latency_set_class(LatencyClass latency_class)
+{
+  _current_class = latency_class;
+}
+
+/* Called on each write to the uinput device.  Input events causing no
+ * writes, such as the prefix keys of multi stroke actions, are not
+ * recorded. */
+void latency_set_written()
+{
+  _is_written = TRUE;
+}
+
+/* Records the time from the timestamp of the input event to now, when all
+ * events for it have been written to the uinput device */
+void latency_end(const struct timeval *event_time)
+{
+  _Histogram *histogram;
+  struct timespec now;
+  gint64 elapsed;
+  guint32 value;
+
+  if (!_is_written) {
+    return;
+  }
+  _is_written = FALSE;
+  histogram = &_histograms[_current_class];
+  if (clock_gettime(_clock_id, &now)) {
+    return;
+  }
+  elapsed = (now.tv_sec - event_time->tv_sec) * G_GINT64_CONSTANT(1000000) +
+    now.tv_nsec / 1000 - event_time->tv_usec;
+  value = CLAMP(elapsed, 0, G_MAXUINT32);
+
+  histogram->counts[_get_bucket(value)]++;
+  histogram->total_count++;
+  histogram->total_value += value;
+  if (value > histogram->max_value) {
+    histogram->max_value = value;
+  }
+}
+
+void latency_print()
+{
+  LatencyClass latency_class;
+
+  for (latency_class = 0;
+       latency_class < LATENCY_NUM_CLASSES;
+       latency_class++) {
+    _print_histogram(latency_class);
+  }
+}
+
+const gchar *latency_get_class_name(LatencyClass latency_class)
+{
+  return _class_names[latency_class];
+}
+
+/* The percentiles are the upper bounds of their buckets, but never above
+ * the maximum value */
+void latency_get_summary(LatencyClass latency_class, LatencySummary *summary)
+{
+  const _Histogram *histogram = &_histograms[latency_class];
+  guint64 count = 0;
+  guint bucket = 0;
+  gint index;
+
+  summary->count = histogram->total_count;
+  summary->sum = histogram->total_value;
+  summary->max = histogram->max_value;
+  for (index = 0; index < LATENCY_NUM_PERCENTILES; index++) {
+    guint64 threshold =
+      MAX(histogram->total_count * latency_percentiles[index] / 100.0, 1);
+
+    while (bucket < _NUM_BUCKETS - 1 &&
+           count + histogram->counts[bucket] < threshold) {
+      count += histogram->counts[bucket++];
+    }
+    summary->percentiles[index] = MIN(_get_bucket_upper_bound(bucket),
+                                      histogram->max_value);
+  }
+}
+
+static guint _get_bucket(guint32 value)
+{
+  gint magnitude;
+
+  if (value < _NUM_SUB_BUCKETS) {
+    return value;
+  }
+  magnitude = g_bit_storage(value) - 1 - _SUB_BUCKET_BITS;
+  return (magnitude + 1) * _NUM_SUB_BUCKETS +
+    ((value >> magnitude) & (_NUM_SUB_BUCKETS - 1));
+}
+
+static guint32 _get_bucket_upper_bound(guint bucket)
+{
+  gint magnitude;
+  guint64 lower_bound;
+
+  if (bucket < _NUM_SUB_BUCKETS) {
+    return bucket;
+  }
+  magnitude = bucket / _NUM_SUB_BUCKETS - 1;
+  lower_bound =
+    (guint64)(_NUM_SUB_BUCKETS + bucket % _NUM_SUB_BUCKETS) << magnitude;
+  return MIN(lower_bound + (G_GUINT64_CONSTANT(1) << magnitude) - 1,
+             G_MAXUINT32);
+}
+
+static void _print_histogram(LatencyClass latency_class)
+{
+  LatencySummary summary;
+  GString *string;
+  gint index;
+
+  latency_get_summary(latency_class, &summary);
+  if (!summary.count) {
+    g_message("Latency of %s: no events", _class_names[latency_class]);
+    return;
+  }
+  string = g_string_new(NULL);
+  for (index = 0; index < LATENCY_NUM_PERCENTILES; index++) {
+    g_string_append_printf(string,
+                           " p%g=%u",
+                           latency_percentiles[index],
+                           summary.percentiles[index]);
+  }
+  g_message("Latency of %s: events=%" G_GUINT64_FORMAT "%s max=%u (us)",
+            _class_names[latency_class],
+            summary.count,
+            string->str,
+            summary.max);
+  g_string_free(string, TRUE);
+}
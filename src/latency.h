@@ -0,0 +1,58 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+#ifndef _LATENCY_H
+#define _LATENCY_H
+
+#include <sys/time.h>
+#include <time.h>
+#include <glib.h>
+
+/* How an input event was handled, which decides the histogram its
+ * time-in-daemon is recorded to */
+typedef enum LatencyClass_ {
+  LATENCY_CLASS_PASSTHROUGH = 0,
+  LATENCY_CLASS_REMAP = 1,
+  LATENCY_CLASS_MULTI_EVENT = 2,
+  LATENCY_CLASS_SELECTION = 3
+#define LATENCY_NUM_CLASSES (LATENCY_CLASS_SELECTION+1)
+} LatencyClass;
+
+#define LATENCY_NUM_PERCENTILES 4
+
+typedef struct LatencySummary_ {
+  guint64 count;
+  guint64 sum;
+  guint32 max;
+  guint32 percentiles[LATENCY_NUM_PERCENTILES];
+} LatencySummary;
+
+/* 50, 90, 99 and 99.9 */
+extern const gdouble latency_percentiles[LATENCY_NUM_PERCENTILES];
+
+void latency_set_clock(clockid_t clock_id);
+void latency_begin();
+void latency_set_class(LatencyClass latency_class);
+void latency_set_written();
+void latency_end(const struct timeval *event_time);
+void latency_print();
+const gchar *latency_get_class_name(LatencyClass latency_class);
+void latency_get_summary(LatencyClass latency_class, LatencySummary *summary);
+
+#endif /* _LATENCY_H */
@@ -28,18 +28,29 @@
 #include "common.h"
 #include "x-set-keys.h"
 #include "config.h"
+#include "latency.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
+#include "recorder.h"
+#include "replay.h"
 
 typedef struct _Arguments_ {
   gchar *config_filepath;
   gchar *device_filepath;
   gchar **excluded_classes;
   gchar **excluded_fcitx_input_methods;
+  gchar *metrics_socket_path;
+  gchar *record_filepath;
+  gchar *replay_filepath;
+  gchar *trace_filepath;
 } _Arguments;
 
 static volatile gboolean _caught_sigint = FALSE;
 static volatile gboolean _caught_sigterm = FALSE;
 static volatile gboolean _caught_sighup = FALSE;
 static volatile gboolean _caught_sigusr1 = FALSE;
+static volatile gboolean _caught_sigusr2 = FALSE;
 static volatile gboolean _error_occurred = FALSE;
 static jmp_buf _xio_error_env;
 
@@ -52,10 +63,12 @@ static gboolean _handle_signal(gpointer flag_pointer);
 static gint _handle_x_error(Display *display, XErrorEvent *event);
 static gint _handle_xio_error(Display *display);
 static gboolean _run(const _Arguments *arguments);
+static void _dump_statistics(const gchar *trace_filepath);
 
 gint main(gint argc, gchar *argv[])
 {
   _Arguments arguments = { 0 };
+  MetricsServer *metrics_server = NULL;
   gint error_retry_count = 0;
 
   g_set_prgname(g_path_get_basename(argv[0]));
@@ -69,25 +82,58 @@ gint main(gint argc, gchar *argv[])
   g_unix_signal_add(SIGTERM, _handle_signal, (gpointer)&_caught_sigterm);
   g_unix_signal_add(SIGHUP, _handle_signal, (gpointer)&_caught_sighup);
   g_unix_signal_add(SIGUSR1, _handle_signal, (gpointer)&_caught_sigusr1);
+  g_unix_signal_add(SIGUSR2, _handle_signal, (gpointer)&_caught_sigusr2);
 
   XSetErrorHandler(_handle_x_error);
   XSetIOErrorHandler(_handle_xio_error);
 
+  if (arguments.metrics_socket_path) {
+    metrics_server = metrics_server_initialize(arguments.metrics_socket_path);
+    if (!metrics_server) {
+      _free_arguments(&arguments);
+      return EXIT_FAILURE;
+    }
+  }
+  if (arguments.record_filepath &&
+      !recorder_initialize(arguments.record_filepath)) {
+    if (metrics_server) {
+      metrics_server_finalize(metrics_server);
+    }
+    _free_arguments(&arguments);
+    return EXIT_FAILURE;
+  }
+  if (arguments.replay_filepath &&
+      !replay_open(arguments.replay_filepath)) {
+    recorder_finalize();
+    if (metrics_server) {
+      metrics_server_finalize(metrics_server);
+    }
+    _free_arguments(&arguments);
+    return EXIT_FAILURE;
+  }
+
   while (_run(&arguments)) {
     if (_error_occurred) {
       if (++error_retry_count > 10) {
         g_critical("Maximum error retry count exceeded");
         break;
       }
+      metrics_count(METRICS_ERROR_RETRIES);
       g_usleep(G_USEC_PER_SEC);
       _error_occurred = FALSE;
     } else {
       error_retry_count = 0;
     }
+    metrics_count(METRICS_RESTARTS);
     g_message("Restarting");
   }
 
   g_message("Exiting");
+  replay_close();
+  recorder_finalize();
+  if (metrics_server) {
+    metrics_server_finalize(metrics_server);
+  }
   _free_arguments(&arguments);
   return _error_occurred ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -124,6 +170,26 @@ static gboolean _parse_arguments(gint argc,
       &arguments->excluded_fcitx_input_methods,
       "Exclude input method of fcitx (Can be specified multiple times)",
       "<inputmethod>"
+    }, {
+      "metrics-socket", 'm', 0, G_OPTION_ARG_FILENAME,
+      &arguments->metrics_socket_path,
+      "Serve metrics in Prometheus text format on Unix socket",
+      "<socketfile>"
+    }, {
+      "record-file", 'r', 0, G_OPTION_ARG_FILENAME,
+      &arguments->record_filepath,
+      "Record input events read and written to file",
+      "<recordfile>"
+    }, {
+      "replay-file", 'p', 0, G_OPTION_ARG_FILENAME,
+      &arguments->replay_filepath,
+      "Replay input events of record file instead of keyboard device, and exit",
+      "<recordfile>"
+    }, {
+      "trace-file", 't', 0, G_OPTION_ARG_FILENAME,
+      &arguments->trace_filepath,
+      "Write last input events to file on SIGUSR2",
+      "<tracefile>"
     }, {
       NULL
     }
@@ -173,6 +239,18 @@ static void _free_arguments( _Arguments *arguments)
   if (arguments->excluded_fcitx_input_methods) {
     g_strfreev(arguments->excluded_fcitx_input_methods);
   }
+  if (arguments->metrics_socket_path) {
+    g_free(arguments->metrics_socket_path);
+  }
+  if (arguments->record_filepath) {
+    g_free(arguments->record_filepath);
+  }
+  if (arguments->replay_filepath) {
+    g_free(arguments->replay_filepath);
+  }
+  if (arguments->trace_filepath) {
+    g_free(arguments->trace_filepath);
+  }
 }
 
 static gboolean _handle_signal(gpointer flag_pointer)
@@ -211,22 +289,36 @@ static gboolean _run(const _Arguments *arguments)
     is_restart = FALSE;
   }
 
-  if (!_error_occurred && !xsk_initialize(&xsk, arguments->excluded_classes)) {
+  if (!_error_occurred &&
+      !xsk_initialize(&xsk,
+                      arguments->excluded_classes,
+                      arguments->replay_filepath != NULL)) {
     _error_occurred = TRUE;
     if (xsk_get_display(&xsk)) {
       is_restart = TRUE;
     }
   }
-  if (!_error_occurred && !config_load(&xsk, arguments->config_filepath)) {
-    _error_occurred = TRUE;
+  if (!_error_occurred) {
+    probe0(load_config);
+    if (!config_load(&xsk, arguments->config_filepath)) {
+      _error_occurred = TRUE;
+    }
+    probe1(load_config_done, !_error_occurred);
   }
-  if (!_error_occurred && !xsk_start(&xsk,
-                                     arguments->device_filepath,
-                                     arguments->excluded_fcitx_input_methods)) {
+  if (!_error_occurred &&
+      !xsk_start(&xsk,
+                 arguments->device_filepath,
+                 arguments->excluded_fcitx_input_methods,
+                 arguments->replay_filepath != NULL)) {
     _error_occurred = TRUE;
   }
 
-  if (!_error_occurred) {
+  if (!_error_occurred && arguments->replay_filepath) {
+    /* Shut down after replaying, even on mismatches */
+    if (!replay_run(&xsk)) {
+      _error_occurred = TRUE;
+    }
+  } else if (!_error_occurred) {
     debug_print("Starting main loop");
     _caught_sighup = FALSE;
     while (!_caught_sigint &&
@@ -236,13 +328,17 @@ static gboolean _run(const _Arguments *arguments)
       g_main_context_iteration(NULL, TRUE);
       if (_caught_sigusr1 && !_error_occurred) {
         g_message("Keyboard mapping changed");
-        xsk_mapping_changed(&xsk);
-        if (!_error_occurred &&
-            !config_load(&xsk, arguments->config_filepath)) {
+        probe0(reload_mapping);
+        if (!config_reload_mapping(&xsk)) {
           _error_occurred = TRUE;
         }
+        probe1(reload_mapping_done, !_error_occurred);
         _caught_sigusr1 = FALSE;
       }
+      if (_caught_sigusr2) {
+        _dump_statistics(arguments->trace_filepath);
+        _caught_sigusr2 = FALSE;
+      }
     }
     is_restart = TRUE;
     if (_caught_sigint) {
@@ -267,3 +363,13 @@ static gboolean _run(const _Arguments *arguments)
   xsk_finalize(&xsk, is_restart);
   return is_restart;
 }
+
+/* The trace holds typed keys, so that it is written only to the file given
+ * by the option */
+static void _dump_statistics(const gchar *trace_filepath)
+{
+  latency_print();
+  if (trace_filepath && trace_dump(trace_filepath)) {
+    g_message("Trace written: %s", trace_filepath);
+  }
+}
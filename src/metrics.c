@@ -0,0 +1,296 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "metrics.h"
+#include "latency.h"
+
+#define _NAME_PREFIX "x_set_keys_"
+#define _LISTEN_BACKLOG 4
+
+typedef struct _Metric_ {
+  const gchar *name;
+  const gchar *label;
+  const gchar *help;
+} _Metric;
+
+/* Indexed by MetricsCounter, counters of the same name are adjacent */
+static const _Metric _metrics[] = {
+  { "events_read_total", NULL,
+    "Input events read from the keyboard device." },
+  { "events_written_total", NULL,
+    "Input events written to the uinput device." },
+  { "syscalls_total", NULL,
+    "Reads and writes of devices." },
+  { "actions_total", "type=\"key\"",
+    "Actions fired by type." },
+  { "actions_total", "type=\"multi_stroke\"", NULL },
+  { "actions_total", "type=\"selection\"", NULL },
+  { "key_sequences_canceled_total", NULL,
+    "Multi stroke key sequences canceled by an undefined key." },
+  { "selection_mode_toggles_total", NULL,
+    "Toggles of selection mode." },
+  { "exclusion_changes_total", NULL,
+    "Changes of exclusion by the focus window or the fcitx input method." },
+  { "focus_changes_total", NULL,
+    "Changes of the active window." },
+  { "focus_update_microseconds_total", NULL,
+    "Time from changes of the active window to updates of the exclusion." },
+  { "x_round_trips_total", NULL,
+    "X requests waiting for a reply." },
+  { "fcitx_calls_total", NULL,
+    "D-Bus method calls to fcitx." },
+  { "restarts_total", NULL,
+    "Restarts of the main loop." },
+  { "error_retries_total", NULL,
+    "Restarts of the main loop caused by errors." }
+};
+
+/* Indexed by MetricsGauge */
+static const _Metric _gauges[] = {
+  { "live_actions", NULL,
+    "Actions allocated, including the ones of multi stroke keys." },
+  { "live_action_nodes", NULL,
+    "Entries of action lists." },
+  { "live_key_code_arrays", NULL,
+    "Arrays of key codes allocated." }
+};
+
+static gboolean _handle_connection(gpointer user_data);
+static GString *_format_metrics();
+static void _format_metric(GString *text,
+                           const _Metric *metric,
+                           const gchar *type,
+                           gint64 value);
+static gint64 _get_resident_memory();
+static void _format_latency(GString *text);
+
+/* Serves the counters in the Prometheus text format to each connection to
+ * the socket.  The counters are kept across restarts of the main loop. */
+MetricsServer *metrics_server_initialize(const gchar *socket_path)
+{
+  gint fd;
+  struct sockaddr_un address;
+  struct stat st;
+  mode_t original_umask;
+  gboolean is_bound;
+  MetricsServer *server;
+
+  if (strlen(socket_path) >= sizeof (address.sun_path)) {
+    g_critical("Too long metrics socket path: %s", socket_path);
+    return NULL;
+  }
+  memset(&address, 0, sizeof (address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socket_path);
+
+  /* A socket left by the previous process is replaced */
+  if (!lstat(socket_path, &st) && S_ISSOCK(st.st_mode)) {
+    unlink(socket_path);
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    print_error("Failed to create metrics socket");
+    return NULL;
+  }
+  /* Only root can connect, since the counters tell the typing activity */
+  original_umask = umask(0177);
+  is_bound = bind(fd, (struct sockaddr *)&address, sizeof (address)) == 0;
+  umask(original_umask);
+  if (!is_bound || listen(fd, _LISTEN_BACKLOG) < 0) {
+    print_error("Failed to listen on %s", socket_path);
+    close(fd);
+    return NULL;
+  }
+
+  server = (MetricsServer *)device_initialize(fd,
+                                              "metrics socket",
+                                              sizeof (MetricsServer),
+                                              _handle_connection,
+                                              NULL);
+  server->socket_path = g_strdup(socket_path);
+  g_source_set_callback(&server->device.source,
+                        _handle_connection,
+                        server,
+                        NULL);
+  return server;
+}
+
+void metrics_server_finalize(MetricsServer *server)
+{
+  unlink(server->socket_path);
+  g_free(server->socket_path);
+  device_close(&server->device);
+  device_finalize(&server->device);
+}
+
+/* Failures are only logged, so that they never restart x-set-keys.  The
+ * text fits in the socket buffer, so that a client which does not take it
+ * at once is slow and dropped instead of blocking the main loop. */
+static gboolean _handle_connection(gpointer user_data)
+{
+  MetricsServer *server = user_data;
+  gint fd;
+  GString *text;
+  gsize offset = 0;
+
+  fd = accept4(device_get_fd(&server->device),
+               NULL,
+               NULL,
+               SOCK_CLOEXEC | SOCK_NONBLOCK);
+  if (fd < 0) {
+    if (errno != EAGAIN && errno != EINTR) {
+      print_error("Failed to accept connection to metrics socket");
+    }
+    return TRUE;
+  }
+
+  text = _format_metrics();
+  while (offset < text->len) {
+    gssize written = send(fd,
+                          text->str + offset,
+                          text->len - offset,
+                          MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN) {
+        g_warning("Metrics client dropped after %" G_GSIZE_FORMAT
+                  " of %" G_GSIZE_FORMAT " bytes",
+                  offset,
+                  text->len);
+      } else {
+        print_error("Failed to write metrics");
+      }
+      break;
+    }
+    offset += written;
+  }
+  g_string_free(text, TRUE);
+  close(fd);
+  return TRUE;
+}
+
+static GString *_format_metrics()
+{
+  static const _Metric resident_memory = {
+    "resident_memory_bytes", NULL, "Resident set size of the process."
+  };
+  GString *text = g_string_new(NULL);
+  gint64 resident_memory_bytes;
+  gint index;
+
+  for (index = 0; index < METRICS_NUM_COUNTERS; index++) {
+    _format_metric(text, &_metrics[index], "counter", metrics_counters[index]);
+  }
+  for (index = 0; index < METRICS_NUM_GAUGES; index++) {
+    _format_metric(text, &_gauges[index], "gauge", metrics_gauges[index]);
+  }
+  resident_memory_bytes = _get_resident_memory();
+  if (resident_memory_bytes >= 0) {
+    _format_metric(text, &resident_memory, "gauge", resident_memory_bytes);
+  }
+  _format_latency(text);
+  return text;
+}
+
+static void _format_metric(GString *text,
+                           const _Metric *metric,
+                           const gchar *type,
+                           gint64 value)
+{
+  if (metric->help) {
+    g_string_append_printf(text,
+                           "# HELP " _NAME_PREFIX "%s %s\n"
+                           "# TYPE " _NAME_PREFIX "%s %s\n",
+                           metric->name,
+                           metric->help,
+                           metric->name,
+                           type);
+  }
+  g_string_append_printf(text,
+                         _NAME_PREFIX "%s%s%s%s %" G_GINT64_FORMAT "\n",
+                         metric->name,
+                         metric->label ? "{" : "",
+                         metric->label ? metric->label : "",
+                         metric->label ? "}" : "",
+                         value);
+}
+
+/* Returns -1 if /proc is not available */
+static gint64 _get_resident_memory()
+{
+  gchar *contents;
+  gint64 pages = -1;
+
+  if (!g_file_get_contents("/proc/self/statm", &contents, NULL, NULL)) {
+    return -1;
+  }
+  if (sscanf(contents, "%*s %" G_GINT64_FORMAT, &pages) != 1) {
+    pages = -1;
+  }
+  g_free(contents);
+  return pages < 0 ? -1 : pages * sysconf(_SC_PAGESIZE);
+}
+
+/* The latency histograms of latency.c as a summary labeled by class */
+static void _format_latency(GString *text)
+{
+  LatencyClass latency_class;
+  LatencySummary summary;
+  gint index;
+
+  g_string_append(text,
+                  "# HELP " _NAME_PREFIX "latency_microseconds"
+                  " Time from input events to writes to the uinput device.\n"
+                  "# TYPE " _NAME_PREFIX "latency_microseconds summary\n");
+  for (latency_class = 0;
+       latency_class < LATENCY_NUM_CLASSES;
+       latency_class++) {
+    const gchar *name = latency_get_class_name(latency_class);
+
+    latency_get_summary(latency_class, &summary);
+    for (index = 0; index < LATENCY_NUM_PERCENTILES; index++) {
+      g_string_append_printf(text,
+                             _NAME_PREFIX "latency_microseconds"
+                             "{class=\"%s\",quantile=\"%g\"} %u\n",
+                             name,
+                             latency_percentiles[index] / 100.0,
+                             summary.percentiles[index]);
+    }
+    g_string_append_printf(text,
+                           _NAME_PREFIX "latency_microseconds_sum"
+                           "{class=\"%s\"} %" G_GUINT64_FORMAT "\n"
+                           _NAME_PREFIX "latency_microseconds_count"
+                           "{class=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                           name,
+                           summary.sum,
+                           name,
+                           summary.count);
+  }
+}
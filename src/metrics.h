@@ -0,0 +1,74 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include "device.h"
+
+typedef enum MetricsCounter_ {
+  METRICS_EVENTS_READ,
+  METRICS_EVENTS_WRITTEN,
+  METRICS_SYSCALLS,
+  METRICS_KEY_ACTIONS,
+  METRICS_MULTI_STROKE_ACTIONS,
+  METRICS_SELECTION_ACTIONS,
+  METRICS_KEY_SEQUENCES_CANCELED,
+  METRICS_SELECTION_MODE_TOGGLES,
+  METRICS_EXCLUSION_CHANGES,
+  METRICS_FOCUS_CHANGES,
+  METRICS_FOCUS_UPDATE_MICROSECONDS,
+  METRICS_X_ROUND_TRIPS,
+  METRICS_FCITX_CALLS,
+  METRICS_RESTARTS,
+  METRICS_ERROR_RETRIES,
+#define METRICS_NUM_COUNTERS (METRICS_ERROR_RETRIES+1)
+} MetricsCounter;
+
+/* Numbers of live objects, which must not grow over reloads */
+typedef enum MetricsGauge_ {
+  METRICS_LIVE_ACTIONS,
+  METRICS_LIVE_ACTION_NODES,
+  METRICS_LIVE_KEY_CODE_ARRAYS,
+#define METRICS_NUM_GAUGES (METRICS_LIVE_KEY_CODE_ARRAYS+1)
+} MetricsGauge;
+
+typedef struct MetricsServer_ {
+  Device device;
+  gchar *socket_path;
+} MetricsServer;
+
+#ifndef MAIN
+extern
+#endif
+guint64 metrics_counters[METRICS_NUM_COUNTERS];
+
+#ifndef MAIN
+extern
+#endif
+gint64 metrics_gauges[METRICS_NUM_GAUGES];
+
+/* Counters are only updated from the main loop, plain increments suffice */
+#define metrics_count(counter) (metrics_counters[counter]++)
+#define metrics_gauge_add(gauge, value) (metrics_gauges[gauge] += (value))
+
+MetricsServer *metrics_server_initialize(const gchar *socket_path);
+void metrics_server_finalize(MetricsServer *server);
+
+#endif  /* _METRICS_H */
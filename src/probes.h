@@ -0,0 +1,40 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+#ifndef _PROBES_H
+#define _PROBES_H
+
+/* USDT probes of the provider x_set_keys, enabled by building with
+ * CDEFS=-DUSE_SDT.  An unattached probe is a single nop instruction, and
+ * the probes expand to nothing otherwise. */
+#ifdef USE_SDT
+#include <sys/sdt.h>
+
+#define probe0(name) STAP_PROBE(x_set_keys, name)
+#define probe1(name, a1) STAP_PROBE1(x_set_keys, name, a1)
+#define probe2(name, a1, a2) STAP_PROBE2(x_set_keys, name, a1, a2)
+#define probe3(name, a1, a2, a3) STAP_PROBE3(x_set_keys, name, a1, a2, a3)
+#else
+#define probe0(name)
+#define probe1(name, a1)
+#define probe2(name, a1, a2)
+#define probe3(name, a1, a2, a3)
+#endif
+
+#endif /* _PROBES_H */
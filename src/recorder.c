@@ -0,0 +1,308 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "recorder.h"
+
+/* Records are queued in the ring by the event handlers, and copied to
+ * the mapped file by a low priority timeout, which also extends the file
+ * ahead by the size of the ring.  A ring filled before the timeout is
+ * copied at once to that room without extending the file, and records are
+ * dropped only if there is no room. */
+#define _RING_SIZE 4096
+#define _FLUSH_INTERVAL 100
+#define _FILE_CHUNK_SIZE (1024 * 1024)
+#define _align(size) (((size) + 7) & ~7)
+#define _get_offset(header, num_records)                                \
+  ((header)->header_size + (num_records) * sizeof (RecorderRecord))
+
+typedef struct _Recorder_ {
+  gint fd;
+  gchar *filepath;
+  guint8 *map;
+  gsize map_size;
+  guint flush_timeout_id;
+  guint64 num_dropped;
+  guint ring_start;
+  guint ring_length;
+  RecorderRecord ring[_RING_SIZE];
+} _Recorder;
+
+static _Recorder _recorder = { -1 };
+
+static gboolean _flush(gpointer user_data);
+static gboolean _copy_ring(gboolean can_extend);
+static void _stop();
+static void _close();
+static gboolean _map_file(gsize size);
+
+gboolean recorder_initialize(const gchar *filepath)
+{
+  RecorderHeader *header;
+  struct stat st;
+
+  /* Created anew, since typed keys must not be left readable in an
+     existing file nor written through a symbolic link */
+  if (!lstat(filepath, &st) && !S_ISDIR(st.st_mode) && unlink(filepath) < 0) {
+    print_error("Failed to remove old record file: %s", filepath);
+    return FALSE;
+  }
+  _recorder.fd = open(filepath,
+                      O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                      0600);
+  if (_recorder.fd < 0) {
+    print_error("Failed to create record file: %s", filepath);
+    return FALSE;
+  }
+  _recorder.filepath = g_strdup(filepath);
+  if (!_map_file(sizeof (RecorderHeader))) {
+    _close();
+    return FALSE;
+  }
+  header = (RecorderHeader *)_recorder.map;
+  memcpy(header->magic, RECORDER_MAGIC, sizeof (header->magic));
+  header->version = RECORDER_VERSION;
+  header->header_size = sizeof (RecorderHeader);
+  header->record_size = sizeof (RecorderRecord);
+
+  _recorder.flush_timeout_id = g_timeout_add_full(G_PRIORITY_LOW,
+                                                  _FLUSH_INTERVAL,
+                                                  _flush,
+                                                  NULL,
+                                                  NULL);
+  return TRUE;
+}
+
+void recorder_finalize()
+{
+  if (_recorder.flush_timeout_id) {
+    g_source_remove(_recorder.flush_timeout_id);
+    _recorder.flush_timeout_id = 0;
+    _copy_ring(TRUE);
+  }
+  _close();
+}
+
+/* Writes the keyboard mapping used to load the configuration file, so that
+ * replay.c resolves it the same.  Only the first one is kept, and only
+ * before any event is recorded. */
+void recorder_keep_keyboard_mapping(const KIKeyboardMapping *mapping)
+{
+  RecorderHeader *header = (RecorderHeader *)_recorder.map;
+  gsize header_size;
+  guint32 *key_syms;
+  gsize index;
+
+  if (_recorder.fd < 0 ||
+      header->header_size != sizeof (RecorderHeader) ||
+      header->num_records ||
+      _recorder.ring_length) {
+    return;
+  }
+  header->min_key_code = mapping->min_key_code;
+  header->num_key_codes = mapping->num_key_codes;
+  header->key_syms_per_key_code = mapping->key_syms_per_key_code;
+  header->max_keypermod = mapping->modmap->max_keypermod;
+  header_size = _align(sizeof (RecorderHeader) +
+                       recorder_get_key_syms_size(header) +
+                       recorder_get_modmap_size(header));
+  if (!_map_file(header_size)) {
+    _stop();
+    return;
+  }
+  header = (RecorderHeader *)_recorder.map;
+
+  key_syms = (guint32 *)(header + 1);
+  for (index = 0;
+       index < (gsize)mapping->num_key_codes * mapping->key_syms_per_key_code;
+       index++) {
+    key_syms[index] = mapping->key_syms[index];
+  }
+  memcpy((guint8 *)key_syms + recorder_get_key_syms_size(header),
+         mapping->modmap->modifiermap,
+         recorder_get_modmap_size(header));
+  header->header_size = header_size;
+}
+
+/* Writes the repeat controls of the keyboard device, so that replay.c
+ * tells repeated keys after the delay the same.  Only the ones before any
+ * event is recorded are kept. */
+void recorder_keep_repeat_controls(guint repeat_delay, guint repeat_interval)
+{
+  RecorderHeader *header = (RecorderHeader *)_recorder.map;
+
+  if (_recorder.fd < 0 || header->num_records || _recorder.ring_length) {
+    return;
+  }
+  header->repeat_delay = repeat_delay;
+  header->repeat_interval = repeat_interval;
+}
+
+/* For loops which do not return to the main loop, such as replay_run() */
+void recorder_flush()
+{
+  if (_recorder.fd >= 0 &&
+      _recorder.ring_length >= _RING_SIZE / 2 &&
+      !_copy_ring(TRUE)) {
+    _stop();
+  }
+}
+
+/* Only queues the event unless the ring is full */
+void recorder_record(guint8 direction, const struct input_event *event)
+{
+  RecorderRecord *record;
+
+  if (_recorder.fd < 0) {
+    return;
+  }
+  if (_recorder.ring_length == _RING_SIZE && !_copy_ring(FALSE)) {
+    _recorder.num_dropped++;
+    return;
+  }
+  record = &_recorder.ring[(_recorder.ring_start + _recorder.ring_length++)
+                           % _RING_SIZE];
+  memset(record, 0, sizeof (*record));
+  /* An input keeps the timestamp of the keyboard device, which replay.c
+     gives back to tell repeated keys after the delay the same */
+  record->time = direction == RECORDER_DIRECTION_INPUT
+    ? event->time.tv_sec * G_USEC_PER_SEC + event->time.tv_usec
+    : g_get_monotonic_time();
+  record->value = event->value;
+  record->type = event->type;
+  record->code = event->code;
+  record->direction = direction;
+}
+
+static gboolean _flush(gpointer user_data)
+{
+  if (!_copy_ring(TRUE)) {
+    _recorder.flush_timeout_id = 0;
+    _stop();
+    return G_SOURCE_REMOVE;
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+/* Copies the ring to the mapped file, extended to leave room for another
+ * ring if `can_extend', otherwise fails if the mapping has no room. */
+static gboolean _copy_ring(gboolean can_extend)
+{
+  RecorderHeader *header = (RecorderHeader *)_recorder.map;
+  gsize offset;
+
+  offset = _get_offset(header, header->num_records + _recorder.ring_length);
+  if (can_extend) {
+    if (!_map_file(offset + _RING_SIZE * sizeof (RecorderRecord))) {
+      return FALSE;
+    }
+    header = (RecorderHeader *)_recorder.map;
+  } else if (offset > _recorder.map_size) {
+    return FALSE;
+  }
+
+  offset = _get_offset(header, header->num_records);
+  while (_recorder.ring_length > 0) {
+    guint length = MIN(_recorder.ring_length,
+                       _RING_SIZE - _recorder.ring_start);
+
+    memcpy(_recorder.map + offset,
+           &_recorder.ring[_recorder.ring_start],
+           length * sizeof (RecorderRecord));
+    offset += length * sizeof (RecorderRecord);
+    header->num_records += length;
+    _recorder.ring_start = (_recorder.ring_start + length) % _RING_SIZE;
+    _recorder.ring_length -= length;
+  }
+  header->num_dropped = _recorder.num_dropped;
+  return TRUE;
+}
+
+static void _stop()
+{
+  g_critical("Stop recording to %s", _recorder.filepath);
+  if (_recorder.flush_timeout_id) {
+    g_source_remove(_recorder.flush_timeout_id);
+    _recorder.flush_timeout_id = 0;
+  }
+  _close();
+}
+
+/* Truncates the file to the records written, so that the file is complete
+ * without the trailing unused space of the mapping */
+static void _close()
+{
+  if (_recorder.map) {
+    const RecorderHeader *header = (const RecorderHeader *)_recorder.map;
+
+    if (ftruncate(_recorder.fd,
+                  _get_offset(header, header->num_records)) < 0) {
+      print_error("Failed to truncate record file: %s", _recorder.filepath);
+    }
+    munmap(_recorder.map, _recorder.map_size);
+    _recorder.map = NULL;
+    _recorder.map_size = 0;
+  }
+  if (_recorder.fd >= 0) {
+    close(_recorder.fd);
+    _recorder.fd = -1;
+  }
+  g_free(_recorder.filepath);
+  _recorder.filepath = NULL;
+}
+
+/* Extends the file and the mapping by chunks to hold `size' bytes */
+static gboolean _map_file(gsize size)
+{
+  gsize map_size = _recorder.map_size;
+
+  if (size <= map_size) {
+    return TRUE;
+  }
+  while (map_size < size) {
+    map_size += _FILE_CHUNK_SIZE;
+  }
+  if (ftruncate(_recorder.fd, map_size) < 0) {
+    print_error("Failed to extend record file: %s", _recorder.filepath);
+    return FALSE;
+  }
+  if (_recorder.map) {
+    munmap(_recorder.map, _recorder.map_size);
+    _recorder.map = NULL;
+    _recorder.map_size = 0;
+  }
+  _recorder.map = mmap(NULL,
+                       map_size,
+                       PROT_READ | PROT_WRITE,
+                       MAP_SHARED,
+                       _recorder.fd,
+                       0);
+  if (_recorder.map == MAP_FAILED) {
+    print_error("Failed to map record file: %s", _recorder.filepath);
+    _recorder.map = NULL;
+    return FALSE;
+  }
+  _recorder.map_size = map_size;
+  return TRUE;
+}
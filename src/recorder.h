@@ -0,0 +1,75 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+#ifndef _RECORDER_H
+#define _RECORDER_H
+
+#include <linux/input.h>
+#include <glib.h>
+
+#include "key-information.h"
+
+#define RECORDER_MAGIC "XSKR"
+#define RECORDER_VERSION 2
+
+#define RECORDER_DIRECTION_INPUT 0
+#define RECORDER_DIRECTION_OUTPUT 1
+
+/* Layout of the record file, in the byte order of the host.  See the
+ * "Record file" section of README.md.  The header is followed by the key
+ * symbols and the modifier map of the keyboard mapping, which are included
+ * in `header_size'.  The repeat controls are in milliseconds, with a delay
+ * of 0 if autorepeat is off. */
+typedef struct RecorderHeader_ {
+  gchar magic[4];
+  guint32 version;
+  guint32 header_size;
+  guint32 record_size;
+  guint64 num_records;
+  guint64 num_dropped;
+  guint32 min_key_code;
+  guint32 num_key_codes;
+  guint32 key_syms_per_key_code;
+  guint32 max_keypermod;
+  guint32 repeat_delay;
+  guint32 repeat_interval;
+} RecorderHeader;
+
+#define recorder_get_key_syms_size(header)                              \
+  ((gsize)(header)->num_key_codes * (header)->key_syms_per_key_code *   \
+   sizeof (guint32))
+#define recorder_get_modmap_size(header) (8 * (gsize)(header)->max_keypermod)
+
+typedef struct RecorderRecord_ {
+  gint64 time;
+  gint32 value;
+  guint16 type;
+  guint16 code;
+  guint8 direction;
+  guint8 reserved[7];
+} RecorderRecord;
+
+gboolean recorder_initialize(const gchar *filepath);
+void recorder_finalize();
+void recorder_flush();
+void recorder_keep_keyboard_mapping(const KIKeyboardMapping *mapping);
+void recorder_keep_repeat_controls(guint repeat_delay, guint repeat_interval);
+void recorder_record(guint8 direction, const struct input_event *event);
+
+#endif /* _RECORDER_H */
@@ -0,0 +1,252 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+#include <stdlib.h>
+
+#include "common.h"
+#include "replay.h"
+#include "recorder.h"
+#include "keyboard-device.h"
+
+/* Mismatches after this number are only counted */
+#define _MAX_REPORTED_MISMATCHES 10
+
+typedef struct _Replay_ {
+  GMappedFile *file;
+  KIKeyboardMapping mapping;
+  const gchar *records;
+  guint32 record_size;
+  guint64 num_records;
+  guint32 repeat_delay;
+  guint32 repeat_interval;
+  guint64 next_output;
+  guint64 num_outputs;
+  guint64 num_mismatches;
+  gboolean is_running;
+} _Replay;
+
+static _Replay _replay;
+
+static gboolean _read_keyboard_mapping(const RecorderHeader *header);
+static const RecorderRecord *_get_record(guint64 index);
+static const RecorderRecord *_next_output_record();
+
+/* Maps a record file and makes the configuration file resolved with the
+ * keyboard mapping in it, so that replay_run() does not depend on X
+ * server.  Called before the configuration file is loaded. */
+gboolean replay_open(const gchar *filepath)
+{
+  GError *error = NULL;
+  const RecorderHeader *header;
+  gsize length;
+
+  memset(&_replay, 0, sizeof (_replay));
+  _replay.file = g_mapped_file_new(filepath, FALSE, &error);
+  if (!_replay.file) {
+    g_critical("Failed to open record file(%s): %s", filepath, error->message);
+    g_error_free(error);
+    return FALSE;
+  }
+  header = (const RecorderHeader *)g_mapped_file_get_contents(_replay.file);
+  length = g_mapped_file_get_length(_replay.file);
+  /* Checked in this order, so that nothing underflows nor divides by zero */
+  if (length < sizeof (RecorderHeader) ||
+      memcmp(header->magic, RECORDER_MAGIC, sizeof (header->magic)) ||
+      header->header_size < sizeof (RecorderHeader) ||
+      header->header_size > length ||
+      header->record_size < sizeof (RecorderRecord) ||
+      (length - header->header_size) / header->record_size
+      < header->num_records ||
+      !_read_keyboard_mapping(header)) {
+    g_critical("Invalid record file: %s", filepath);
+    replay_close();
+    return FALSE;
+  }
+  _replay.records = (const gchar *)header + header->header_size;
+  _replay.record_size = header->record_size;
+  _replay.num_records = header->num_records;
+  _replay.repeat_delay = header->repeat_delay;
+  _replay.repeat_interval = header->repeat_interval;
+  if (header->num_dropped) {
+    g_warning("%" G_GUINT64_FORMAT " events were dropped in recording",
+              header->num_dropped);
+  }
+  ki_set_fixed_keyboard_mapping(&_replay.mapping);
+  return TRUE;
+}
+
+void replay_close()
+{
+  ki_set_fixed_keyboard_mapping(NULL);
+  ki_free_keyboard_mapping(&_replay.mapping);
+  if (_replay.file) {
+    g_mapped_file_unref(_replay.file);
+  }
+  memset(&_replay, 0, sizeof (_replay));
+}
+
+/* Feeds the input events of the record file to the keyboard device as fast
+ * as possible, and compares the events sent to uinput with the recorded
+ * ones.  Requires the same configuration file as the recording for the
+ * outputs to match.  Neither the focus window nor fcitx is followed, so
+ * that the default actions handle every key, and repeated keys are told
+ * by the repeat controls of the recording. */
+gboolean replay_run(XSetKeys *xsk)
+{
+  guint64 index;
+  guint64 num_inputs = 0;
+  gint64 start_time;
+  gint64 elapsed;
+  gboolean result = TRUE;
+
+  xsk_set_focus_class(xsk, 0, 0);
+  kd_set_repeat_controls(xsk, _replay.repeat_delay, _replay.repeat_interval);
+
+  _replay.is_running = TRUE;
+  start_time = g_get_monotonic_time();
+  for (index = 0; index < _replay.num_records && result; index++) {
+    const RecorderRecord *record = _get_record(index);
+    struct input_event event;
+
+    if (record->direction != RECORDER_DIRECTION_INPUT) {
+      continue;
+    }
+    event.time.tv_sec = record->time / G_USEC_PER_SEC;
+    event.time.tv_usec = record->time % G_USEC_PER_SEC;
+    event.type = record->type;
+    event.code = record->code;
+    event.value = record->value;
+    result = kd_replay_event(xsk, &event);
+    num_inputs++;
+    recorder_flush();
+  }
+  elapsed = MAX(g_get_monotonic_time() - start_time, 1);
+
+  g_message("Replayed %" G_GUINT64_FORMAT " events in %" G_GINT64_FORMAT
+            " us: %.0f events/s, %.0f ns/event",
+            num_inputs,
+            elapsed,
+            num_inputs * 1e6 / elapsed,
+            num_inputs ? elapsed * 1e3 / num_inputs : 0.0);
+  g_message("Checked %" G_GUINT64_FORMAT " output events: %" G_GUINT64_FORMAT
+            " mismatches",
+            _replay.num_outputs,
+            _replay.num_mismatches);
+  if (_replay.num_mismatches) {
+    result = FALSE;
+  }
+
+  /* Outputs after this, such as releasing keys on exit, are not checked */
+  _replay.is_running = FALSE;
+  return result;
+}
+
+void replay_check_event(const struct input_event *event)
+{
+  const RecorderRecord *record;
+
+  if (!_replay.is_running) {
+    return;
+  }
+  _replay.num_outputs++;
+  record = _next_output_record();
+  if (record &&
+      record->type == event->type &&
+      record->code == event->code &&
+      record->value == event->value) {
+    return;
+  }
+  if (++_replay.num_mismatches <= _MAX_REPORTED_MISMATCHES) {
+    if (record) {
+      g_warning("Output mismatch #%" G_GUINT64_FORMAT
+                ": type=%02x code=%d value=%d, recorded type=%02x code=%d"
+                " value=%d",
+                _replay.num_outputs,
+                event->type,
+                event->code,
+                event->value,
+                record->type,
+                record->code,
+                record->value);
+    } else {
+      g_warning("Output mismatch #%" G_GUINT64_FORMAT
+                ": type=%02x code=%d value=%d, not recorded",
+                _replay.num_outputs,
+                event->type,
+                event->code,
+                event->value);
+    }
+  }
+}
+
+/* The key symbols and the modifier map follow the header */
+static gboolean _read_keyboard_mapping(const RecorderHeader *header)
+{
+  const guint32 *key_syms = (const guint32 *)(header + 1);
+  gsize num_key_syms = (gsize)header->num_key_codes *
+    header->key_syms_per_key_code;
+  gsize index;
+
+  if (header->min_key_code < 8 ||
+      header->min_key_code > G_MAXUINT8 ||
+      !header->num_key_codes ||
+      header->num_key_codes > G_MAXUINT8 + 1 - header->min_key_code ||
+      !header->key_syms_per_key_code ||
+      header->key_syms_per_key_code > G_MAXUINT8 ||
+      !header->max_keypermod ||
+      header->max_keypermod > G_MAXUINT8 ||
+      header->header_size < sizeof (RecorderHeader) +
+      recorder_get_key_syms_size(header) + recorder_get_modmap_size(header)) {
+    return FALSE;
+  }
+  _replay.mapping.min_key_code = header->min_key_code;
+  _replay.mapping.num_key_codes = header->num_key_codes;
+  _replay.mapping.key_syms_per_key_code = header->key_syms_per_key_code;
+  _replay.mapping.is_local = TRUE;
+  _replay.mapping.key_syms = malloc(num_key_syms * sizeof (KeySym));
+  _replay.mapping.modmap = XNewModifiermap(header->max_keypermod);
+  if (!_replay.mapping.key_syms || !_replay.mapping.modmap) {
+    return FALSE;
+  }
+  for (index = 0; index < num_key_syms; index++) {
+    _replay.mapping.key_syms[index] = key_syms[index];
+  }
+  memcpy(_replay.mapping.modmap->modifiermap,
+         (const guint8 *)key_syms + recorder_get_key_syms_size(header),
+         recorder_get_modmap_size(header));
+  return TRUE;
+}
+
+static const RecorderRecord *_get_record(guint64 index)
+{
+  return (const RecorderRecord *)(_replay.records +
+                                  index * _replay.record_size);
+}
+
+static const RecorderRecord *_next_output_record()
+{
+  while (_replay.next_output < _replay.num_records) {
+    const RecorderRecord *record = _get_record(_replay.next_output++);
+
+    if (record->direction == RECORDER_DIRECTION_OUTPUT) {
+      return record;
+    }
+  }
+  return NULL;
+}
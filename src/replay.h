@@ -0,0 +1,32 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+#ifndef _REPLAY_H
+#define _REPLAY_H
+
+#include <linux/input.h>
+
+#include "x-set-keys.h"
+
+gboolean replay_open(const gchar *filepath);
+void replay_close();
+gboolean replay_run(XSetKeys *xsk);
+void replay_check_event(const struct input_event *event);
+
+#endif /* _REPLAY_H */
@@ -0,0 +1,189 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/input.h>
+
+#include "common.h"
+#include "trace.h"
+
+/* Must be a power of two, 64KB of records */
+#define _RING_SIZE 4096
+
+static TraceRecord _ring[_RING_SIZE];
+static guint64 _num_records;
+
+static void _decode_record(GString *text,
+                           const TraceRecord *record,
+                           gint64 previous_time);
+static const gchar *_get_event_type_name(guint8 event_type);
+static gboolean _write_file(const gchar *filepath, const GString *text);
+
+/* Always on, so that the last records before a problem are available
+ * without changing the timing by debug output */
+void trace_record(TraceType type, guint8 sub_type, guint16 code, gint32 value)
+{
+  TraceRecord *record = &_ring[_num_records++ & (_RING_SIZE - 1)];
+
+  record->time = g_get_monotonic_time();
+  record->type = type;
+  record->sub_type = sub_type;
+  record->code = code;
+  record->value = value;
+}
+
+/* Writes the records in the ring from the oldest one as text */
+gboolean trace_dump(const gchar *filepath)
+{
+  GString *text = g_string_new(NULL);
+  guint64 index;
+  guint64 start = _num_records > _RING_SIZE ? _num_records - _RING_SIZE : 0;
+  gint64 previous_time = 0;
+  gboolean result;
+
+  g_string_append_printf(text,
+                         "# %" G_GUINT64_FORMAT " records, %"
+                         G_GUINT64_FORMAT " dropped\n"
+                         "# time(us) +delta(us) record\n",
+                         _num_records - start,
+                         start);
+  for (index = start; index < _num_records; index++) {
+    const TraceRecord *record = &_ring[index & (_RING_SIZE - 1)];
+
+    _decode_record(text, record, previous_time);
+    previous_time = record->time;
+  }
+
+  result = _write_file(filepath, text);
+  g_string_free(text, TRUE);
+  return result;
+}
+
+static void _decode_record(GString *text,
+                           const TraceRecord *record,
+                           gint64 previous_time)
+{
+  g_string_append_printf(text,
+                         "%" G_GINT64_FORMAT " +%" G_GINT64_FORMAT " ",
+                         record->time,
+                         previous_time ? record->time - previous_time : 0);
+  switch (record->type) {
+  case TRACE_EVENT_READ:
+  case TRACE_EVENT_WRITTEN:
+    g_string_append_printf(text,
+                           "%s %s code=%u value=%d\n",
+                           record->type == TRACE_EVENT_READ ? "read" : "write",
+                           _get_event_type_name(record->sub_type),
+                           record->code,
+                           record->value);
+    break;
+  case TRACE_KEY_ACTION:
+    g_string_append_printf(text,
+                           "key-action combinations=%d\n",
+                           record->value);
+    break;
+  case TRACE_MULTI_STROKE_ACTION:
+    g_string_append(text, "multi-stroke\n");
+    break;
+  case TRACE_SELECTION_MODE:
+    g_string_append_printf(text,
+                           "selection-mode %s\n",
+                           record->value ? "enter" : "exit");
+    break;
+  case TRACE_KEY_SEQUENCE_CANCELED:
+    g_string_append_printf(text,
+                           "key-sequence-canceled key-code=%u\n",
+                           record->code);
+    break;
+  case TRACE_EXCLUSION:
+    g_string_append_printf(text,
+                           "exclusion %s %s\n",
+                           record->sub_type == TRACE_EXCLUSION_FCITX
+                           ? "fcitx" : "window",
+                           record->value ? "on" : "off");
+    break;
+  default:
+    g_string_append_printf(text,
+                           "unknown type=%u sub-type=%u code=%u value=%d\n",
+                           record->type,
+                           record->sub_type,
+                           record->code,
+                           record->value);
+    break;
+  }
+}
+
+static const gchar *_get_event_type_name(guint8 event_type)
+{
+  switch (event_type) {
+  case EV_SYN:
+    return "syn";
+  case EV_KEY:
+    return "key";
+  case EV_MSC:
+    return "msc";
+  case EV_LED:
+    return "led";
+  case EV_REP:
+    return "rep";
+  }
+  return "other";
+}
+
+/* The records are typed keys, so that the file is created anew readable
+ * only by its owner, never through a symbolic link nor into a file created
+ * by someone else in its place. */
+static gboolean _write_file(const gchar *filepath, const GString *text)
+{
+  struct stat st;
+  gint fd;
+  gsize offset = 0;
+
+  if (!lstat(filepath, &st) && !S_ISDIR(st.st_mode) && unlink(filepath) < 0) {
+    print_error("Failed to remove old trace file(%s)", filepath);
+    return FALSE;
+  }
+  fd = open(filepath,
+            O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+            0600);
+  if (fd < 0) {
+    print_error("Failed to create trace file(%s)", filepath);
+    return FALSE;
+  }
+  while (offset < text->len) {
+    gssize written = write(fd, text->str + offset, text->len - offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      print_error("Failed to write trace file(%s)", filepath);
+      close(fd);
+      return FALSE;
+    }
+    offset += written;
+  }
+  if (close(fd) < 0) {
+    print_error("Failed to close trace file(%s)", filepath);
+    return FALSE;
+  }
+  return TRUE;
+}
@@ -0,0 +1,51 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <glib.h>
+
+typedef enum TraceType_ {
+  TRACE_EVENT_READ = 1,
+  TRACE_EVENT_WRITTEN,
+  TRACE_KEY_ACTION,
+  TRACE_MULTI_STROKE_ACTION,
+  TRACE_SELECTION_MODE,
+  TRACE_KEY_SEQUENCE_CANCELED,
+  TRACE_EXCLUSION
+} TraceType;
+
+/* `sub_type' of TRACE_EXCLUSION */
+#define TRACE_EXCLUSION_WINDOW 0
+#define TRACE_EXCLUSION_FCITX 1
+
+/* 16 bytes, recorded without any formatting */
+typedef struct TraceRecord_ {
+  gint64 time;
+  guint8 type;
+  guint8 sub_type;
+  guint16 code;
+  gint32 value;
+} TraceRecord;
+
+void trace_record(TraceType type, guint8 sub_type, guint16 code, gint32 value);
+gboolean trace_dump(const gchar *filepath);
+
+#endif /* _TRACE_H */
@@ -21,11 +21,18 @@
 #include <linux/uinput.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
 
 #include "common.h"
 #include "uinput-device.h"
 #include "keyboard-device.h"
+#include "latency.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
+#include "recorder.h"
+#include "replay.h"
 
 static gint _open_uinput_device();
 static gboolean _write_user_dev(Device *device);
@@ -73,7 +80,28 @@ UInputDevice *ud_initialize(XSetKeys *xsk)
     device_finalize(&device->device);
     return NULL;
   }
-  device->pressing_keys = key_code_array_new(6);
+  device->pressing_keys = key_code_array_new(KEY_CODE_ARRAY_MAX_LENGTH);
+  return device;
+}
+
+/* The events sent to this device are checked against the recorded ones by
+ * replay.c instead of being written */
+UInputDevice *ud_initialize_replay(XSetKeys *xsk)
+{
+  UInputDevice *device;
+  gint fd = eventfd(0, EFD_CLOEXEC);
+
+  if (fd < 0) {
+    print_error("Failed to create eventfd for replay");
+    return NULL;
+  }
+  device = (UInputDevice *)device_initialize(fd,
+                                             "replayed uinput device",
+                                             sizeof (UInputDevice),
+                                             _handle_input,
+                                             xsk);
+  device->is_replay = TRUE;
+  device->pressing_keys = key_code_array_new(KEY_CODE_ARRAY_MAX_LENGTH);
   return device;
 }
 
@@ -85,7 +113,8 @@ void ud_finalize(XSetKeys *xsk)
     ud_send_key_events(xsk, device->pressing_keys, FALSE, TRUE);
     key_code_array_free(device->pressing_keys);
   }
-  if (ioctl(device_get_fd(&device->device), UI_DEV_DESTROY) < 0) {
+  if (!device->is_replay &&
+      ioctl(device_get_fd(&device->device), UI_DEV_DESTROY) < 0) {
     print_error("Failed to destroy uinput device");
   }
   device_close(&device->device);
@@ -281,11 +310,14 @@ static gboolean _send_event(XSetKeys *xsk,
   device->last_event_type = event->type;
   gettimeofday(&event->time, NULL);
 
-#ifdef TRACE
-  debug_print("Write to uinput : type=%02x code=%d value=%d",
-              event->type,
-              event->code,
-              event->value);
-#endif
+  trace_record(TRACE_EVENT_WRITTEN, event->type, event->code, event->value);
+  probe3(send_event, event->type, event->code, event->value);
+  recorder_record(RECORDER_DIRECTION_OUTPUT, event);
+  if (device->is_replay) {
+    replay_check_event(event);
+    return TRUE;
+  }
+  latency_set_written();
+  metrics_count(METRICS_EVENTS_WRITTEN);
   return device_write(&device->device, event, sizeof (*event));
 }
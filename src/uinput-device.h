@@ -29,9 +29,11 @@ typedef struct UInputDevice_ {
   Device device;
   KeyCodeArray *pressing_keys;
   guint16 last_event_type;
+  gboolean is_replay;
 } UInputDevice;
 
 UInputDevice *ud_initialize(XSetKeys *xsk);
+UInputDevice *ud_initialize_replay(XSetKeys *xsk);
 void ud_finalize(XSetKeys *xsk);
 
 gboolean ud_send_key_event(XSetKeys *xsk,
@@ -20,40 +20,85 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <signal.h>
+#include <stdlib.h>
 #include <X11/Xutil.h>
 #include <X11/XKBlib.h>
+#include <X11/Xlib-xcb.h>
 
 #include "common.h"
 #include "window-system.h"
+#include "keyboard-device.h"
 #include "uinput-device.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
 
 static struct _KeyboardData_ {
-  int min_keycodes;
-  int num_keycodes;
-  int keysyms_per_keycode;
-  KeySym *keysyms;
-  XModifierKeymap *modmap;
+  KIKeyboardMapping mapping;
   XkbDescPtr xkb;
   gboolean is_failed;
 } _keyboard_data = { 0 };
 
+#define _CLASS_CACHE_SIZE 256
+#define _WM_CLASS_LENGTH 256
+#define _KEYBOARD_MAPPING_TIMEOUT 200
+#define _MAPPING_BUSY_INTERVAL 100
+#define _MAPPING_BUSY_RETRIES 20
+
+typedef struct _WindowClass_ {
+  GQuark res_name;
+  GQuark res_class;
+  gboolean is_excluded;
+} _WindowClass;
+
 #define _is_valid_window(window) ((window) != None && (window) != PointerRoot)
+#define _is_exist_keyboard_mapping()                                \
+  (_keyboard_data.mapping.key_syms || _keyboard_data.mapping.modmap)
 #define _is_exist_keyboard_data()                                       \
-  (_keyboard_data.keysyms || _keyboard_data.modmap || _keyboard_data.xkb)
+  (_is_exist_keyboard_mapping() || _keyboard_data.xkb)
 
 static gboolean _handle_event(gpointer user_data);
+static gboolean _has_pending(Device *device);
 static gboolean _dispatch_event(XSetKeys *xsk,
                                 gboolean *xkb_rule_changed,
                                 gboolean *keymapping_changed,
                                 gboolean *modifier_changed);
-static Window _get_focus_window(Display *display);
-static gboolean _get_is_excluded(Display *display,
-                                 Window window,
-                                 gchar **excluded_classes);
+static void _set_request(WindowSystemReply *reply, guint sequence);
+static gboolean _poll_reply(WindowSystem *ws, WindowSystemReply *reply);
+static void _take_reply(WindowSystemReply *reply,
+                        void **result,
+                        xcb_generic_error_t **error);
+static void _discard_reply(WindowSystem *ws, WindowSystemReply *reply);
+static void _request_active_window(WindowSystem *ws, Window root);
+static void _request_window_class(WindowSystem *ws, Window window);
+static void _cancel_window_class(WindowSystem *ws);
+static void _process_replies(XSetKeys *xsk);
+static void _process_active_window_reply(XSetKeys *xsk);
+static void _process_window_class_replies(XSetKeys *xsk);
+static _WindowClass *_new_window_class(GHashTable *excluded_classes,
+                                       const gchar *wm_class,
+                                       gint length);
+static void _cache_window_class(WindowSystem *ws,
+                                Window window,
+                                _WindowClass *window_class);
+static _WindowClass *_copy_window_class(const _WindowClass *window_class);
+static void _set_window_class(XSetKeys *xsk,
+                              const _WindowClass *window_class);
+static gboolean _is_root_window(WindowSystem *ws, Window window);
+static void _wait_keyboard_mapping(XSetKeys *xsk, XkbRulesState state);
+static gboolean _handle_keyboard_mapping_timeout(gpointer user_data);
+static void _start_restore_keyboard_data(XSetKeys *xsk);
+static gboolean _retry_restore_keyboard_data(gpointer user_data);
+static void _continue_restore_keyboard_data(XSetKeys *xsk);
+static void _remove_xkb_rules_timeout(WindowSystem *ws);
 static void _get_keyboard_data(Display *display);
+static void _get_keyboard_controls(Display *display);
+static void _select_controls_notify(Display *display, WindowSystem *ws);
 static void _set_keyboard_data(Display *display);
+static void _set_keyboard_mapping(Display *display);
+static gint _set_modifier_mapping(Display *display);
+static void _set_keyboard_controls(Display *display);
 static void _free_keyboard_data();
-static gboolean _poll_display(Display *display, gint timeout);
 
 WindowSystem *window_system_initialize(XSetKeys *xsk,
                                        gchar *excluded_classes[])
@@ -67,26 +112,34 @@ WindowSystem *window_system_initialize(XSetKeys *xsk,
                                          sizeof (WindowSystem),
                                          _handle_event,
                                          xsk);
-  ws->excluded_classes = excluded_classes;
+  device_set_pending_func(&ws->device, _has_pending);
+  ws->display = display;
+  ws->connection = XGetXCBConnection(display);
   ws->active_window_atom = XInternAtom(display, "_NET_ACTIVE_WINDOW", False);
   ws->xkb_rules_atom = XInternAtom(display, "_XKB_RULES_NAMES", False);
+  metrics_counters[METRICS_X_ROUND_TRIPS] += 2;
 
-  ws->focus_window = _get_focus_window(display);
-  if (!_is_valid_window(ws->focus_window)) {
-    g_critical("XGetInputFocus returned special window");
-    device_finalize(&ws->device);
-    return NULL;
+  if (excluded_classes) {
+    ws->excluded_classes = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (; *excluded_classes; excluded_classes++) {
+      g_hash_table_add(ws->excluded_classes,
+                       GUINT_TO_POINTER(g_quark_from_string(*excluded_classes)));
+    }
   }
-  ws->is_excluded = _get_is_excluded(display,
-                                     ws->focus_window,
-                                     ws->excluded_classes);
-  debug_print("Input focus window exclusion: %s",
-              ws->is_excluded ? "true" : "false");
-
-  _get_keyboard_data(display);
+  ws->class_cache = g_hash_table_new_full(g_direct_hash,
+                                          g_direct_equal,
+                                          NULL,
+                                          g_free);
+
+  /* The keyboard mapping is given by window_system_keep_keyboard_mapping() */
+  _get_keyboard_controls(display);
+  _select_controls_notify(display, ws);
   for (screen = 0; screen < ScreenCount(display); screen++) {
     XSelectInput(display, RootWindow(display, screen), PropertyChangeMask);
   }
+  XFlush(display);
+  _request_active_window(ws, DefaultRootWindow(display));
+  xcb_flush(ws->connection);
   return ws;
 }
 
@@ -97,19 +150,54 @@ void window_system_pre_finalize(XSetKeys *xsk)
   }
 }
 
+/* Keeps the keyboard mapping got by config_load() to restore it after XKB
+ * rules are changed, unless it is already kept.  The members of `mapping'
+ * are moved.  A mapping not got from X server, such as a compiled keymap,
+ * is never given back to it, so that the mappings are got from X server
+ * instead. */
+void window_system_keep_keyboard_mapping(XSetKeys *xsk,
+                                         KIKeyboardMapping *mapping)
+{
+  if (_is_exist_keyboard_mapping() || _keyboard_data.is_failed) {
+    return;
+  }
+  if (mapping->is_local) {
+    ki_get_server_keyboard_mapping(xsk_get_display(xsk),
+                                   &_keyboard_data.mapping);
+    return;
+  }
+  debug_print("Keep keyboard mapping");
+  _keyboard_data.mapping = *mapping;
+  mapping->key_syms = NULL;
+  mapping->modmap = NULL;
+}
+
 void window_system_finalize(XSetKeys *xsk, gboolean is_restart)
 {
   WindowSystem *ws = xsk_get_window_system(xsk);
 
+  _remove_xkb_rules_timeout(ws);
+  _discard_reply(ws, &ws->active_window_reply);
+  _cancel_window_class(ws);
+  if (ws->released_keys) {
+    key_code_array_free(ws->released_keys);
+  }
   if (!is_restart && _is_exist_keyboard_data()) {
     _set_keyboard_data(xsk_get_display(xsk));
   }
+  if (ws->excluded_classes) {
+    g_hash_table_destroy(ws->excluded_classes);
+  }
+  if (ws->class_cache) {
+    g_hash_table_destroy(ws->class_cache);
+  }
   device_finalize(&ws->device);
 }
 
 static gboolean _handle_event(gpointer user_data)
 {
   XSetKeys *xsk = user_data;
+  WindowSystem *ws = xsk_get_window_system(xsk);
   Display *display = xsk_get_display(xsk);
   gboolean xkb_rule_changed = FALSE;
   gboolean keymapping_changed = FALSE;
@@ -124,57 +212,50 @@ static gboolean _handle_event(gpointer user_data)
     return FALSE;
   }
 
-  if (xkb_rule_changed && _is_exist_keyboard_data()) {
-    gint status = _poll_display(display, 200);
-    if (status < 0) {
-      return FALSE;
-    }
-    if (status == 0) {
-      debug_print("Poll display Timeout!");
-    }
-    xkb_rule_changed = FALSE;
-    keymapping_changed = FALSE;
-    if (!_dispatch_event(xsk,
-                         &xkb_rule_changed,
-                         &keymapping_changed,
-                         &modifier_changed)) {
-      return FALSE;
-    }
-    if (keymapping_changed && !xkb_rule_changed) {
-      gint status = _poll_display(display, 200);
-      if (status < 0) {
-        return FALSE;
-      }
-      if (status == 0) {
-        debug_print("Poll display Timeout!");
-      }
-      if (!_dispatch_event(xsk,
-                           &xkb_rule_changed,
-                           &keymapping_changed,
-                           &modifier_changed)) {
-        return FALSE;
+  switch (ws->xkb_rules_state) {
+  case XKB_RULES_IDLE:
+    if (xkb_rule_changed && _is_exist_keyboard_data()) {
+      _wait_keyboard_mapping(xsk, XKB_RULES_WAITING);
+    } else if (modifier_changed) {
+      if (_is_exist_keyboard_data()) {
+        g_warning("Unexpected X Event: "
+                  "Modifier mapping was changed before XKB rules was changed");
+        _free_keyboard_data();
+        _get_keyboard_controls(display);
       }
+      kill(getpid(), SIGUSR1);
     }
-    ud_send_key_events(xsk, ud_get_pressing_keys(xsk), FALSE, TRUE);
-    _set_keyboard_data(display);
-    ud_send_key_events(xsk, ud_get_pressing_keys(xsk), TRUE, TRUE);
-    return _dispatch_event(xsk,
-                           &xkb_rule_changed,
-                           &keymapping_changed,
-                           &modifier_changed);
-  } else if (modifier_changed) {
-    if (_is_exist_keyboard_data()) {
-      g_warning("Unexpected X Event: "
-                "Modifier mapping was changed before XKB rules was changed");
-      _free_keyboard_data();
-      _get_keyboard_data(display);
+    break;
+  case XKB_RULES_WAITING:
+    if (keymapping_changed && !xkb_rule_changed) {
+      _wait_keyboard_mapping(xsk, XKB_RULES_WAITING_MORE);
+    } else {
+      _start_restore_keyboard_data(xsk);
     }
-    kill(getpid(), SIGUSR1);
+    break;
+  case XKB_RULES_WAITING_MORE:
+    _start_restore_keyboard_data(xsk);
+    break;
+  case XKB_RULES_RESTORING:
+    break;
   }
 
   return TRUE;
 }
 
+/* Events and replies read by other X calls, for example while loading the
+ * keyboard mapping, are queued in Xlib and xcb without making the fd
+ * readable */
+static gboolean _has_pending(Device *device)
+{
+  WindowSystem *ws = (WindowSystem *)device;
+
+  return XEventsQueued(ws->display, QueuedAlready) > 0 ||
+    _poll_reply(ws, &ws->active_window_reply) ||
+    _poll_reply(ws, &ws->class_reply) ||
+    _poll_reply(ws, &ws->tree_reply);
+}
+
 static gboolean _dispatch_event(XSetKeys *xsk,
                                 gboolean *xkb_rule_changed,
                                 gboolean *keymapping_changed,
@@ -183,190 +264,628 @@ static gboolean _dispatch_event(XSetKeys *xsk,
   Display *display = xsk_get_display(xsk);
   WindowSystem *ws = xsk_get_window_system(xsk);
 
-  while (XPending(display)) {
-    XEvent event;
-
-    XNextEvent(display, &event);
-    switch (event.type) {
-    case PropertyNotify:
-      debug_print("PropertyNotify: %s",
-                  XGetAtomName(display, event.xproperty.atom));
-      if (event.xproperty.atom == ws->active_window_atom) {
-        Window focus_window;
-        gboolean is_excluded;
-
-        focus_window = _get_focus_window(display);
-        if (focus_window != ws->focus_window) {
-          if (!_is_valid_window(focus_window)) {
-            g_critical("XGetInputFocus returned special window");
-            return FALSE;
-          }
-          ws->focus_window = focus_window;
-          is_excluded = _get_is_excluded(display,
-                                         focus_window,
-                                         ws->excluded_classes);
-          if (is_excluded && !xsk_is_excluded(xsk)) {
-            xsk_reset_state(xsk);
-          }
-          ws->is_excluded = is_excluded;
-          debug_print("Input focus window exclusion: %s",
-                      is_excluded ? "true" : "false");
+  /* Polling the replies may read more events from the connection, which
+     the fd does not tell any more */
+  do {
+    while (XPending(display)) {
+      XEvent event;
+
+      XNextEvent(display, &event);
+      switch (event.type) {
+      case PropertyNotify:
+        if (is_debug) {
+          gchar *atom_name = XGetAtomName(display, event.xproperty.atom);
+
+          debug_print("PropertyNotify: %s", atom_name);
+          XFree(atom_name);
         }
-      } else if (event.xproperty.atom == ws->xkb_rules_atom) {
-        *xkb_rule_changed = TRUE;
-      }
-      break;
+        if (event.xproperty.atom == ws->active_window_atom) {
+          _request_active_window(ws, event.xproperty.window);
+        } else if (event.xproperty.atom == ws->xkb_rules_atom) {
+          *xkb_rule_changed = TRUE;
+        }
+        break;
+
+      case DestroyNotify:
+        if (g_hash_table_remove(
+              ws->class_cache,
+              GSIZE_TO_POINTER(event.xdestroywindow.window))) {
+          debug_print("Forget class of destroyed window=%lx",
+                      event.xdestroywindow.window);
+        }
+        break;
 
-    case MappingNotify:
-      switch (event.xmapping.request) {
-      case MappingKeyboard:
-        debug_print("MappingKeyboard");
-        XRefreshKeyboardMapping(&event.xmapping);
-        *keymapping_changed = TRUE;
+      case ReparentNotify:
+        /* The classes found through the old ancestors of the window, also
+           for the windows under it, may differ under the new parent */
+        debug_print("Forget classes on reparenting window=%lx",
+                    event.xreparent.window);
+        g_hash_table_remove_all(ws->class_cache);
         break;
-      case MappingModifier:
-        debug_print("MappingModifier");
-        XRefreshKeyboardMapping(&event.xmapping);
-        *modifier_changed = TRUE;
+
+      case MappingNotify:
+        switch (event.xmapping.request) {
+        case MappingKeyboard:
+          debug_print("MappingKeyboard");
+          XRefreshKeyboardMapping(&event.xmapping);
+          *keymapping_changed = TRUE;
+          break;
+        case MappingModifier:
+          debug_print("MappingModifier");
+          XRefreshKeyboardMapping(&event.xmapping);
+          *modifier_changed = TRUE;
+          break;
+        }
+        break;
+
+      default:
+        if (event.type == ws->xkb_event_type &&
+            ((XkbEvent *)&event)->any.xkb_type == XkbControlsNotify &&
+            xsk_get_keyboard_device(xsk)) {
+          debug_print("XkbControlsNotify");
+          kd_update_repeat_controls(xsk);
+        }
         break;
       }
-      break;
     }
-  }
 
+    _process_replies(xsk);
+  } while (XPending(display));
   return TRUE;
 }
 
-static Window _get_focus_window(Display *display)
+static void _set_request(WindowSystemReply *reply, guint sequence)
 {
-  Window window;
-  gint focus_state;
+  reply->sequence = sequence;
+  reply->is_polled = FALSE;
+  reply->reply = NULL;
+  reply->error = NULL;
+}
 
-  XGetInputFocus(display, &window, &focus_state);
-  return window;
+/* Returns TRUE if the reply or the error has arrived, without reading the
+ * connection */
+static gboolean _poll_reply(WindowSystem *ws, WindowSystemReply *reply)
+{
+  if (!reply->sequence) {
+    return FALSE;
+  }
+  if (!reply->is_polled) {
+    reply->is_polled = xcb_poll_for_reply(ws->connection,
+                                          reply->sequence,
+                                          &reply->reply,
+                                          &reply->error);
+  }
+  return reply->is_polled;
 }
 
-static gboolean _get_is_excluded(Display *display,
-                                 Window window,
-                                 gchar **excluded_classes)
+/* Moves the arrived reply and error to the caller, who frees them */
+static void _take_reply(WindowSystemReply *reply,
+                        void **result,
+                        xcb_generic_error_t **error)
 {
-  gboolean result = FALSE;
-  XClassHint class_hints;
-  Window root;
-  Window parent;
-  Window *children;
-  guint nchildren;
+  *result = reply->reply;
+  *error = reply->error;
+  _set_request(reply, 0);
+}
 
-  if (!excluded_classes) {
-    return FALSE;
+static void _discard_reply(WindowSystem *ws, WindowSystemReply *reply)
+{
+  if (reply->is_polled) {
+    free(reply->reply);
+    free(reply->error);
+  } else if (reply->sequence) {
+    xcb_discard_reply(ws->connection, reply->sequence);
   }
+  _set_request(reply, 0);
+}
 
-  for (;;) {
-    if (XGetClassHint(display, window, &class_hints)) {
-      break;
+static void _request_active_window(WindowSystem *ws, Window root)
+{
+  xcb_get_property_cookie_t cookie;
+
+  _discard_reply(ws, &ws->active_window_reply);
+  /* Measured from the first change not reflected yet */
+  if (!ws->focus_change_time) {
+    ws->focus_change_time = g_get_monotonic_time();
+  }
+  metrics_count(METRICS_X_ROUND_TRIPS);
+  cookie = xcb_get_property(ws->connection,
+                            FALSE,
+                            root,
+                            ws->active_window_atom,
+                            XCB_ATOM_WINDOW,
+                            0,
+                            1);
+  _set_request(&ws->active_window_reply, cookie.sequence);
+}
+
+static void _request_window_class(WindowSystem *ws, Window window)
+{
+  xcb_get_property_cookie_t class_cookie;
+  xcb_query_tree_cookie_t tree_cookie;
+
+  _cancel_window_class(ws);
+
+  /* Both requests are issued at once, so that the parent is already known
+     when the window turns out to have no WM_CLASS */
+  class_cookie = xcb_get_property(ws->connection,
+                                  FALSE,
+                                  window,
+                                  XCB_ATOM_WM_CLASS,
+                                  XCB_ATOM_STRING,
+                                  0,
+                                  _WM_CLASS_LENGTH);
+  tree_cookie = xcb_query_tree(ws->connection, window);
+  metrics_counters[METRICS_X_ROUND_TRIPS] += 2;
+  ws->class_window = window;
+  _set_request(&ws->class_reply, class_cookie.sequence);
+  _set_request(&ws->tree_reply, tree_cookie.sequence);
+}
+
+static void _cancel_window_class(WindowSystem *ws)
+{
+  _discard_reply(ws, &ws->class_reply);
+  _discard_reply(ws, &ws->tree_reply);
+}
+
+static void _process_replies(XSetKeys *xsk)
+{
+  WindowSystem *ws = xsk_get_window_system(xsk);
+
+  if (ws->active_window_reply.sequence) {
+    _process_active_window_reply(xsk);
+  }
+  if (ws->class_reply.sequence || ws->tree_reply.sequence) {
+    _process_window_class_replies(xsk);
+  }
+  xcb_flush(ws->connection);
+}
+
+static void _process_active_window_reply(XSetKeys *xsk)
+{
+  WindowSystem *ws = xsk_get_window_system(xsk);
+  xcb_get_property_reply_t *reply = NULL;
+  xcb_generic_error_t *error = NULL;
+  Window window = None;
+  _WindowClass *window_class;
+
+  if (!_poll_reply(ws, &ws->active_window_reply)) {
+    return;
+  }
+  _take_reply(&ws->active_window_reply, (void **)&reply, &error);
+  if (error) {
+    g_warning("Failed to get _NET_ACTIVE_WINDOW, error_code=%d",
+              error->error_code);
+    free(error);
+  }
+  if (reply) {
+    if (reply->type == XCB_ATOM_WINDOW &&
+        xcb_get_property_value_length(reply) >= sizeof (xcb_window_t)) {
+      window = *(xcb_window_t *)xcb_get_property_value(reply);
     }
-    if (!XQueryTree(display, window, &root, &parent, &children, &nchildren)) {
-      print_error("XQueryTree failed window=%lx", window);
-      return FALSE;
+    free(reply);
+  }
+
+  if (window == ws->focus_window) {
+    ws->focus_change_time = 0;
+    return;
+  }
+  metrics_count(METRICS_FOCUS_CHANGES);
+  ws->focus_window = window;
+  _cancel_window_class(ws);
+
+  if (!_is_valid_window(window) ||
+      (!ws->excluded_classes && !xsk_has_profiles(xsk))) {
+    _set_window_class(xsk, NULL);
+    return;
+  }
+  window_class = g_hash_table_lookup(ws->class_cache,
+                                     GSIZE_TO_POINTER(window));
+  if (window_class) {
+    _set_window_class(xsk, window_class);
+  } else {
+    _request_window_class(ws, window);
+  }
+}
+
+static void _process_window_class_replies(XSetKeys *xsk)
+{
+  WindowSystem *ws = xsk_get_window_system(xsk);
+  xcb_get_property_reply_t *class_reply = NULL;
+  xcb_query_tree_reply_t *tree_reply = NULL;
+  xcb_generic_error_t *error = NULL;
+  Window parent;
+  _WindowClass *window_class;
+
+  if (ws->class_reply.sequence) {
+    if (!_poll_reply(ws, &ws->class_reply)) {
+      return;
+    }
+    _take_reply(&ws->class_reply, (void **)&class_reply, &error);
+    if (error) {
+      /* The window may have been destroyed in the meantime */
+      debug_print("Failed to get WM_CLASS window=%lx, error_code=%d",
+                  ws->class_window,
+                  error->error_code);
+      free(error);
+      _cancel_window_class(ws);
+      _set_window_class(xsk, NULL);
+      return;
     }
-    XFree(children);
-    if (window == root || parent == root) {
-      g_critical("Can not get window class for input focus window");
-      return FALSE;
+    if (class_reply && xcb_get_property_value_length(class_reply) > 0) {
+      _cancel_window_class(ws);
+      window_class =
+        _new_window_class(ws->excluded_classes,
+                          xcb_get_property_value(class_reply),
+                          xcb_get_property_value_length(class_reply));
+      free(class_reply);
+      /* Also cached for the ancestor, so that the search from the other
+         windows in it stops there.  The focus window is cached last,
+         since caching may clear the cache. */
+      if (ws->class_window != ws->focus_window) {
+        _cache_window_class(ws,
+                            ws->class_window,
+                            _copy_window_class(window_class));
+      }
+      _cache_window_class(ws, ws->focus_window, window_class);
+      _set_window_class(xsk, window_class);
+      return;
     }
-    window = parent;
+    free(class_reply);
   }
 
-  for (; *excluded_classes; excluded_classes++) {
-    if (!g_strcmp0(*excluded_classes, class_hints.res_name)) {
-      result = TRUE;
-      break;
+  if (!_poll_reply(ws, &ws->tree_reply)) {
+    return;
+  }
+  _take_reply(&ws->tree_reply, (void **)&tree_reply, &error);
+  if (error || !tree_reply) {
+    g_critical("QueryTree failed window=%lx", ws->class_window);
+    free(error);
+    _set_window_class(xsk, NULL);
+    return;
+  }
+  parent = tree_reply->parent;
+  if (ws->class_window == tree_reply->root || parent == tree_reply->root) {
+    /* Not cached, since WM_CLASS may be set later, or the window may be
+       found while it is being reparented */
+    g_critical("Can not get window class for input focus window");
+    free(tree_reply);
+    _set_window_class(xsk, NULL);
+    return;
+  }
+  free(tree_reply);
+
+  window_class = g_hash_table_lookup(ws->class_cache,
+                                     GSIZE_TO_POINTER(parent));
+  if (window_class) {
+    window_class = _copy_window_class(window_class);
+    _cache_window_class(ws, ws->focus_window, window_class);
+    _set_window_class(xsk, window_class);
+    return;
+  }
+  _request_window_class(ws, parent);
+}
+
+static _WindowClass *_new_window_class(GHashTable *excluded_classes,
+                                       const gchar *wm_class,
+                                       gint length)
+{
+  _WindowClass *window_class = g_new0(_WindowClass, 1);
+  gchar *res_name = g_strndup(wm_class, length);
+  gint res_name_length = strlen(res_name);
+
+  /* WM_CLASS consists of two consecutive null-terminated strings */
+  window_class->res_name = g_quark_from_string(res_name);
+  if (res_name_length + 1 < length) {
+    gchar *res_class = g_strndup(wm_class + res_name_length + 1,
+                                 length - res_name_length - 1);
+    window_class->res_class = g_quark_from_string(res_class);
+    g_free(res_class);
+  }
+  g_free(res_name);
+
+  if (excluded_classes) {
+    window_class->is_excluded =
+      g_hash_table_contains(excluded_classes,
+                            GUINT_TO_POINTER(window_class->res_name)) ||
+      (window_class->res_class &&
+       g_hash_table_contains(excluded_classes,
+                             GUINT_TO_POINTER(window_class->res_class)));
+  }
+  return window_class;
+}
+
+static void _cache_window_class(WindowSystem *ws,
+                                Window window,
+                                _WindowClass *window_class)
+{
+  const guint32 event_mask = XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+  xcb_void_cookie_t cookie;
+
+  if (g_hash_table_size(ws->class_cache) >= _CLASS_CACHE_SIZE) {
+    debug_print("Window class cache is full, clearing");
+    g_hash_table_remove_all(ws->class_cache);
+  }
+  g_hash_table_insert(ws->class_cache, GSIZE_TO_POINTER(window), window_class);
+  if (!_is_root_window(ws, window)) {
+    /* To receive DestroyNotify, so that the cached result can be dropped
+       before the window ID is reused, and ReparentNotify.  BadWindow is
+       ignored, because the window may already have been destroyed. */
+    cookie = xcb_change_window_attributes_checked(ws->connection,
+                                                  window,
+                                                  XCB_CW_EVENT_MASK,
+                                                  &event_mask);
+    xcb_discard_reply(ws->connection, cookie.sequence);
+  }
+}
+
+static _WindowClass *_copy_window_class(const _WindowClass *window_class)
+{
+  _WindowClass *result = g_new(_WindowClass, 1);
+
+  *result = *window_class;
+  return result;
+}
+
+static void _set_window_class(XSetKeys *xsk, const _WindowClass *window_class)
+{
+  WindowSystem *ws = xsk_get_window_system(xsk);
+  gboolean is_excluded = window_class && window_class->is_excluded;
+
+  if (is_excluded && !xsk_is_excluded(xsk)) {
+    xsk_reset_state(xsk);
+  }
+  if (is_excluded != ws->is_excluded) {
+    metrics_count(METRICS_EXCLUSION_CHANGES);
+    trace_record(TRACE_EXCLUSION, TRACE_EXCLUSION_WINDOW, 0, is_excluded);
+  }
+  ws->is_excluded = is_excluded;
+  if (ws->focus_change_time && !ws->active_window_reply.sequence) {
+    metrics_counters[METRICS_FOCUS_UPDATE_MICROSECONDS] +=
+      g_get_monotonic_time() - ws->focus_change_time;
+    ws->focus_change_time = 0;
+  }
+  probe1(window_exclusion, is_excluded);
+  debug_print("Input focus window exclusion: %s",
+              is_excluded ? "true" : "false");
+  xsk_set_focus_class(xsk,
+                      window_class ? window_class->res_name : 0,
+                      window_class ? window_class->res_class : 0);
+}
+
+static gboolean _is_root_window(WindowSystem *ws, Window window)
+{
+  xcb_screen_iterator_t iterator;
+
+  for (iterator = xcb_setup_roots_iterator(xcb_get_setup(ws->connection));
+       iterator.rem;
+       xcb_screen_next(&iterator)) {
+    if (window == iterator.data->root) {
+      return TRUE;
     }
-    if (!g_strcmp0(*excluded_classes, class_hints.res_class)) {
-      result = TRUE;
-      break;
+  }
+  return FALSE;
+}
+
+/* After the XKB rules are changed (e.g. by setxkbmap), the new keymap
+ * follows in separate X events.  Instead of blocking on the display until
+ * they arrive, the state is advanced by the next X event or a timeout. */
+static void _wait_keyboard_mapping(XSetKeys *xsk, XkbRulesState state)
+{
+  WindowSystem *ws = xsk_get_window_system(xsk);
+
+  _remove_xkb_rules_timeout(ws);
+  ws->xkb_rules_state = state;
+  ws->xkb_rules_timeout_id = g_timeout_add(_KEYBOARD_MAPPING_TIMEOUT,
+                                           _handle_keyboard_mapping_timeout,
+                                           xsk);
+}
+
+static gboolean _handle_keyboard_mapping_timeout(gpointer user_data)
+{
+  XSetKeys *xsk = user_data;
+  WindowSystem *ws = xsk_get_window_system(xsk);
+
+  debug_print("Wait keyboard mapping Timeout!");
+  ws->xkb_rules_timeout_id = 0;
+  _start_restore_keyboard_data(xsk);
+  return G_SOURCE_REMOVE;
+}
+
+static void _start_restore_keyboard_data(XSetKeys *xsk)
+{
+  WindowSystem *ws = xsk_get_window_system(xsk);
+  const KeyCodeArray *pressing_keys = ud_get_pressing_keys(xsk);
+  const KeyCode *pointer;
+
+  _remove_xkb_rules_timeout(ws);
+  ws->xkb_rules_state = XKB_RULES_RESTORING;
+  ws->mapping_busy_retries = _MAPPING_BUSY_RETRIES;
+
+  if (!ws->released_keys) {
+    ws->released_keys = key_code_array_new(6);
+  }
+  key_code_array_clear(ws->released_keys);
+  for (pointer = &key_code_array_get_at(pressing_keys, 0);
+       *pointer;
+       pointer++) {
+    key_code_array_add(ws->released_keys, *pointer);
+  }
+  ud_send_key_events(xsk, ws->released_keys, FALSE, TRUE);
+
+  _set_keyboard_mapping(xsk_get_display(xsk));
+  _continue_restore_keyboard_data(xsk);
+}
+
+static gboolean _retry_restore_keyboard_data(gpointer user_data)
+{
+  XSetKeys *xsk = user_data;
+  WindowSystem *ws = xsk_get_window_system(xsk);
+
+  ws->xkb_rules_timeout_id = 0;
+  _continue_restore_keyboard_data(xsk);
+  return G_SOURCE_REMOVE;
+}
+
+static void _continue_restore_keyboard_data(XSetKeys *xsk)
+{
+  WindowSystem *ws = xsk_get_window_system(xsk);
+  Display *display = xsk_get_display(xsk);
+  const KeyCode *pointer;
+  gboolean xkb_rule_changed = FALSE;
+  gboolean keymapping_changed = FALSE;
+  gboolean modifier_changed = FALSE;
+
+  if (_set_modifier_mapping(display) == MappingBusy) {
+    if (--ws->mapping_busy_retries > 0) {
+      ws->xkb_rules_timeout_id = g_timeout_add(_MAPPING_BUSY_INTERVAL,
+                                               _retry_restore_keyboard_data,
+                                               xsk);
+      return;
+    }
+    g_warning("XSetModifierMapping failed by MappingBusy");
+    XFreeModifiermap(_keyboard_data.mapping.modmap);
+    _keyboard_data.mapping.modmap = NULL;
+  }
+  _set_keyboard_controls(display);
+
+  /* Only the keys which are still pressed are pressed again */
+  for (pointer = &key_code_array_get_at(ws->released_keys, 0);
+       *pointer;
+       pointer++) {
+    if (ud_is_key_pressed(xsk, *pointer)) {
+      ud_send_key_event(xsk, *pointer, TRUE, TRUE);
     }
   }
+  ws->xkb_rules_state = XKB_RULES_IDLE;
 
-  XFree(class_hints.res_name);
-  XFree(class_hints.res_class);
+  /* The mapping notifications caused by restoring are not handled */
+  if (!_dispatch_event(xsk,
+                       &xkb_rule_changed,
+                       &keymapping_changed,
+                       &modifier_changed)) {
+    notify_error();
+  }
+}
 
-  return result;
+static void _remove_xkb_rules_timeout(WindowSystem *ws)
+{
+  if (ws->xkb_rules_timeout_id) {
+    g_source_remove(ws->xkb_rules_timeout_id);
+    ws->xkb_rules_timeout_id = 0;
+  }
 }
 
 static void _get_keyboard_data(Display *display)
 {
-  gint max_keycodes;
-
   if (_is_exist_keyboard_data() || _keyboard_data.is_failed) {
     return;
   }
 
   debug_print("Get keyboard data");
 
-  XDisplayKeycodes(display, &_keyboard_data.min_keycodes, &max_keycodes);
-  _keyboard_data.num_keycodes = max_keycodes - _keyboard_data.min_keycodes + 1;
-  _keyboard_data.keysyms =
-    XGetKeyboardMapping(display,
-                        _keyboard_data.min_keycodes,
-                        _keyboard_data.num_keycodes,
-                        &_keyboard_data.keysyms_per_keycode);
-  if (!_keyboard_data.keysyms) {
-    print_error("XGetKeyboardMapping failed!");
-  }
+  ki_get_server_keyboard_mapping(display, &_keyboard_data.mapping);
+  _get_keyboard_controls(display);
+}
 
-  _keyboard_data.modmap = XGetModifierMapping(display);
-  if (!_keyboard_data.modmap) {
-    print_error("XGetModifierMapping failed!");
+static void _get_keyboard_controls(Display *display)
+{
+  if (_keyboard_data.xkb || _keyboard_data.is_failed) {
+    return;
   }
 
   _keyboard_data.xkb = XkbAllocKeyboard();
   if (!_keyboard_data.xkb) {
     print_error("XkbAllocKeyboard failed!");
-  } else if (XkbGetControls(display, XkbAllControlsMask, _keyboard_data.xkb)
-             != Success) {
+    return;
+  }
+  metrics_count(METRICS_X_ROUND_TRIPS);
+  if (XkbGetControls(display, XkbAllControlsMask, _keyboard_data.xkb)
+      != Success) {
     print_error("XkbGetControls failed!");
     XkbFreeKeyboard(_keyboard_data.xkb, 0, True);
     _keyboard_data.xkb = NULL;
   }
 }
 
+/* Repeat controls are kept by keyboard-device.c until they are changed */
+static void _select_controls_notify(Display *display, WindowSystem *ws)
+{
+  const unsigned long mask = XkbRepeatKeysMask|XkbControlsEnabledMask;
+  gint major = XkbMajorVersion;
+  gint minor = XkbMinorVersion;
+
+  if (!XkbQueryExtension(display, NULL, &ws->xkb_event_type, NULL,
+                         &major, &minor)) {
+    g_warning("XKB extension is not available");
+    ws->xkb_event_type = -1;
+    return;
+  }
+  XkbSelectEventDetails(display,
+                        XkbUseCoreKbd,
+                        XkbControlsNotify,
+                        mask,
+                        mask);
+}
+
 static void _set_keyboard_data(Display *display)
 {
-  debug_print("Set keyboard data");
+  gint retries;
 
-  if (_keyboard_data.keysyms) {
-    XChangeKeyboardMapping(display,
-                           _keyboard_data.min_keycodes,
-                           _keyboard_data.keysyms_per_keycode,
-                           _keyboard_data.keysyms,
-                           _keyboard_data.num_keycodes);
-    XFree(_keyboard_data.keysyms);
-    _keyboard_data.keysyms = NULL;
-  }
-
-  if (_keyboard_data.modmap) {
-    gint retries;
-
-    for (retries = 20; retries > 0; retries--) {
-      gint status = XSetModifierMapping(display, _keyboard_data.modmap);
-      if (status == MappingBusy) {
-        g_usleep(100000);
-        continue;
-      }
-      if (status != MappingSuccess) {
-        _keyboard_data.is_failed = TRUE;
-        print_error("XSetModifierMapping returns=%d", status);
-      }
+  _set_keyboard_mapping(display);
+  for (retries = _MAPPING_BUSY_RETRIES; retries > 0; retries--) {
+    if (_set_modifier_mapping(display) != MappingBusy) {
       break;
     }
-    if (!retries) {
-      g_warning("XSetModifierMapping failed by MappingBusy");
-    }
-    XFreeModifiermap(_keyboard_data.modmap);
-    _keyboard_data.modmap = NULL;
+    g_usleep(_MAPPING_BUSY_INTERVAL * 1000);
+  }
+  if (!retries) {
+    g_warning("XSetModifierMapping failed by MappingBusy");
+    XFreeModifiermap(_keyboard_data.mapping.modmap);
+    _keyboard_data.mapping.modmap = NULL;
+  }
+  _set_keyboard_controls(display);
+}
+
+static void _set_keyboard_mapping(Display *display)
+{
+  debug_print("Set keyboard data");
+
+  if (_keyboard_data.mapping.key_syms) {
+    XChangeKeyboardMapping(display,
+                           _keyboard_data.mapping.min_key_code,
+                           _keyboard_data.mapping.key_syms_per_key_code,
+                           _keyboard_data.mapping.key_syms,
+                           _keyboard_data.mapping.num_key_codes);
+    XFree(_keyboard_data.mapping.key_syms);
+    _keyboard_data.mapping.key_syms = NULL;
+  }
+}
+
+static gint _set_modifier_mapping(Display *display)
+{
+  gint status;
+
+  if (!_keyboard_data.mapping.modmap) {
+    return MappingSuccess;
+  }
+  metrics_count(METRICS_X_ROUND_TRIPS);
+  status = XSetModifierMapping(display, _keyboard_data.mapping.modmap);
+  if (status == MappingBusy) {
+    debug_print("XSetModifierMapping returns MappingBusy");
+    return status;
+  }
+  if (status != MappingSuccess) {
+    _keyboard_data.is_failed = TRUE;
+    print_error("XSetModifierMapping returns=%d", status);
   }
+  XFreeModifiermap(_keyboard_data.mapping.modmap);
+  _keyboard_data.mapping.modmap = NULL;
+  return status;
+}
 
+static void _set_keyboard_controls(Display *display)
+{
   if (_keyboard_data.xkb) {
     if (!XkbSetControls(display, XkbAllControlsMask, _keyboard_data.xkb)) {
       _keyboard_data.is_failed = TRUE;
@@ -376,48 +895,15 @@ static void _set_keyboard_data(Display *display)
     _keyboard_data.xkb = NULL;
   }
 
+  metrics_count(METRICS_X_ROUND_TRIPS);
   XSync(display, FALSE);
 }
 
 static void _free_keyboard_data()
 {
-  if (_keyboard_data.keysyms) {
-    XFree(_keyboard_data.keysyms);
-    _keyboard_data.keysyms = NULL;
-  }
-  if (_keyboard_data.modmap) {
-    XFreeModifiermap(_keyboard_data.modmap);
-    _keyboard_data.modmap = NULL;
-  }
+  ki_free_keyboard_mapping(&_keyboard_data.mapping);
   if (_keyboard_data.xkb) {
     XkbFreeKeyboard(_keyboard_data.xkb, 0, True);
     _keyboard_data.xkb = NULL;
   }
 }
-
-static gint _poll_display(Display *display, gint timeout)
-{
-  GPollFD fds;
-  fds.fd = ConnectionNumber(display);
-  fds.events = G_IO_IN | G_IO_HUP | G_IO_ERR;
-
-  for (;;) {
-    gint status = g_poll(&fds, 1, timeout);
-    if (status > 0) {
-      if (fds.revents & G_IO_HUP) {
-        print_error("Hang up on display");
-        return -1;
-      }
-      if (fds.revents & G_IO_ERR) {
-        print_error("I/O Error on display");
-        return -1;
-      }
-    } else if (status < 0) {
-      if (errno == EINTR) {
-        continue;
-      }
-      print_error("g_poll failed!");
-    }
-    return status;
-  }
-}
@@ -20,23 +20,58 @@
 #ifndef _WINDOW_SYSTEM_H
 #define _WINDOW_SYSTEM_H
 
+#include <xcb/xcb.h>
+
 #include "x-set-keys.h"
 #include "device.h"
 
+typedef enum XkbRulesState_ {
+  XKB_RULES_IDLE,
+  XKB_RULES_WAITING,
+  XKB_RULES_WAITING_MORE,
+  XKB_RULES_RESTORING
+} XkbRulesState;
+
+/* Reply of a request sent through xcb.  Other X calls may read it from
+ * the connection without making the fd readable, so it is also polled
+ * when the main loop checks for pending events, and kept until used. */
+typedef struct WindowSystemReply_ {
+  guint sequence;
+  gboolean is_polled;
+  void *reply;
+  xcb_generic_error_t *error;
+} WindowSystemReply;
+
 typedef struct WindowSystem_ {
   Device device;
-  gchar **excluded_classes;
+  Display *display;
+  xcb_connection_t *connection;
+  GHashTable *excluded_classes;
+  GHashTable *class_cache;
   Atom active_window_atom;
   Atom xkb_rules_atom;
+  gint xkb_event_type;
   Window focus_window;
+  gint64 focus_change_time;
   gboolean is_excluded;
+  WindowSystemReply active_window_reply;
+  Window class_window;
+  WindowSystemReply class_reply;
+  WindowSystemReply tree_reply;
+  XkbRulesState xkb_rules_state;
+  guint xkb_rules_timeout_id;
+  gint mapping_busy_retries;
+  KeyCodeArray *released_keys;
 } WindowSystem;
 
 WindowSystem *window_system_initialize(XSetKeys *xsk,
                                        gchar *excluded_classes[]);
 void window_system_pre_finalize(XSetKeys *xsk);
 void window_system_finalize(XSetKeys *xsk, gboolean is_restart);
+void window_system_keep_keyboard_mapping(XSetKeys *xsk,
+                                         KIKeyboardMapping *mapping);
 
-#define window_system_is_excluded(xsk) (xsk_get_window_system(xsk)->is_excluded)
+#define window_system_is_excluded(xsk)                                  \
+  (xsk_get_window_system(xsk) && xsk_get_window_system(xsk)->is_excluded)
 
 #endif  /* _WINDOW_SYSTEM_H */
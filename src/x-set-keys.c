@@ -21,14 +21,21 @@
 #include "x-set-keys.h"
 #include "window-system.h"
 #include "fcitx.h"
+#include "config.h"
+#include "config-monitor.h"
 #include "action.h"
 #include "keyboard-device.h"
 #include "uinput-device.h"
+#include "latency.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
 
 #define _reset_current_actions(xsk)                 \
   ((xsk)->current_actions = (xsk)->root_actions)
 
 static const Action *_lookup_action(XSetKeys *xsk, KeyCode key_code);
+static XskResult _run_action(XSetKeys *xsk, const Action *action);
 static XskResult _key_pressed_on_selection_mode(XSetKeys *xsk,
                                                 KeyCode key_code);
 static gboolean _send_regular_modifiers_event(XSetKeys *xsk,
@@ -40,42 +47,62 @@ static gboolean
 _adds_shift_on_selection_mode(XSetKeys *xsk,
                               KeyCode key_code,
                               const KeyCodeArray *pressing_keys);
-static gboolean _send_key_events(XSetKeys *xsk, const KeyCode *keys);
+static int _emit_key_event(void *xsk, uint8_t key_code, int is_press);
 
-gboolean xsk_initialize(XSetKeys *xsk, gchar *excluded_classes[])
+/* With `is_replay', no X display is opened, since replay.c gives the
+ * keyboard mapping and the repeat controls, and follows no window. */
+gboolean xsk_initialize(XSetKeys *xsk,
+                        gchar *excluded_classes[],
+                        gboolean is_replay)
 {
-  xsk->display = XOpenDisplay(NULL);
-  if (!xsk->display) {
-    g_critical("Could not create X11 display");
-    return FALSE;
-  }
-  xsk->window_system = window_system_initialize(xsk, excluded_classes);
-  if (!xsk->window_system) {
-    return FALSE;
+  if (!is_replay) {
+    xsk->display = XOpenDisplay(NULL);
+    if (!xsk->display) {
+      g_critical("Could not create X11 display");
+      return FALSE;
+    }
+    xsk->window_system = window_system_initialize(xsk, excluded_classes);
+    if (!xsk->window_system) {
+      return FALSE;
+    }
   }
-  ki_initialize(xsk->display, &xsk->key_information);
-  xsk->root_actions = action_list_new();
+  xsk->default_actions = action_list_new();
+  xsk->profile_actions = g_hash_table_new_full(g_direct_hash,
+                                               g_direct_equal,
+                                               NULL,
+                                               action_list_free);
+  xsk->root_actions = xsk->default_actions;
   return TRUE;
 }
 
+/* With `is_replay', the keyboard and uinput devices are replaced by the
+ * ones for replay.c, and neither fcitx nor the configuration file is
+ * monitored. */
 gboolean xsk_start(XSetKeys *xsk,
                    const gchar *device_filepath,
-                   gchar *excluded_fcitx_input_methods[])
+                   gchar *excluded_fcitx_input_methods[],
+                   gboolean is_replay)
 {
-  if (excluded_fcitx_input_methods) {
+  if (excluded_fcitx_input_methods && !is_replay) {
     xsk->fcitx = fcitx_initialize(xsk, excluded_fcitx_input_methods);
     if (!xsk->fcitx) {
       return FALSE;
     }
   }
-  xsk->keyboard_device = kd_initialize(xsk, device_filepath);
+  xsk->keyboard_device = is_replay
+    ? kd_initialize_replay(xsk) : kd_initialize(xsk, device_filepath);
   if (!xsk->keyboard_device) {
     return FALSE;
   }
-  xsk->uinput_device = ud_initialize(xsk);
+  xsk->uinput_device = is_replay ? ud_initialize_replay(xsk) : ud_initialize(xsk);
   if (!xsk->uinput_device) {
     return FALSE;
   }
+  /* Not fatal, the configuration file can still be reloaded by SIGHUP */
+  if (!is_replay) {
+    xsk->config_monitor =
+      config_monitor_initialize(xsk, xsk_get_config(xsk)->filepath);
+  }
   xsk_reset_state(xsk);
   return TRUE;
 }
@@ -94,8 +121,17 @@ void xsk_finalize(XSetKeys *xsk, gboolean is_restart)
   if (xsk->fcitx) {
     fcitx_finalize(xsk);
   }
-  if (xsk->root_actions) {
-    action_list_free(xsk->root_actions);
+  if (xsk->config_monitor) {
+    config_monitor_finalize(xsk);
+  }
+  if (xsk->config) {
+    config_finalize(xsk);
+  }
+  if (xsk->profile_actions) {
+    g_hash_table_destroy(xsk->profile_actions);
+  }
+  if (xsk->default_actions) {
+    action_list_free(xsk->default_actions);
   }
   if (xsk->window_system) {
     window_system_finalize(xsk, is_restart);
@@ -109,18 +145,20 @@ XskResult xsk_handle_key_press(XSetKeys *xsk, KeyCode key_code)
 {
   const Action *action;
 
+  probe1(key_press, key_code);
   if (xsk_is_excluded(xsk)) {
     return XSK_UNCONSUMED;
   }
   action = _lookup_action(xsk, key_code);
   if (action) {
-    _reset_current_actions(xsk);
-    return action->run(xsk, action) ? XSK_CONSUMED : XSK_FAILED;
+    return _run_action(xsk, action);
   }
   if (!ki_is_modifier(&xsk->key_information, key_code)) {
     if (xsk->current_actions != xsk->root_actions) {
       _reset_current_actions(xsk);
-      g_warning("Key sequence canceled");
+      metrics_count(METRICS_KEY_SEQUENCES_CANCELED);
+      trace_record(TRACE_KEY_SEQUENCE_CANCELED, 0, key_code, 0);
+      debug_print("Key sequence canceled");
     }
     if (xsk->is_selection_mode) {
       return _key_pressed_on_selection_mode(xsk, key_code);
@@ -136,6 +174,7 @@ XskResult xsk_handle_key_repeat(XSetKeys *xsk,
   const Action *action;
   XskResult result;
 
+  probe2(key_repeat, key_code, is_after_key_repeat_delay);
   if (ud_is_key_pressed(xsk, key_code)) {
     if (xsk_is_excluded(xsk)) {
       return XSK_UNCONSUMED;
@@ -153,8 +192,7 @@ XskResult xsk_handle_key_repeat(XSetKeys *xsk,
     if (!ud_send_key_event(xsk, key_code, FALSE, FALSE)) {
       return XSK_FAILED;
     }
-    _reset_current_actions(xsk);
-    return action->run(xsk, action) ? XSK_CONSUMED : XSK_FAILED;
+    return _run_action(xsk, action);
   }
 
   if (!is_after_key_repeat_delay) {
@@ -179,24 +217,18 @@ gboolean xsk_send_key_events(XSetKeys *xsk, const KeyCodeArrayArray *key_arrays)
        index < key_code_array_array_get_length(key_arrays);
        index++) {
     const KeyCodeArray *array = key_code_array_array_get_at(key_arrays, index);
-    gboolean adds_shift = _adds_shift_on_send_keys(xsk, array);
-    KeyCode shift_code;
+    KeyCode shift_code = 0;
 
-    if (adds_shift) {
+    if (_adds_shift_on_send_keys(xsk, array)) {
       shift_code = ki_get_modifier_key_code(&xsk->key_information,
                                             KI_MODIFIER_SHIFT);
-      if (!ud_send_key_event(xsk, shift_code, TRUE, TRUE)) {
-        return FALSE;
-      }
     }
-    if (!_send_key_events(xsk, &key_code_array_get_at(array, 0))) {
+    if (!engine_emit_keys(&key_code_array_get_at(array, 0),
+                          shift_code,
+                          _emit_key_event,
+                          xsk)) {
       return FALSE;
     }
-    if (adds_shift) {
-      if (!ud_send_key_event(xsk, shift_code, FALSE, TRUE)) {
-        return FALSE;
-      }
-    }
   }
   if (!_send_regular_modifiers_event(xsk, ud_get_pressing_keys(xsk), TRUE)) {
     return FALSE;
@@ -206,8 +238,9 @@ gboolean xsk_send_key_events(XSetKeys *xsk, const KeyCodeArrayArray *key_arrays)
 
 void xsk_toggle_selection_mode(XSetKeys *xsk)
 {
-  debug_print("%s selection mode", xsk->is_selection_mode ? "Exit" : "Enter" );
   xsk->is_selection_mode = !xsk->is_selection_mode;
+  metrics_count(METRICS_SELECTION_MODE_TOGGLES);
+  trace_record(TRACE_SELECTION_MODE, 0, 0, xsk->is_selection_mode);
 }
 
 gboolean xsk_is_excluded(XSetKeys *xsk)
@@ -221,29 +254,90 @@ void xsk_reset_state(XSetKeys *xsk)
   xsk->is_selection_mode = FALSE;
 }
 
-void xsk_mapping_changed(XSetKeys *xsk)
+/* Replaces the key information and all the actions at once, so that no
+ * key event is handled with partially updated actions.  The given actions
+ * are taken over. */
+void xsk_replace_actions(XSetKeys *xsk,
+                         const KeyInformation *key_info,
+                         ActionList *default_actions,
+                         GHashTable *profile_actions)
 {
-  ki_initialize(xsk->display, &xsk->key_information);
-  if (xsk->root_actions) {
-    action_list_free(xsk->root_actions);
-  }
-  xsk->root_actions = action_list_new();
+  gint64 start_time = is_debug ? g_get_monotonic_time() : 0;
+
+  xsk->key_information = *key_info;
+  g_hash_table_destroy(xsk->profile_actions);
+  action_list_free(xsk->default_actions);
+  debug_print("Old actions freed in %" G_GINT64_FORMAT " us",
+              g_get_monotonic_time() - start_time);
+  xsk->default_actions = default_actions;
+  xsk->profile_actions = profile_actions;
+  xsk->root_actions = NULL;
+  xsk_select_profile(xsk);
   xsk_reset_state(xsk);
 }
 
+void xsk_set_focus_class(XSetKeys *xsk, GQuark res_name, GQuark res_class)
+{
+  xsk->focus_class[0] = res_name;
+  xsk->focus_class[1] = res_class;
+  xsk_select_profile(xsk);
+}
+
+void xsk_select_profile(XSetKeys *xsk)
+{
+  ActionList *actions = NULL;
+  gint index;
+
+  for (index = 0; index < array_num(xsk->focus_class); index++) {
+    if (!xsk->focus_class[index]) {
+      continue;
+    }
+    actions = g_hash_table_lookup(xsk->profile_actions,
+                                  GUINT_TO_POINTER(xsk->focus_class[index]));
+    if (actions) {
+      break;
+    }
+  }
+  if (!actions) {
+    actions = xsk->default_actions;
+  }
+  if (actions != xsk->root_actions) {
+    debug_print("Switch profile: %s",
+                actions == xsk->default_actions
+                ? "(default)" : g_quark_to_string(xsk->focus_class[index]));
+    xsk->root_actions = actions;
+    _reset_current_actions(xsk);
+  }
+}
+
 static const Action *_lookup_action(XSetKeys *xsk, KeyCode key_code)
 {
   KeyCombination kc;
+  const Action *action;
 
   kc = ki_pressing_keys_to_key_combination(&xsk->key_information,
                                            key_code,
                                            kd_get_pressing_keys(xsk));
-  return action_list_lookup(xsk->current_actions, kc);
+  action = action_list_lookup(xsk->current_actions, kc);
+  probe2(lookup_action, kc.i, action != NULL);
+  return action;
+}
+
+static XskResult _run_action(XSetKeys *xsk, const Action *action)
+{
+  gboolean result;
+
+  _reset_current_actions(xsk);
+  probe1(action_run, action->type);
+  result = action->run(xsk, action);
+  probe2(action_run_done, action->type, result);
+  return result ? XSK_CONSUMED : XSK_FAILED;
 }
 
 static XskResult _key_pressed_on_selection_mode(XSetKeys *xsk,
                                                 KeyCode key_code)
 {
+  const KeyCode keys[] = { key_code, 0 };
   KeyCode shift_code;
 
   if (!_adds_shift_on_selection_mode(xsk,
@@ -251,6 +345,7 @@ static XskResult _key_pressed_on_selection_mode(XSetKeys *xsk,
                                      ud_get_pressing_keys(xsk))) {
     return XSK_UNCONSUMED;
   }
+  latency_set_class(LATENCY_CLASS_SELECTION);
 
   if (ud_is_key_pressed(xsk, key_code)) {
     if (!ud_send_key_event(xsk, key_code, FALSE, FALSE)) {
@@ -260,16 +355,7 @@ static XskResult _key_pressed_on_selection_mode(XSetKeys *xsk,
 
   shift_code = ki_get_modifier_key_code(&xsk->key_information,
                                         KI_MODIFIER_SHIFT);
-  if (!ud_send_key_event(xsk, shift_code, TRUE, TRUE)) {
-    return XSK_FAILED;
-  }
-  if (!ud_send_key_event(xsk, key_code, TRUE, TRUE)) {
-    return XSK_FAILED;
-  }
-  if (!ud_send_key_event(xsk, key_code, FALSE, TRUE)) {
-    return XSK_FAILED;
-  }
-  if (!ud_send_key_event(xsk, shift_code, FALSE, TRUE)) {
+  if (!engine_emit_keys(keys, shift_code, _emit_key_event, xsk)) {
     return XSK_FAILED;
   }
   return XSK_CONSUMED;
@@ -279,17 +365,11 @@ static gboolean _send_regular_modifiers_event(XSetKeys *xsk,
                                               const KeyCodeArray *keys,
                                               gboolean is_press)
 {
-  const KeyCode *pointer;
-
-  for (pointer = &key_code_array_get_at(keys, 0); *pointer; pointer++) {
-    if (!ki_is_regular_modifier(&xsk->key_information, *pointer)) {
-      continue;
-    }
-    if (!ud_send_key_event(xsk, *pointer, is_press, TRUE)) {
-      return FALSE;
-    }
-  }
-  return TRUE;
+  return engine_emit_regular_modifiers(&xsk->key_information,
+                                       &key_code_array_get_at(keys, 0),
+                                       is_press,
+                                       _emit_key_event,
+                                       xsk);
 }
 
 static gboolean _adds_shift_on_send_keys(XSetKeys *xsk,
@@ -308,32 +388,24 @@ static gboolean _adds_shift_on_selection_mode(XSetKeys *xsk,
                                               KeyCode key_code,
                                               const KeyCodeArray *pressing_keys)
 {
-  if (ki_is_cursor(&xsk->key_information, key_code)) {
-    if (!ki_contains_modifier(&xsk->key_information,
-                              pressing_keys,
-                              KI_MODIFIER_SHIFT)) {
-      return TRUE;
-    }
-  } else if (!ki_is_modifier(&xsk->key_information, key_code)) {
-    g_warning("Selection mode canceled");
+  switch (engine_check_selection_key(&xsk->key_information,
+                                     key_code,
+                                     &key_code_array_get_at(pressing_keys, 0),
+                                     KI_MODIFIER_SHIFT)) {
+  case ENGINE_SELECTION_ADD_SHIFT:
+    return TRUE;
+  case ENGINE_SELECTION_CANCEL:
+    debug_print("Selection mode canceled");
     xsk_toggle_selection_mode(xsk);
+    break;
+  case ENGINE_SELECTION_KEEP:
+    break;
   }
   return FALSE;
 }
 
-static gboolean _send_key_events(XSetKeys *xsk, const KeyCode *keys)
+/* Output of the engine, sent as temporary key events */
+static int _emit_key_event(void *xsk, uint8_t key_code, int is_press)
 {
-  if (!*keys) {
-    return TRUE;
-  }
-  if (!ud_send_key_event(xsk, *keys, TRUE, TRUE)) {
-    return FALSE;
-  }
-  if (!_send_key_events(xsk, keys + 1)) {
-    return FALSE;
-  }
-  if (!ud_send_key_event(xsk, *keys, FALSE, TRUE)) {
-    return FALSE;
-  }
-  return TRUE;
+  return ud_send_key_event(xsk, key_code, is_press, TRUE);
 }
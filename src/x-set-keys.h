@@ -32,8 +32,13 @@ typedef struct XSetKeys_ {
   KeyInformation key_information;
   struct WindowSystem_ *window_system;
   struct Fcitx_ *fcitx;
+  struct Config_ *config;
+  struct ConfigMonitor_ *config_monitor;
   ActionList *root_actions;
   const ActionList *current_actions;
+  ActionList *default_actions;
+  GHashTable *profile_actions;
+  GQuark focus_class[2];
   struct KeyboardDevice_ *keyboard_device;
   struct UInputDevice_ *uinput_device;
   gboolean is_selection_mode;
@@ -45,10 +50,13 @@ typedef enum XskResult_ {
   XSK_FAILED
 } XskResult;
 
-gboolean xsk_initialize(XSetKeys *xsk, gchar *excluded_classes[]);
+gboolean xsk_initialize(XSetKeys *xsk,
+                        gchar *excluded_classes[],
+                        gboolean is_replay);
 gboolean xsk_start(XSetKeys *xsk,
                    const gchar *device_filepath,
-                   gchar *excluded_fcitx_input_methods[]);
+                   gchar *excluded_fcitx_input_methods[],
+                   gboolean is_replay);
 void xsk_finalize(XSetKeys *xsk, gboolean is_restart);
 
 XskResult xsk_handle_key_press(XSetKeys *xsk, KeyCode key_code);
@@ -60,15 +68,25 @@ gboolean xsk_send_key_events(XSetKeys *xsk,
 void xsk_toggle_selection_mode(XSetKeys *xsk);
 gboolean xsk_is_excluded(XSetKeys *xsk);
 void xsk_reset_state(XSetKeys *xsk);
-void xsk_mapping_changed(XSetKeys *xsk);
+void xsk_replace_actions(XSetKeys *xsk,
+                         const KeyInformation *key_info,
+                         ActionList *default_actions,
+                         GHashTable *profile_actions);
+void xsk_set_focus_class(XSetKeys *xsk, GQuark res_name, GQuark res_class);
+void xsk_select_profile(XSetKeys *xsk);
 
 #define xsk_get_display(xsk) ((xsk)->display)
 #define xsk_get_key_information(xsk) (&(xsk)->key_information)
 #define xsk_get_window_system(xsk) ((xsk)->window_system)
 #define xsk_get_root_actions(xsk) ((xsk)->root_actions)
+#define xsk_get_default_actions(xsk) ((xsk)->default_actions)
+#define xsk_get_profile_actions(xsk) ((xsk)->profile_actions)
+#define xsk_has_profiles(xsk) (g_hash_table_size((xsk)->profile_actions) > 0)
 #define xsk_get_keyboard_device(xsk) ((xsk)->keyboard_device)
 #define xsk_get_uinput_device(xsk) ((xsk)->uinput_device)
 #define xsk_get_fcitx(xsk) ((xsk)->fcitx)
+#define xsk_get_config(xsk) ((xsk)->config)
+#define xsk_get_config_monitor(xsk) ((xsk)->config_monitor)
 
 #define xsk_set_current_actions(xsk, actions)   \
   ((xsk)->current_actions = (actions))
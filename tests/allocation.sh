@@ -0,0 +1,29 @@
+#!/bin/sh
+# Replays typing with emacslike.conf under malloc-count.so, and fails if
+# key events allocate on the heap, that is, if a replay of many events
+# allocates more than a replay of a few.
+# Usage: allocation.sh [<events>]
+
+[ -x ../src/x-set-keys ] || exit 77
+. ./xvfb.sh
+directory=`mktemp -d`
+trap 'kill $xvfb_pid 2> /dev/null; rm -rf "$directory"' EXIT
+XDG_CACHE_HOME=$directory
+export XDG_CACHE_HOME
+config=../emacslike.conf
+
+count_allocations() {
+  ./typing-record "$directory/typing.rec" $1 > /dev/null || exit 1
+  # The file has no outputs to compare with, the replay records them
+  ../src/x-set-keys --replay-file="$directory/typing.rec" \
+    --record-file="$directory/reference.rec" $config > /dev/null 2>&1
+  LD_PRELOAD=./malloc-count.so ../src/x-set-keys \
+    --replay-file="$directory/reference.rec" $config \
+    > "$directory/log" 2>&1 || { cat "$directory/log" >&2; exit 1; }
+  sed -n 's/^malloc-count: //p' "$directory/log"
+}
+
+few=`count_allocations 1000` || exit 1
+many=`count_allocations ${1:-1000000}` || exit 1
+echo "allocations: $few for 1000 events, $many for ${1:-1000000} events"
+[ -n "$few" ] && [ "$few" -eq "$many" ]
@@ -0,0 +1,152 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+/* Loads a generated configuration file of many multi stroke bindings,
+ * first by parsing it and then from the compiled cache, and frees the
+ * actions, see config-bench.sh */
+
+#define MAIN
+
+#include <stdlib.h>
+#include <sys/resource.h>
+
+#include "common.h"
+#include "config.h"
+#include "latency.h"
+#include "metrics.h"
+#include "window-system.h"
+
+#define _DEFAULT_NUM_BINDINGS 100000
+
+static gint64 _free_time;
+
+static gboolean _write_config(const gchar *filepath, gint num_bindings);
+static gboolean _load(XSetKeys *xsk, const gchar *filepath, const gchar *what);
+
+/* Called by config.c and action.c */
+void xsk_replace_actions(XSetKeys *xsk,
+                         const KeyInformation *key_info,
+                         ActionList *default_actions,
+                         GHashTable *profile_actions)
+{
+  gint64 start_time = g_get_monotonic_time();
+
+  if (xsk->profile_actions) {
+    g_hash_table_destroy(xsk->profile_actions);
+  }
+  if (xsk->default_actions) {
+    action_list_free(xsk->default_actions);
+  }
+  _free_time = g_get_monotonic_time() - start_time;
+  xsk->key_information = *key_info;
+  xsk->default_actions = default_actions;
+  xsk->profile_actions = profile_actions;
+}
+
+void window_system_keep_keyboard_mapping(XSetKeys *xsk,
+                                         KIKeyboardMapping *mapping)
+{
+}
+
+gboolean xsk_send_key_events(XSetKeys *xsk,
+                             const KeyCodeArrayArray *key_arrays)
+{
+  return TRUE;
+}
+
+void xsk_toggle_selection_mode(XSetKeys *xsk)
+{
+}
+
+gint main(gint argc, gchar *argv[])
+{
+  XSetKeys xsk = { 0 };
+  gint num_bindings = _DEFAULT_NUM_BINDINGS;
+  struct rusage usage;
+
+  if (argc < 2) {
+    g_printerr("Usage: %s <configfile> [<bindings>]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (argc > 2) {
+    num_bindings = atoi(argv[2]);
+  }
+  xsk.display = XOpenDisplay(NULL);
+  if (!xsk.display) {
+    g_printerr("Can not open display\n");
+    return 77;
+  }
+  if (!_write_config(argv[1], num_bindings)) {
+    return EXIT_FAILURE;
+  }
+
+  g_print("bindings: %d\n", num_bindings);
+  if (!_load(&xsk, argv[1], "parse") || !_load(&xsk, argv[1], "cache")) {
+    return EXIT_FAILURE;
+  }
+  xsk_replace_actions(&xsk, &xsk.key_information, action_list_new(), NULL);
+  g_print("free: %.1f ms\n", _free_time / 1000.0);
+  if (!getrusage(RUSAGE_SELF, &usage)) {
+    g_print("max RSS: %ld KB\n", usage.ru_maxrss);
+  }
+
+  action_list_free(xsk.default_actions);
+  config_finalize(&xsk);
+  XCloseDisplay(xsk.display);
+  return EXIT_SUCCESS;
+}
+
+/* The same bindings as the example in README.md */
+static gboolean _write_config(const gchar *filepath, gint num_bindings)
+{
+  GString *contents = g_string_new(NULL);
+  GError *error = NULL;
+  gint index;
+  gboolean result;
+
+  for (index = 0; index < num_bindings; index++) {
+    g_string_append_printf(contents,
+                           "C-%c %c %c %c :: Return\n",
+                           'a' + index / 17576 % 26,
+                           'a' + index / 676 % 26,
+                           'a' + index / 26 % 26,
+                           'a' + index % 26);
+  }
+  result = g_file_set_contents(filepath, contents->str, contents->len, &error);
+  if (!result) {
+    g_printerr("%s\n", error->message);
+    g_error_free(error);
+  }
+  g_string_free(contents, TRUE);
+  return result;
+}
+
+static gboolean _load(XSetKeys *xsk, const gchar *filepath, const gchar *what)
+{
+  gint64 start_time = g_get_monotonic_time();
+
+  if (!config_load(xsk, filepath)) {
+    return FALSE;
+  }
+  g_print("%s: %.1f ms, actions=%" G_GINT64_FORMAT "\n",
+          what,
+          (g_get_monotonic_time() - start_time) / 1000.0,
+          metrics_gauges[METRICS_LIVE_ACTIONS]);
+  return TRUE;
+}
@@ -0,0 +1,9 @@
+#!/bin/sh
+# Reports the time to parse a large generated configuration file, to load
+# it from the compiled cache and to free its actions.
+# Usage: config-bench.sh [<bindings>]
+
+. ./xvfb.sh
+directory=`mktemp -d`
+trap 'kill $xvfb_pid 2> /dev/null; rm -rf "$directory"' EXIT
+XDG_CACHE_HOME=$directory ./config-bench "$directory/large.conf" $1
@@ -0,0 +1,172 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+/* Measures the per event work of the key engine, folding the pressed
+ * modifiers and emitting the frame of a two key action, and the lookup
+ * of a key combination in an action list.  Run by make bench, or as
+ * engine-bench [<actions>] */
+
+#define MAIN
+
+#include <stdlib.h>
+
+#include "common.h"
+#include "engine.h"
+#include "x-set-keys.h"
+
+#define _NUM_ITERATIONS 10000000
+#define _DEFAULT_NUM_ACTIONS 1000
+#define _NUM_LOOKUP_KEYS 4096
+#define _MIN_KEY_CODE 8
+
+/* X key codes of the usual evdev keymap */
+#define _KEY_CODE_CONTROL_L 37
+#define _KEY_CODE_A 38
+#define _KEY_CODE_SHIFT_L 50
+#define _KEY_CODE_CAPS_LOCK 66
+#define _KEY_CODE_RETURN 36
+
+static int _count_key_event(void *user_data, uint8_t key_code, int is_press);
+static ActionList *_new_action_list(gint num_actions);
+static void _print_time(const gchar *what, gint64 start_time, gint count);
+
+/* Called by action.c */
+gboolean xsk_send_key_events(XSetKeys *xsk,
+                             const KeyCodeArrayArray *key_arrays)
+{
+  return TRUE;
+}
+
+void xsk_toggle_selection_mode(XSetKeys *xsk)
+{
+}
+
+gint main(gint argc, gchar *argv[])
+{
+  EngineKeyTable table = { { 0 } };
+  const uint8_t pressing_keys[] = {
+    _KEY_CODE_CONTROL_L, _KEY_CODE_CAPS_LOCK, _KEY_CODE_A, 0
+  };
+  const uint8_t keys[] = { _KEY_CODE_CONTROL_L, _KEY_CODE_A, 0 };
+  KeyCombination lookup_keys[_NUM_LOOKUP_KEYS];
+  volatile guint result = 0;
+  glong num_key_events = 0;
+  ActionList *actions;
+  gint num_actions = _DEFAULT_NUM_ACTIONS;
+  gint64 start_time;
+  gint index;
+
+  if (argc > 1) {
+    num_actions = atoi(argv[1]);
+  }
+  num_actions = CLAMP(num_actions,
+                      1,
+                      (ENGINE_NUM_KEY_CODES - _MIN_KEY_CODE)
+                      << KI_NUM_MODIFIER);
+
+  table.modifier_mask_or_key_kind[_KEY_CODE_CONTROL_L] =
+    1 << KI_MODIFIER_CONTROL;
+  table.modifier_mask_or_key_kind[_KEY_CODE_SHIFT_L] = 1 << KI_MODIFIER_SHIFT;
+  table.modifier_mask_or_key_kind[_KEY_CODE_CAPS_LOCK] =
+    ENGINE_KIND_MODIFIER_OTHER;
+
+  start_time = g_get_monotonic_time();
+  for (index = 0; index < _NUM_ITERATIONS; index++) {
+    result += engine_fold_modifiers(&table, _KEY_CODE_A, pressing_keys);
+  }
+  _print_time("fold modifiers", start_time, _NUM_ITERATIONS);
+
+  start_time = g_get_monotonic_time();
+  for (index = 0; index < _NUM_ITERATIONS; index++) {
+    engine_emit_keys(keys,
+                     _KEY_CODE_SHIFT_L,
+                     _count_key_event,
+                     &num_key_events);
+  }
+  _print_time("emit two keys", start_time, _NUM_ITERATIONS);
+
+  actions = _new_action_list(num_actions);
+  /* Hits and misses in a scattered order, as typed keys are */
+  for (index = 0; index < _NUM_LOOKUP_KEYS; index++) {
+    guint value = (guint)index * 2654435761u;
+
+    key_combination_set_value(lookup_keys[index],
+                              _MIN_KEY_CODE
+                              + value % (ENGINE_NUM_KEY_CODES - _MIN_KEY_CODE),
+                              (value >> 16) % (1 << KI_NUM_MODIFIER));
+  }
+  start_time = g_get_monotonic_time();
+  for (index = 0; index < _NUM_ITERATIONS; index++) {
+    if (action_list_lookup(actions,
+                           lookup_keys[index % _NUM_LOOKUP_KEYS])) {
+      result++;
+    }
+  }
+  g_print("actions: %d\n", action_list_get_length(actions));
+  _print_time("lookup action", start_time, _NUM_ITERATIONS);
+  action_list_free(actions);
+
+  if (num_key_events != (glong)_NUM_ITERATIONS * 6) {
+    g_printerr("Unexpected number of key events: %ld\n", num_key_events);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+static int _count_key_event(void *user_data, uint8_t key_code, int is_press)
+{
+  (*(glong *)user_data)++;
+  return 1;
+}
+
+/* Single stroke actions of `num_actions' key combinations, spread over
+ * all key codes and modifiers */
+static ActionList *_new_action_list(gint num_actions)
+{
+  ActionList *actions = action_list_new();
+  KeyCombinationArray *input_keys = key_combination_array_new(1);
+  KeyCodeArrayArray *output_keys = key_code_array_array_new(1);
+  KeyCombination key_combination;
+  KeyCodeArray *key_codes;
+  KeyCode key_code = _KEY_CODE_RETURN;
+  gint index;
+
+  for (index = 0; index < num_actions; index++) {
+    key_combination_set_value(key_combination,
+                              _MIN_KEY_CODE
+                              + index % (ENGINE_NUM_KEY_CODES - _MIN_KEY_CODE),
+                              index / (ENGINE_NUM_KEY_CODES - _MIN_KEY_CODE));
+    key_combination_array_clear(input_keys);
+    key_combination_array_add(input_keys, key_combination);
+    key_codes = key_code_array_new(1);
+    key_code_array_add(key_codes, key_code);
+    key_code_array_array_add(output_keys, key_codes);
+    action_list_add_key_action(actions, input_keys, output_keys);
+  }
+  key_code_array_array_free(output_keys);
+  key_combination_array_free(input_keys);
+  return actions;
+}
+
+static void _print_time(const gchar *what, gint64 start_time, gint count)
+{
+  g_print("%s: %.1f ns\n",
+          what,
+          (g_get_monotonic_time() - start_time) * 1000.0 / count);
+}
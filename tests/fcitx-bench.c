@@ -0,0 +1,293 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+/* Runs fcitx.c against the mock of org.fcitx.Fcitx emitting a burst of
+ * PropertiesChanged at a given rate, while a thread standing in for the
+ * keyboard device writes the time to a pipe every millisecond.  Prints
+ * percentiles of the time from the emission of a signal switching to the
+ * excluded input method until fcitx.c excludes it, and of the time the key
+ * events wait in the main loop without and during the burst, see
+ * fcitx-bench.sh */
+
+#define MAIN
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <glib-unix.h>
+
+#include "common.h"
+#include "fcitx.h"
+#include "fcitx-mock.h"
+#include "metrics.h"
+#include "test-keyboard.h"
+
+/* PropertiesChanged per second */
+#define _DEFAULT_RATE 1000
+/* Seconds of each of the idle and burst phases */
+#define _PHASE_TIME 2
+/* Microseconds between key events */
+#define _KEY_INTERVAL 1000
+#define _WAIT_TIMEOUT (5 * G_USEC_PER_SEC)
+
+#define _check(expression)                                              \
+  ((expression) ? (void)0                                               \
+   : (g_printerr("%s:%d: check failed: %s\n",                           \
+                 __FILE__, __LINE__, #expression), exit(EXIT_FAILURE)))
+
+static FcitxMock *_mock;
+static gint _num_signals;
+static gint64 _interval;
+/* Of every other signal, which switches to the excluded input method */
+static gint64 *_emission_times;
+static gint64 *_exclusion_times;
+static gint _num_exclusions;
+static gint _is_emitted;
+static gint _key_fds[2];
+static gint _is_typing;
+static gboolean _is_burst;
+static GArray *_idle_waits;
+static GArray *_burst_waits;
+
+static gint64 _get_time();
+static gpointer _emit_burst(gpointer data);
+static gpointer _type_keys(gpointer data);
+static gboolean _handle_keys(gint fd, GIOCondition condition,
+                             gpointer user_data);
+static void _wait(gboolean (*condition)(XSetKeys *xsk),
+                  XSetKeys *xsk,
+                  gint64 timeout);
+static gboolean _is_owned(XSetKeys *xsk);
+static gboolean _is_subscribed(XSetKeys *xsk);
+static gboolean _is_idle(XSetKeys *xsk);
+static gboolean _is_burst_done(XSetKeys *xsk);
+static void _print_added(GArray *idle_waits, GArray *burst_waits);
+
+/* Called by fcitx.c */
+gboolean xsk_is_excluded(XSetKeys *xsk)
+{
+  return fcitx_is_excluded(xsk);
+}
+
+/* Called once for each switch to the excluded input method */
+void xsk_reset_state(XSetKeys *xsk)
+{
+  if (_num_exclusions < (_num_signals + 1) / 2) {
+    _exclusion_times[_num_exclusions++] = _get_time();
+  }
+}
+
+gint main(gint argc, gchar *argv[])
+{
+  gchar *excluded[] = { FCITX_MOCK_EXCLUDED, NULL };
+  gchar *uid_string = g_strdup_printf("%d", getuid());
+  XSetKeys xsk = { 0 };
+  gint rate = _DEFAULT_RATE;
+  GThread *typing_thread;
+  GThread *burst_thread;
+  gint64 end_time;
+  gint index;
+
+  if (!g_getenv("DBUS_SESSION_BUS_ADDRESS")) {
+    g_printerr("Run with dbus-run-session\n");
+    return 77;
+  }
+  if (argc > 1) {
+    rate = MAX(atoi(argv[1]), 1);
+  }
+  _num_signals = MAX(rate * _PHASE_TIME, 2);
+  _interval = G_GINT64_CONSTANT(1000000000) / rate;
+  _emission_times = g_new(gint64, (_num_signals + 1) / 2);
+  _exclusion_times = g_new(gint64, (_num_signals + 1) / 2);
+  _idle_waits = g_array_new(FALSE, FALSE, sizeof (gint64));
+  _burst_waits = g_array_new(FALSE, FALSE, sizeof (gint64));
+
+  /* fcitx.c connects to the bus as the user who ran sudo */
+  g_setenv("SUDO_UID", uid_string, TRUE);
+  g_free(uid_string);
+
+  _mock = fcitx_mock_start();
+  _wait(_is_owned, &xsk, _WAIT_TIMEOUT);
+  xsk.fcitx = fcitx_initialize(&xsk, excluded);
+  _check(xsk.fcitx != NULL);
+  _wait(_is_subscribed, &xsk, _WAIT_TIMEOUT);
+  _wait(_is_idle, &xsk, _WAIT_TIMEOUT);
+
+  _check(pipe(_key_fds) == 0);
+  g_unix_fd_add(_key_fds[0], G_IO_IN, _handle_keys, NULL);
+  _is_typing = TRUE;
+  typing_thread = g_thread_new("typing", _type_keys, NULL);
+
+  end_time = g_get_monotonic_time() + _PHASE_TIME * G_USEC_PER_SEC;
+  while (g_get_monotonic_time() < end_time) {
+    g_main_context_iteration(NULL, TRUE);
+  }
+
+  _is_burst = TRUE;
+  burst_thread = g_thread_new("burst", _emit_burst, NULL);
+  _wait(_is_burst_done,
+        &xsk,
+        _PHASE_TIME * G_USEC_PER_SEC + _WAIT_TIMEOUT);
+  g_thread_join(burst_thread);
+  g_atomic_int_set(&_is_typing, FALSE);
+  g_thread_join(typing_thread);
+
+  for (index = 0; index < _num_exclusions; index++) {
+    _exclusion_times[index] -= _emission_times[index];
+  }
+  g_print("rate: %d signals/s, signals: %d\n", rate, _num_signals);
+  g_print("%-12s %8s %8s %8s %8s (us)\n", "case", "p50", "p99", "p99.9", "max");
+  test_keyboard_print_percentiles("exclusion", _exclusion_times,
+                                  _num_exclusions);
+  test_keyboard_print_percentiles("key idle",
+                                  &g_array_index(_idle_waits, gint64, 0),
+                                  _idle_waits->len);
+  test_keyboard_print_percentiles("key burst",
+                                  &g_array_index(_burst_waits, gint64, 0),
+                                  _burst_waits->len);
+  _print_added(_idle_waits, _burst_waits);
+
+  fcitx_finalize(&xsk);
+  fcitx_mock_stop(_mock);
+  g_array_free(_idle_waits, TRUE);
+  g_array_free(_burst_waits, TRUE);
+  g_free(_emission_times);
+  g_free(_exclusion_times);
+  return EXIT_SUCCESS;
+}
+
+static gint64 _get_time()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * G_GINT64_CONSTANT(1000000000) + now.tv_nsec;
+}
+
+/* Alternates the excluded and the not excluded input method, so that each
+ * signal flips the exclusion without any GetCurrentIM call, which leaves
+ * the state of the mock to this thread */
+static gpointer _emit_burst(gpointer data)
+{
+  gint64 next_time = _get_time();
+  gint index;
+
+  for (index = 0; index < _num_signals; index++) {
+    gint64 time;
+
+    while ((time = _get_time()) < next_time) {
+      g_usleep((next_time - time) / 1000);
+    }
+    if (index % 2 == 0) {
+      _emission_times[index / 2] = time;
+      fcitx_mock_emit_changed(_mock, FCITX_MOCK_EXCLUDED);
+    } else {
+      fcitx_mock_emit_changed(_mock, FCITX_MOCK_NOT_EXCLUDED);
+    }
+    next_time += _interval;
+  }
+  g_atomic_int_set(&_is_emitted, TRUE);
+  return NULL;
+}
+
+static gpointer _type_keys(gpointer data)
+{
+  while (g_atomic_int_get(&_is_typing)) {
+    gint64 time = _get_time();
+
+    if (write(_key_fds[1], &time, sizeof (time)) != sizeof (time)) {
+      break;
+    }
+    g_usleep(_KEY_INTERVAL);
+  }
+  return NULL;
+}
+
+/* Records how long each key event waited in the main loop */
+static gboolean _handle_keys(gint fd, GIOCondition condition,
+                             gpointer user_data)
+{
+  gint64 times[64];
+  gssize size = read(fd, times, sizeof (times));
+  gint64 now = _get_time();
+  GArray *waits = _is_burst ? _burst_waits : _idle_waits;
+  gint index;
+
+  for (index = 0; index < size / (gssize)sizeof (*times); index++) {
+    gint64 wait = now - times[index];
+
+    g_array_append_val(waits, wait);
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+static void _wait(gboolean (*condition)(XSetKeys *xsk),
+                  XSetKeys *xsk,
+                  gint64 timeout)
+{
+  gint64 end_time = g_get_monotonic_time() + timeout;
+
+  while (!condition(xsk)) {
+    _check(g_get_monotonic_time() < end_time);
+    g_main_context_iteration(NULL, TRUE);
+  }
+}
+
+static gboolean _is_owned(XSetKeys *xsk)
+{
+  return _mock->is_owned;
+}
+
+static gboolean _is_subscribed(XSetKeys *xsk)
+{
+  return xsk->fcitx->subscription_id != 0;
+}
+
+static gboolean _is_idle(XSetKeys *xsk)
+{
+  return !xsk->fcitx->is_updating && !_mock->num_pending_replies;
+}
+
+static gboolean _is_burst_done(XSetKeys *xsk)
+{
+  return g_atomic_int_get(&_is_emitted) &&
+    _num_exclusions == (_num_signals + 1) / 2 &&
+    !xsk->fcitx->is_excluded;
+}
+
+/* The main loop stall added by the burst, of the waits already sorted */
+static void _print_added(GArray *idle_waits, GArray *burst_waits)
+{
+  const gint64 *idle = &g_array_index(idle_waits, gint64, 0);
+  const gint64 *burst = &g_array_index(burst_waits, gint64, 0);
+  const gdouble quantiles[] = { 0.5, 0.99, 0.999, 1.0 };
+  gint index;
+
+  g_print("%-12s", "key added");
+  for (index = 0; index < array_num(quantiles); index++) {
+    g_print(" %8.1f",
+            test_keyboard_get_percentile(burst,
+                                         burst_waits->len,
+                                         quantiles[index]) -
+            test_keyboard_get_percentile(idle,
+                                         idle_waits->len,
+                                         quantiles[index]));
+  }
+  g_print("\n");
+}
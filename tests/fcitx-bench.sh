@@ -0,0 +1,7 @@
+#!/bin/sh
+# Runs fcitx-bench on a private session bus, where it owns org.fcitx.Fcitx
+# itself.  The rate of PropertiesChanged per second can be given, e.g.
+# fcitx-bench.sh 10000
+
+command -v dbus-run-session > /dev/null || exit 77
+exec dbus-run-session -- ./fcitx-bench "$@"
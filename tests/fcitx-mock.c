@@ -0,0 +1,199 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+#include <stdlib.h>
+
+#include "fcitx-mock.h"
+
+#define _BUS_NAME "org.fcitx.Fcitx"
+#define _OBJECT_PATH "/inputmethod"
+#define _INTERFACE_NAME _BUS_NAME ".InputMethod"
+#define _REPLY_DELAY 100
+
+#define _check(expression)                                              \
+  ((expression) ? (void)0                                               \
+   : (g_printerr("%s:%d: check failed: %s\n",                           \
+                 __FILE__, __LINE__, #expression), exit(EXIT_FAILURE)))
+
+typedef struct _Reply_ {
+  FcitxMock *mock;
+  GDBusMethodInvocation *invocation;
+  gchar *input_method;
+} _Reply;
+
+static const gchar _introspection_xml[] =
+  "<node>"
+  "  <interface name='" _INTERFACE_NAME "'>"
+  "    <method name='GetCurrentIM'>"
+  "      <arg type='s' name='im' direction='out'/>"
+  "    </method>"
+  "  </interface>"
+  "</node>";
+
+static void _handle_method_call(GDBusConnection *connection,
+                                const gchar *sender,
+                                const gchar *object_path,
+                                const gchar *interface_name,
+                                const gchar *method_name,
+                                GVariant *parameters,
+                                GDBusMethodInvocation *invocation,
+                                gpointer user_data);
+static gboolean _send_reply(gpointer user_data);
+static void _handle_name_acquired(GDBusConnection *connection,
+                                  const gchar *name,
+                                  gpointer user_data);
+
+/* The mock has its own connection, so that its signals come from another
+ * unique name like the real fcitx */
+FcitxMock *fcitx_mock_start()
+{
+  static const GDBusInterfaceVTable vtable = { _handle_method_call };
+  FcitxMock *mock = g_new0(FcitxMock, 1);
+  GDBusNodeInfo *node_info;
+  GError *error = NULL;
+  gchar *address;
+
+  address = g_dbus_address_get_for_bus_sync(G_BUS_TYPE_SESSION, NULL, &error);
+  _check(address != NULL);
+  mock->connection =
+    g_dbus_connection_new_for_address_sync(
+      address,
+      G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+      G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+      NULL,
+      NULL,
+      &error);
+  _check(mock->connection != NULL);
+  g_free(address);
+
+  node_info = g_dbus_node_info_new_for_xml(_introspection_xml, &error);
+  _check(node_info != NULL);
+  _check(g_dbus_connection_register_object(mock->connection,
+                                           _OBJECT_PATH,
+                                           node_info->interfaces[0],
+                                           &vtable,
+                                           mock,
+                                           NULL,
+                                           &error) > 0);
+  g_dbus_node_info_unref(node_info);
+
+  mock->current_input_method = g_strdup(FCITX_MOCK_NOT_EXCLUDED);
+  mock->owner_id = g_bus_own_name_on_connection(mock->connection,
+                                                _BUS_NAME,
+                                                G_BUS_NAME_OWNER_FLAGS_NONE,
+                                                _handle_name_acquired,
+                                                NULL,
+                                                mock,
+                                                NULL);
+  return mock;
+}
+
+/* Changes the value replied to GetCurrentIM without any signal */
+void fcitx_mock_set_current_input_method(FcitxMock *mock,
+                                         const gchar *current_input_method)
+{
+  g_free(mock->current_input_method);
+  mock->current_input_method = g_strdup(current_input_method);
+}
+
+/* Sends PropertiesChanged with the value, or only invalidating it if
+ * `current_input_method' is NULL */
+void fcitx_mock_emit_changed(FcitxMock *mock,
+                             const gchar *current_input_method)
+{
+  GVariantBuilder changed;
+  GVariantBuilder invalidated;
+
+  if (current_input_method) {
+    fcitx_mock_set_current_input_method(mock, current_input_method);
+  }
+  g_variant_builder_init(&changed, G_VARIANT_TYPE("a{sv}"));
+  g_variant_builder_init(&invalidated, G_VARIANT_TYPE("as"));
+  if (current_input_method) {
+    g_variant_builder_add(&changed,
+                          "{sv}",
+                          "CurrentIM",
+                          g_variant_new_string(current_input_method));
+  } else {
+    g_variant_builder_add(&invalidated, "s", "CurrentIM");
+  }
+  _check(g_dbus_connection_emit_signal(mock->connection,
+                                       NULL,
+                                       _OBJECT_PATH,
+                                       "org.freedesktop.DBus.Properties",
+                                       "PropertiesChanged",
+                                       g_variant_new("(sa{sv}as)",
+                                                     _INTERFACE_NAME,
+                                                     &changed,
+                                                     &invalidated),
+                                       NULL));
+  g_dbus_connection_flush_sync(mock->connection, NULL, NULL);
+}
+
+void fcitx_mock_stop(FcitxMock *mock)
+{
+  g_bus_unown_name(mock->owner_id);
+  g_object_unref(mock->connection);
+  g_free(mock->current_input_method);
+  g_free(mock);
+}
+
+/* Replies later with the value at the time of the call, so that calls
+ * stay in flight while the tests send more signals */
+static void _handle_method_call(GDBusConnection *connection,
+                                const gchar *sender,
+                                const gchar *object_path,
+                                const gchar *interface_name,
+                                const gchar *method_name,
+                                GVariant *parameters,
+                                GDBusMethodInvocation *invocation,
+                                gpointer user_data)
+{
+  FcitxMock *mock = user_data;
+  _Reply *reply = g_new(_Reply, 1);
+
+  mock->num_calls++;
+  mock->num_pending_replies++;
+  reply->mock = mock;
+  reply->invocation = invocation;
+  reply->input_method = g_strdup(mock->current_input_method);
+  g_timeout_add(_REPLY_DELAY, _send_reply, reply);
+}
+
+static gboolean _send_reply(gpointer user_data)
+{
+  _Reply *reply = user_data;
+
+  g_dbus_method_invocation_return_value(reply->invocation,
+                                        g_variant_new("(s)",
+                                                      reply->input_method));
+  reply->mock->num_pending_replies--;
+  g_free(reply->input_method);
+  g_free(reply);
+  return G_SOURCE_REMOVE;
+}
+
+static void _handle_name_acquired(GDBusConnection *connection,
+                                  const gchar *name,
+                                  gpointer user_data)
+{
+  FcitxMock *mock = user_data;
+
+  mock->is_owned = TRUE;
+}
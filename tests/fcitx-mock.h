@@ -0,0 +1,47 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+#ifndef _FCITX_MOCK_H
+#define _FCITX_MOCK_H
+
+#include <gio/gio.h>
+
+/* Mock of org.fcitx.Fcitx on the session bus, which replies to
+ * GetCurrentIM later with the value at the time of the call */
+
+#define FCITX_MOCK_EXCLUDED "mozc"
+#define FCITX_MOCK_NOT_EXCLUDED "fcitx-keyboard-us"
+
+typedef struct FcitxMock_ {
+  GDBusConnection *connection;
+  guint owner_id;
+  gboolean is_owned;
+  gchar *current_input_method;
+  guint num_calls;
+  guint num_pending_replies;
+} FcitxMock;
+
+FcitxMock *fcitx_mock_start();
+void fcitx_mock_set_current_input_method(FcitxMock *mock,
+                                         const gchar *current_input_method);
+void fcitx_mock_emit_changed(FcitxMock *mock,
+                             const gchar *current_input_method);
+void fcitx_mock_stop(FcitxMock *mock);
+
+#endif /* _FCITX_MOCK_H */
@@ -0,0 +1,198 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+/* Runs fcitx.c against a mock of org.fcitx.Fcitx on a private session bus,
+ * see fcitx.sh */
+
+#define MAIN
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "fcitx.h"
+#include "fcitx-mock.h"
+#include "metrics.h"
+
+#define _WAIT_TIMEOUT (5 * G_USEC_PER_SEC)
+
+#define _check(expression)                                              \
+  ((expression) ? (void)0                                               \
+   : (g_printerr("%s:%d: check failed: %s\n",                           \
+                 __FILE__, __LINE__, #expression), exit(EXIT_FAILURE)))
+
+static FcitxMock *_mock;
+static guint _num_resets;
+
+static void _wait(gboolean (*condition)(XSetKeys *xsk), XSetKeys *xsk);
+static gboolean _is_owned(XSetKeys *xsk);
+static gboolean _is_subscribed(XSetKeys *xsk);
+static gboolean _is_excluded(XSetKeys *xsk);
+static gboolean _is_not_excluded(XSetKeys *xsk);
+static gboolean _is_idle(XSetKeys *xsk);
+static void _test_value_in_signal(XSetKeys *xsk);
+static void _test_coalesced_calls(XSetKeys *xsk);
+static void _test_stale_reply(XSetKeys *xsk);
+static void _test_cancel_on_finalize(XSetKeys *xsk);
+
+/* Called by fcitx.c */
+gboolean xsk_is_excluded(XSetKeys *xsk)
+{
+  return fcitx_is_excluded(xsk);
+}
+
+void xsk_reset_state(XSetKeys *xsk)
+{
+  _num_resets++;
+}
+
+gint main(gint argc, gchar *argv[])
+{
+  gchar *excluded[] = { FCITX_MOCK_EXCLUDED, NULL };
+  gchar *uid_string = g_strdup_printf("%d", getuid());
+  XSetKeys xsk = { 0 };
+
+  if (!g_getenv("DBUS_SESSION_BUS_ADDRESS")) {
+    g_printerr("Run with dbus-run-session\n");
+    return 77;
+  }
+  /* fcitx.c connects to the bus as the user who ran sudo */
+  g_setenv("SUDO_UID", uid_string, TRUE);
+  g_free(uid_string);
+
+  _mock = fcitx_mock_start();
+  _wait(_is_owned, &xsk);
+
+  xsk.fcitx = fcitx_initialize(&xsk, excluded);
+  _check(xsk.fcitx != NULL);
+  _wait(_is_subscribed, &xsk);
+
+  _test_value_in_signal(&xsk);
+  _test_coalesced_calls(&xsk);
+  _test_stale_reply(&xsk);
+  _test_cancel_on_finalize(&xsk);
+
+  fcitx_mock_stop(_mock);
+  g_print("fcitx: OK\n");
+  return EXIT_SUCCESS;
+}
+
+static void _wait(gboolean (*condition)(XSetKeys *xsk), XSetKeys *xsk)
+{
+  gint64 end_time = g_get_monotonic_time() + _WAIT_TIMEOUT;
+
+  while (!condition(xsk)) {
+    _check(g_get_monotonic_time() < end_time);
+    g_main_context_iteration(NULL, TRUE);
+  }
+}
+
+static gboolean _is_owned(XSetKeys *xsk)
+{
+  return _mock->is_owned;
+}
+
+static gboolean _is_subscribed(XSetKeys *xsk)
+{
+  return xsk->fcitx->subscription_id != 0;
+}
+
+static gboolean _is_excluded(XSetKeys *xsk)
+{
+  return xsk->fcitx->is_excluded;
+}
+
+static gboolean _is_not_excluded(XSetKeys *xsk)
+{
+  return !xsk->fcitx->is_excluded;
+}
+
+static gboolean _is_idle(XSetKeys *xsk)
+{
+  return !xsk->fcitx->is_updating && !_mock->num_pending_replies;
+}
+
+/* A signal carrying the value needs no GetCurrentIM call */
+static void _test_value_in_signal(XSetKeys *xsk)
+{
+  guint num_calls = _mock->num_calls;
+  guint num_resets = _num_resets;
+
+  fcitx_mock_emit_changed(_mock, FCITX_MOCK_EXCLUDED);
+  _wait(_is_excluded, xsk);
+  _check(_mock->num_calls == num_calls);
+  _check(_num_resets == num_resets + 1);
+
+  fcitx_mock_emit_changed(_mock, FCITX_MOCK_NOT_EXCLUDED);
+  _wait(_is_not_excluded, xsk);
+  _check(_mock->num_calls == num_calls);
+}
+
+/* Signals during a call are coalesced into one call after it */
+static void _test_coalesced_calls(XSetKeys *xsk)
+{
+  guint num_calls = _mock->num_calls;
+  gint index;
+
+  fcitx_mock_set_current_input_method(_mock, FCITX_MOCK_EXCLUDED);
+  for (index = 0; index < 5; index++) {
+    fcitx_mock_emit_changed(_mock, NULL);
+  }
+  _wait(_is_idle, xsk);
+  _check(_mock->num_calls == num_calls + 2);
+  _check(xsk->fcitx->is_excluded);
+}
+
+/* The reply of a call issued before a signal carrying the value is
+ * older than the value and ignored */
+static void _test_stale_reply(XSetKeys *xsk)
+{
+  guint num_calls = _mock->num_calls;
+
+  fcitx_mock_set_current_input_method(_mock, FCITX_MOCK_EXCLUDED);
+  fcitx_mock_emit_changed(_mock, NULL);
+  while (_mock->num_calls == num_calls) {
+    g_main_context_iteration(NULL, TRUE);
+  }
+  /* The call replying FCITX_MOCK_EXCLUDED is in flight */
+  fcitx_mock_emit_changed(_mock, FCITX_MOCK_NOT_EXCLUDED);
+  _wait(_is_idle, xsk);
+  _check(_mock->num_calls == num_calls + 1);
+  _check(!xsk->fcitx->is_excluded);
+}
+
+/* The reply of a call in flight arrives after fcitx_finalize() and must
+ * not touch the freed Fcitx */
+static void _test_cancel_on_finalize(XSetKeys *xsk)
+{
+  guint num_calls = _mock->num_calls;
+
+  fcitx_mock_emit_changed(_mock, NULL);
+  while (_mock->num_calls == num_calls) {
+    g_main_context_iteration(NULL, TRUE);
+  }
+  fcitx_finalize(xsk);
+  xsk->fcitx = NULL;
+  while (_mock->num_pending_replies) {
+    g_main_context_iteration(NULL, TRUE);
+  }
+  /* Lets the cancelled callback run */
+  while (g_main_context_iteration(NULL, FALSE)) {
+  }
+}
@@ -0,0 +1,6 @@
+#!/bin/sh
+# Runs fcitx-test on a private session bus, where it owns org.fcitx.Fcitx
+# itself
+
+command -v dbus-run-session > /dev/null || exit 77
+exec dbus-run-session -- ./fcitx-test
@@ -0,0 +1,331 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+/* Flips _NET_ACTIVE_WINDOW of a virtual X server between deep trees of
+ * reparented windows, half of whose classes are excluded, and reports the
+ * X requests and the time x-set-keys takes per focus change, from its
+ * metrics socket, and the latency of keys typed meanwhile, see
+ * focus-bench.sh */
+
+#define MAIN
+
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+#include <linux/input.h>
+
+#include "common.h"
+#include "test-keyboard.h"
+
+#define _EXCLUDED_CLASS "Excluded"
+#define _INCLUDED_CLASS "Included"
+#define _DEFAULT_DEPTH 8
+#define _NUM_TOPLEVELS 100
+#define _NUM_CACHED_PASSES 10
+#define _NUM_KEYS 1000
+#define _FLIPS_PER_KEY 10
+
+typedef struct _Metrics_ {
+  gint64 focus_changes;
+  gint64 focus_update_microseconds;
+  gint64 x_round_trips;
+  gint64 exclusion_changes;
+} _Metrics;
+
+typedef struct _Bench_ {
+  Display *display;
+  Atom active_window_atom;
+  Window leaves[_NUM_TOPLEVELS];
+  const gchar *socket_path;
+  TestKeyboard keyboard;
+  gint64 *latencies;
+} _Bench;
+
+static void _create_windows(_Bench *bench, gint depth);
+static void _set_active_window(_Bench *bench, Window window);
+static gboolean _flip_synchronously(_Bench *bench,
+                                    const gchar *name,
+                                    gint num_passes);
+static gboolean _measure_keys(_Bench *bench, const gchar *name, gint flips);
+static gboolean _read_metrics(const gchar *socket_path, _Metrics *metrics);
+static void _print_metrics(const gchar *name,
+                           gint num_flips,
+                           gint64 elapsed,
+                           const _Metrics *before,
+                           const _Metrics *after);
+
+gint main(gint argc, gchar *argv[])
+{
+  _Bench bench = { 0 };
+  gchar *x_set_keys_argv[5];
+  gchar *socket_option;
+  gint depth = _DEFAULT_DEPTH;
+  gboolean result;
+
+  if (argc < 4) {
+    g_printerr("Usage: %s <x-set-keys> <configfile> <metricssocket>"
+               " [<depth>]\n",
+               argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (argc > 4) {
+    depth = MAX(atoi(argv[4]), 1);
+  }
+  bench.display = XOpenDisplay(NULL);
+  if (!bench.display) {
+    g_printerr("Can not open display\n");
+    return 77;
+  }
+  bench.active_window_atom = XInternAtom(bench.display,
+                                         "_NET_ACTIVE_WINDOW",
+                                         False);
+  _create_windows(&bench, depth);
+
+  bench.socket_path = argv[3];
+  socket_option = g_strconcat("--metrics-socket=", argv[3], NULL);
+  x_set_keys_argv[0] = argv[1];
+  x_set_keys_argv[1] = "--exclude-focus-class=" _EXCLUDED_CLASS;
+  x_set_keys_argv[2] = socket_option;
+  x_set_keys_argv[3] = argv[2];
+  x_set_keys_argv[4] = NULL;
+  result = test_keyboard_start(&bench.keyboard, x_set_keys_argv);
+  g_free(socket_option);
+  if (!result) {
+    XCloseDisplay(bench.display);
+    return EXIT_FAILURE;
+  }
+
+  bench.latencies = g_new(gint64, _NUM_KEYS);
+  g_print("depth: %d, toplevels: %d\n", depth, _NUM_TOPLEVELS);
+  g_print("%-12s %8s %8s %14s %14s %12s\n",
+          "phase", "flips", "changes", "requests/chg", "update us/chg",
+          "flip us");
+  result = _flip_synchronously(&bench, "first", 1) &&
+    _flip_synchronously(&bench, "cached", _NUM_CACHED_PASSES);
+  if (result) {
+    g_print("%-12s %8s %8s %8s %8s (us)\n",
+            "keys", "p50", "p99", "p99.9", "max");
+    result = _measure_keys(&bench, "idle", 0) &&
+      _measure_keys(&bench, "churn", _FLIPS_PER_KEY);
+  }
+
+  g_free(bench.latencies);
+  test_keyboard_stop(&bench.keyboard);
+  XCloseDisplay(bench.display);
+  return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Toplevels like those of a reparenting window manager, a frame without
+ * WM_CLASS and the client window with it, and a chain of `depth' windows
+ * in the client, whose deepest one gets active.  The classes alternate,
+ * so that each flip in order changes the exclusion. */
+static void _create_windows(_Bench *bench, gint depth)
+{
+  Window root = DefaultRootWindow(bench->display);
+  XClassHint class_hint;
+  Window frame;
+  Window window;
+  gint index;
+  gint level;
+
+  for (index = 0; index < _NUM_TOPLEVELS; index++) {
+    frame = XCreateSimpleWindow(bench->display, root, 0, 0, 100, 100, 0, 0, 0);
+    window = XCreateSimpleWindow(bench->display, root, 0, 0, 100, 100, 0, 0, 0);
+    class_hint.res_name = "focus-bench";
+    class_hint.res_class = index % 2 ? _INCLUDED_CLASS : _EXCLUDED_CLASS;
+    XSetClassHint(bench->display, window, &class_hint);
+    XReparentWindow(bench->display, window, frame, 0, 0);
+    for (level = 0; level < depth; level++) {
+      window = XCreateSimpleWindow(bench->display,
+                                   window,
+                                   0, 0, 100, 100, 0, 0, 0);
+    }
+    bench->leaves[index] = window;
+  }
+  XSync(bench->display, False);
+}
+
+static void _set_active_window(_Bench *bench, Window window)
+{
+  XChangeProperty(bench->display,
+                  DefaultRootWindow(bench->display),
+                  bench->active_window_atom,
+                  XA_WINDOW,
+                  32,
+                  PropModeReplace,
+                  (guchar *)&window,
+                  1);
+  XFlush(bench->display);
+}
+
+/* Flips through all leaves `num_passes' times, each time waiting for the
+ * exclusion to change */
+static gboolean _flip_synchronously(_Bench *bench,
+                                    const gchar *name,
+                                    gint num_passes)
+{
+  _Metrics before;
+  _Metrics metrics;
+  gint64 start_time;
+  gint pass;
+  gint index;
+
+  if (!_read_metrics(bench->socket_path, &before)) {
+    return FALSE;
+  }
+  metrics = before;
+  start_time = g_get_monotonic_time();
+  for (pass = 0; pass < num_passes; pass++) {
+    for (index = 0; index < _NUM_TOPLEVELS; index++) {
+      gint64 exclusion_changes = metrics.exclusion_changes;
+      gint64 deadline = g_get_monotonic_time() +
+        TEST_KEYBOARD_TIMEOUT * 1000;
+
+      _set_active_window(bench, bench->leaves[index]);
+      do {
+        if (g_get_monotonic_time() > deadline) {
+          g_printerr("%s: exclusion did not change\n", name);
+          return FALSE;
+        }
+        if (!_read_metrics(bench->socket_path, &metrics)) {
+          return FALSE;
+        }
+      } while (metrics.exclusion_changes == exclusion_changes);
+    }
+  }
+  _print_metrics(name,
+                 num_passes * _NUM_TOPLEVELS,
+                 g_get_monotonic_time() - start_time,
+                 &before,
+                 &metrics);
+  return TRUE;
+}
+
+/* Types a passthrough key _NUM_KEYS times after `flips' flips each, which
+ * are not waited for */
+static gboolean _measure_keys(_Bench *bench, const gchar *name, gint flips)
+{
+  struct timespec start;
+  gint64 time;
+  gint next_leaf = 0;
+  gint index;
+  gint flip;
+
+  for (index = 0; index < _NUM_KEYS; index++) {
+    for (flip = 0; flip < flips; flip++) {
+      _set_active_window(bench, bench->leaves[next_leaf]);
+      next_leaf = (next_leaf + 1) % _NUM_TOPLEVELS;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!test_keyboard_type(bench->keyboard.fd, KEY_A, 1) ||
+        !test_keyboard_wait_for_key(bench->keyboard.output_fd,
+                                    KEY_A,
+                                    1,
+                                    TEST_KEYBOARD_TIMEOUT,
+                                    &time)) {
+      g_printerr("%s: key was not passed through\n", name);
+      return FALSE;
+    }
+    bench->latencies[index] =
+      time - (start.tv_sec * G_GINT64_CONSTANT(1000000000) + start.tv_nsec);
+    if (!test_keyboard_type(bench->keyboard.fd, KEY_A, 0) ||
+        !test_keyboard_sync(&bench->keyboard)) {
+      return FALSE;
+    }
+  }
+  test_keyboard_print_percentiles(name, bench->latencies, _NUM_KEYS);
+  return TRUE;
+}
+
+static gboolean _read_metrics(const gchar *socket_path, _Metrics *metrics)
+{
+  static const struct {
+    const gchar *name;
+    gsize offset;
+  } fields[] = {
+    { "x_set_keys_focus_changes_total ",
+      G_STRUCT_OFFSET(_Metrics, focus_changes) },
+    { "x_set_keys_focus_update_microseconds_total ",
+      G_STRUCT_OFFSET(_Metrics, focus_update_microseconds) },
+    { "x_set_keys_x_round_trips_total ",
+      G_STRUCT_OFFSET(_Metrics, x_round_trips) },
+    { "x_set_keys_exclusion_changes_total ",
+      G_STRUCT_OFFSET(_Metrics, exclusion_changes) },
+  };
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  GString *text = g_string_new(NULL);
+  gchar buffer[4096];
+  gssize length;
+  gchar **lines;
+  gchar **line;
+  gint index;
+  gint fd;
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  g_strlcpy(address.sun_path, socket_path, sizeof (address.sun_path));
+  if (fd < 0 ||
+      connect(fd, (struct sockaddr *)&address, sizeof (address)) < 0) {
+    print_error("Failed to connect to %s", socket_path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    g_string_free(text, TRUE);
+    return FALSE;
+  }
+  while ((length = read(fd, buffer, sizeof (buffer))) > 0) {
+    g_string_append_len(text, buffer, length);
+  }
+  close(fd);
+
+  memset(metrics, 0, sizeof (*metrics));
+  lines = g_strsplit(text->str, "\n", -1);
+  for (line = lines; *line; line++) {
+    for (index = 0; index < array_num(fields); index++) {
+      if (g_str_has_prefix(*line, fields[index].name)) {
+        G_STRUCT_MEMBER(gint64, metrics, fields[index].offset) =
+          g_ascii_strtoll(*line + strlen(fields[index].name), NULL, 10);
+      }
+    }
+  }
+  g_strfreev(lines);
+  g_string_free(text, TRUE);
+  return TRUE;
+}
+
+static void _print_metrics(const gchar *name,
+                           gint num_flips,
+                           gint64 elapsed,
+                           const _Metrics *before,
+                           const _Metrics *after)
+{
+  gint64 changes = MAX(after->focus_changes - before->focus_changes, 1);
+
+  g_print("%-12s %8d %8" G_GINT64_FORMAT " %14.1f %14.1f %12.1f\n",
+          name,
+          num_flips,
+          after->focus_changes - before->focus_changes,
+          (gdouble)(after->x_round_trips - before->x_round_trips) / changes,
+          (gdouble)(after->focus_update_microseconds -
+                    before->focus_update_microseconds) / changes,
+          (gdouble)elapsed / num_flips);
+}
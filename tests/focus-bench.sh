@@ -0,0 +1,17 @@
+#!/bin/sh
+# Reports the X requests and the time per change of the active window
+# between deep trees of reparented windows, with cached and uncached
+# window classes, and the latency of keys typed while the active window
+# flips.  Needs root for uinput.
+# Usage: focus-bench.sh [<depth>]
+
+[ `id -u` -eq 0 ] && [ -w /dev/uinput ] || exit 77
+[ -x ../src/x-set-keys ] || exit 77
+# Refused while another x-set-keys runs, whose uinput device has the same
+# name as the one read back
+grep -q '^N: Name="x-set-keys"$' /proc/bus/input/devices && exit 77
+. ./xvfb.sh
+directory=`mktemp -d`
+trap 'kill $xvfb_pid 2> /dev/null; rm -rf "$directory"' EXIT
+XDG_CACHE_HOME=$directory ./focus-bench ../src/x-set-keys ../emacslike.conf \
+  "$directory/metrics.sock" $1
@@ -0,0 +1,163 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+/* Types on a test keyboard read by x-set-keys, and reads what x-set-keys
+ * writes to its uinput device back through evdev.  Prints percentiles of
+ * the time from writing a key event to the test keyboard to x-set-keys
+ * writing the expected key event, see latency-bench.sh */
+
+#define MAIN
+
+#include <stdlib.h>
+#include <time.h>
+#include <linux/input.h>
+
+#include "common.h"
+#include "test-keyboard.h"
+
+#define _DEFAULT_NUM_ITERATIONS 1000
+
+typedef struct _Stroke_ {
+  guint16 code;
+  gint32 value;
+} _Stroke;
+
+#define _press(code) { (code), 1 }
+#define _release(code) { (code), 0 }
+#define _END { 0, -1 }
+
+/* The key bindings of emacslike.conf */
+typedef struct _Case_ {
+  const gchar *name;
+  _Stroke setup[4];
+  _Stroke trigger;
+  _Stroke expected;
+  _Stroke cleanup[5];
+} _Case;
+
+static const _Case _cases[] = {
+  { "passthrough", { _END }, _press(KEY_A), _press(KEY_A),
+    { _release(KEY_A), _END } },
+  /* C-f :: Right */
+  { "remap", { _press(KEY_LEFTCTRL), _END }, _press(KEY_F), _press(KEY_RIGHT),
+    { _release(KEY_F), _release(KEY_LEFTCTRL), _END } },
+  /* A-d :: S-C-Right C-x, until the last key */
+  { "multi", { _press(KEY_LEFTALT), _END }, _press(KEY_D), _press(KEY_X),
+    { _release(KEY_D), _release(KEY_LEFTALT), _END } },
+  /* C-n :: Down after C-space :: $select, canceled by an unbound key */
+  { "selection",
+    { _press(KEY_LEFTCTRL), _press(KEY_SPACE), _release(KEY_SPACE), _END },
+    _press(KEY_N), _press(KEY_DOWN),
+    { _release(KEY_N), _release(KEY_LEFTCTRL), _press(KEY_A), _release(KEY_A),
+      _END } },
+};
+
+static gboolean _run_case(TestKeyboard *keyboard,
+                          const _Case *test_case,
+                          gint num_iterations,
+                          gint64 *latencies);
+static gboolean _write_strokes(gint fd, const _Stroke *strokes);
+
+gint main(gint argc, gchar *argv[])
+{
+  gchar *x_set_keys_argv[3];
+  TestKeyboard keyboard;
+  gint num_iterations = _DEFAULT_NUM_ITERATIONS;
+  gint64 *latencies;
+  gint index;
+  gint result = EXIT_SUCCESS;
+
+  if (argc < 3) {
+    g_printerr("Usage: %s <x-set-keys> <configfile> [<iterations>]\n",
+               argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (argc > 3) {
+    num_iterations = MAX(atoi(argv[3]), 1);
+  }
+  x_set_keys_argv[0] = argv[1];
+  x_set_keys_argv[1] = argv[2];
+  x_set_keys_argv[2] = NULL;
+  if (!test_keyboard_start(&keyboard, x_set_keys_argv)) {
+    return EXIT_FAILURE;
+  }
+
+  latencies = g_new(gint64, num_iterations);
+  g_print("iterations: %d\n", num_iterations);
+  g_print("%-12s %8s %8s %8s %8s (us)\n", "case", "p50", "p99", "p99.9", "max");
+  for (index = 0; index < array_num(_cases); index++) {
+    if (!_run_case(&keyboard, &_cases[index], num_iterations, latencies)) {
+      result = EXIT_FAILURE;
+      break;
+    }
+    test_keyboard_print_percentiles(_cases[index].name,
+                                    latencies,
+                                    num_iterations);
+  }
+  g_free(latencies);
+  test_keyboard_stop(&keyboard);
+  return result;
+}
+
+/* Stores the latencies in nanoseconds */
+static gboolean _run_case(TestKeyboard *keyboard,
+                          const _Case *test_case,
+                          gint num_iterations,
+                          gint64 *latencies)
+{
+  const _Stroke trigger[] = { test_case->trigger, _END };
+  struct timespec start;
+  gint64 time;
+  gint index;
+
+  for (index = 0; index < num_iterations; index++) {
+    if (!_write_strokes(keyboard->fd, test_case->setup)) {
+      return FALSE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!_write_strokes(keyboard->fd, trigger) ||
+        !test_keyboard_wait_for_key(keyboard->output_fd,
+                                    test_case->expected.code,
+                                    test_case->expected.value,
+                                    TEST_KEYBOARD_TIMEOUT,
+                                    &time)) {
+      g_printerr("%s: no expected output\n", test_case->name);
+      return FALSE;
+    }
+    latencies[index] = time - (start.tv_sec * G_GINT64_CONSTANT(1000000000) +
+                               start.tv_nsec);
+    if (!_write_strokes(keyboard->fd, test_case->cleanup) ||
+        !test_keyboard_sync(keyboard)) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+static gboolean _write_strokes(gint fd, const _Stroke *strokes)
+{
+  const _Stroke *stroke;
+
+  for (stroke = strokes; stroke->value >= 0; stroke++) {
+    if (!test_keyboard_type(fd, stroke->code, stroke->value)) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Reports percentiles of the time from a key event written to a test
+# keyboard to the key event x-set-keys writes to uinput, for passthrough
+# keys, a 1:1 remap, a multi key output and selection mode, typed with
+# emacslike.conf.  Xvfb reads no input devices, so the output of
+# x-set-keys is read back through evdev.  Needs root for uinput.
+# Usage: latency-bench.sh [<iterations>]
+
+[ `id -u` -eq 0 ] && [ -w /dev/uinput ] || exit 77
+[ -x ../src/x-set-keys ] || exit 77
+# Refused while another x-set-keys runs, whose uinput device has the same
+# name as the one read back
+grep -q '^N: Name="x-set-keys"$' /proc/bus/input/devices && exit 77
+. ./xvfb.sh
+directory=`mktemp -d`
+trap 'kill $xvfb_pid 2> /dev/null; rm -rf "$directory"' EXIT
+XDG_CACHE_HOME=$directory ./latency-bench ../src/x-set-keys \
+  ../emacslike.conf $1
@@ -0,0 +1,86 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+/* Preloaded to count the heap allocations of the main thread, which are
+ * printed on exit, see allocation.sh.  Other threads of GLib and Xlib are
+ * not counted, since they are not on the path of key events. */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t number, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static unsigned long _num_allocations;
+
+static void _count()
+{
+  if (syscall(SYS_gettid) == getpid()) {
+    _num_allocations++;
+  }
+}
+
+void *malloc(size_t size)
+{
+  _count();
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t number, size_t size)
+{
+  _count();
+  return __libc_calloc(number, size);
+}
+
+void *realloc(void *pointer, size_t size)
+{
+  _count();
+  return __libc_realloc(pointer, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+  _count();
+  return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+  _count();
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **pointer, size_t alignment, size_t size)
+{
+  _count();
+  *pointer = __libc_memalign(alignment, size);
+  return *pointer ? 0 : ENOMEM;
+}
+
+__attribute__((destructor)) static void _print_count()
+{
+  dprintf(STDERR_FILENO, "malloc-count: %lu\n", _num_allocations);
+}
@@ -0,0 +1,103 @@
+#!/bin/sh
+# Runs x-set-keys on a test keyboard and reloads its configuration file
+# over and over, by changing the file, by SIGUSR1 as a keyboard mapping
+# change and by SIGHUP as a restart.  Fails if the live objects or the
+# resident set size on the metrics socket grow after the first reloads.
+# Needs root for uinput, and socat to read the metrics socket.
+# Usage: reload.sh [<reloads>]
+
+[ `id -u` -eq 0 ] && [ -w /dev/uinput ] || exit 77
+command -v socat > /dev/null || exit 77
+[ -x ../src/x-set-keys ] || exit 77
+. ./xvfb.sh
+directory=`mktemp -d`
+trap 'kill $xsk_pid $keyboard_pid $xvfb_pid 2> /dev/null; rm -rf "$directory"' \
+  EXIT
+XDG_CACHE_HOME=$directory
+export XDG_CACHE_HOME
+config=$directory/x-set-keys.conf
+socket=$directory/metrics.sock
+log=$directory/log
+num_reloads=${1:-300}
+# Allowed growth of the resident set size after the first reloads
+max_rss_growth=1048576
+
+cp ../emacslike.conf "$config"
+./virtual-keyboard > "$directory/device" &
+keyboard_pid=$!
+for i in `seq 50`; do
+  [ -s "$directory/device" ] && break
+  sleep 0.1
+done
+[ -s "$directory/device" ] || exit 1
+
+../src/x-set-keys --device-file=`cat "$directory/device"` \
+  --metrics-socket="$socket" "$config" > "$log" 2>&1 &
+xsk_pid=$!
+
+# Served from the main loop, so this also waits for a reload to finish
+metrics() {
+  socat -u UNIX-CONNECT:"$socket" - | \
+    grep -e '^x_set_keys_live_' -e '^x_set_keys_resident_memory_bytes'
+}
+
+wait_for_log() {
+  for i in `seq 100`; do
+    [ `grep -c "$2" "$log"` -ge $1 ] && return 0
+    kill -0 $xsk_pid 2> /dev/null || break
+    sleep 0.05
+  done
+  cat "$log" >&2
+  echo "Timed out waiting for: $2" >&2
+  exit 1
+}
+
+get_value() {
+  echo "$1" | sed -n "s/^$2 //p"
+}
+
+for i in `seq 50`; do
+  [ -S "$socket" ] && metrics > /dev/null && break
+  sleep 0.1
+done
+
+for i in `seq $num_reloads`; do
+  case `expr $i % 3` in
+  0)
+    cp "$config" "$config.new"
+    mv "$config.new" "$config"
+    wait_for_log `expr $i / 3` "Reloading configuration file"
+    ;;
+  1)
+    kill -USR1 $xsk_pid
+    wait_for_log `expr $i / 3 + 1` "Keyboard mapping changed"
+    ;;
+  2)
+    kill -HUP $xsk_pid
+    wait_for_log `expr $i / 3 + 1` "Restarting"
+    ;;
+  esac
+  current=`metrics` || exit 1
+  if [ $i -eq 30 ] || [ $i -eq $num_reloads -a $i -lt 30 ]; then
+    baseline=$current
+  fi
+done
+
+echo "after 30 reloads:"
+echo "$baseline"
+echo "after $num_reloads reloads:"
+echo "$current"
+status=0
+if [ "`echo "$baseline" | grep live_`" != "`echo "$current" | grep live_`" ]
+then
+  echo "Live objects grew" >&2
+  status=1
+fi
+rss_growth=`expr \
+  \`get_value "$current" x_set_keys_resident_memory_bytes\` - \
+  \`get_value "$baseline" x_set_keys_resident_memory_bytes\``
+if [ $rss_growth -gt $max_rss_growth ]; then
+  echo "Resident set size grew by $rss_growth bytes" >&2
+  status=1
+fi
+exit $status
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Reports the events per second and the time per event of replaying
+# streams of typing, autorepeat, multi stroke bindings and selection mode
+# with emacslike.conf, written by typing-record.
+# Usage: replay-bench.sh [<events>]
+
+[ -x ../src/x-set-keys ] || exit 77
+# Only typing-record needs X server, for the keyboard mapping
+. ./xvfb.sh
+directory=`mktemp -d`
+trap 'kill $xvfb_pid 2> /dev/null; rm -rf "$directory"' EXIT
+XDG_CACHE_HOME=$directory
+export XDG_CACHE_HOME
+config=../emacslike.conf
+
+printf "%-12s %10s %10s\n" stream events/s ns/event
+for stream in typing repeat multi selection; do
+  ./typing-record "$directory/$stream.rec" ${1:-1000000} $stream \
+    > /dev/null || exit 1
+  # The file has no outputs to compare with, the replay records them
+  ../src/x-set-keys --replay-file="$directory/$stream.rec" \
+    --record-file="$directory/reference.rec" $config > /dev/null 2>&1
+  ../src/x-set-keys --replay-file="$directory/reference.rec" $config \
+    > "$directory/log" 2>&1 || { cat "$directory/log" >&2; exit 1; }
+  sed -n "s|.*Replayed .*: \([0-9]*\) events/s, \([0-9]*\) ns/event.*|\1 \2|p" \
+    "$directory/log" | {
+    read rate time
+    printf "%-12s %10s %10s\n" $stream $rate $time
+  }
+done
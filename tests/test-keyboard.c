@@ -0,0 +1,387 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/uinput.h>
+
+#include "common.h"
+#include "test-keyboard.h"
+
+#define _NAME "x-set-keys test keyboard"
+
+static gchar **_list_event_filenames();
+static gint _compare_latency(gconstpointer a, gconstpointer b);
+static gchar *_get_event_filepath(gint fd);
+
+/* Returns the file descriptor of the uinput device, and the event device
+ * file to be freed by g_free() in `event_filepath', or -1 on failure */
+gint test_keyboard_create(gchar **event_filepath)
+{
+  struct uinput_user_dev user_dev = { { 0 } };
+  gint fd;
+  gint index;
+
+  fd = open("/dev/uinput", O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    print_error("Failed to open /dev/uinput");
+    return -1;
+  }
+  user_dev.id.bustype = BUS_VIRTUAL;
+  strcpy(user_dev.name, _NAME);
+  user_dev.id.vendor = 1;
+  user_dev.id.product = 2;
+  user_dev.id.version = 1;
+  if (write(fd, &user_dev, sizeof (user_dev)) != sizeof (user_dev) ||
+      ioctl(fd, UI_SET_EVBIT, EV_SYN) < 0 ||
+      ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0 ||
+      ioctl(fd, UI_SET_EVBIT, EV_REP) < 0) {
+    print_error("Failed to set up test keyboard");
+    close(fd);
+    return -1;
+  }
+  for (index = KEY_ESC; index <= KEY_MICMUTE; index++) {
+    if (ioctl(fd, UI_SET_KEYBIT, index) < 0) {
+      print_error("Failed to set up test keyboard");
+      close(fd);
+      return -1;
+    }
+  }
+  if (ioctl(fd, UI_DEV_CREATE) < 0) {
+    print_error("Failed to create test keyboard");
+    close(fd);
+    return -1;
+  }
+  *event_filepath = _get_event_filepath(fd);
+  if (!*event_filepath) {
+    test_keyboard_destroy(fd);
+    return -1;
+  }
+  return fd;
+}
+
+gboolean test_keyboard_write(gint fd, guint16 type, guint16 code, gint32 value)
+{
+  struct input_event event = { .type = type, .code = code, .value = value };
+
+  if (write(fd, &event, sizeof (event)) != sizeof (event)) {
+    print_error("Failed to write to test keyboard");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* A key event followed by a report like keyboards do */
+gboolean test_keyboard_type(gint fd, guint16 code, gint32 value)
+{
+  return test_keyboard_write(fd, EV_KEY, code, value) &&
+    test_keyboard_write(fd, EV_SYN, SYN_REPORT, 0);
+}
+
+void test_keyboard_destroy(gint fd)
+{
+  ioctl(fd, UI_DEV_DESTROY);
+  close(fd);
+}
+
+/* Opens the event device of the input device named `name', such as the
+ * uinput device of x-set-keys, waiting for it to be created, and returns
+ * -1 if it does not appear.  The event devices in `existing_filenames' are
+ * skipped, so that only one created after listing them is opened.  The
+ * device is grabbed, so that X server of the desktop does not get its
+ * events, and the time of the events read is monotonic. */
+gint test_keyboard_open_device(const gchar *name,
+                               gchar **existing_filenames)
+{
+  gchar device_name[256];
+  GDir *directory;
+  const gchar *filename;
+  gchar *filepath;
+  gint clock_id = CLOCK_MONOTONIC;
+  gint fd = -1;
+  gint retry;
+
+  for (retry = 0; retry < 50 && fd < 0; retry++) {
+    if (retry) {
+      g_usleep(G_USEC_PER_SEC / 10);
+    }
+    directory = g_dir_open("/dev/input", 0, NULL);
+    if (!directory) {
+      continue;
+    }
+    while (fd < 0 && (filename = g_dir_read_name(directory))) {
+      if (!g_str_has_prefix(filename, "event") ||
+          (existing_filenames &&
+           g_strv_contains((const gchar * const *)existing_filenames,
+                           filename))) {
+        continue;
+      }
+      filepath = g_strconcat("/dev/input/", filename, NULL);
+      fd = open(filepath, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+      g_free(filepath);
+      if (fd < 0) {
+        continue;
+      }
+      memset(device_name, 0, sizeof (device_name));
+      if (ioctl(fd, EVIOCGNAME(sizeof (device_name) - 1), device_name) < 0 ||
+          strcmp(device_name, name)) {
+        close(fd);
+        fd = -1;
+      }
+    }
+    g_dir_close(directory);
+  }
+  if (fd < 0) {
+    g_critical("Can not find input device: %s", name);
+    return -1;
+  }
+  if (ioctl(fd, EVIOCSCLOCKID, &clock_id) < 0) {
+    print_error("Failed to set clock of %s to monotonic", name);
+    close(fd);
+    return -1;
+  }
+  if (ioctl(fd, EVIOCGRAB, 1) < 0) {
+    print_error("Failed to grab %s", name);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Reads the events of a device opened by test_keyboard_open_device() until
+ * the key event, and stores its time in nanoseconds.  Returns FALSE if no
+ * event is read for `timeout' milliseconds. */
+gboolean test_keyboard_wait_for_key(gint fd,
+                                    guint16 code,
+                                    gint32 value,
+                                    gint timeout,
+                                    gint64 *time)
+{
+  struct pollfd poll_fd = { .fd = fd, .events = POLLIN };
+  struct input_event event;
+
+  for (;;) {
+    if (read(fd, &event, sizeof (event)) != sizeof (event)) {
+      if (errno != EAGAIN) {
+        print_error("Failed to read input device");
+        return FALSE;
+      }
+      if (poll(&poll_fd, 1, timeout) <= 0) {
+        return FALSE;
+      }
+      continue;
+    }
+    if (event.type == EV_KEY && event.code == code && event.value == value) {
+      *time = event.time.tv_sec * G_GINT64_CONSTANT(1000000000) +
+        event.time.tv_usec * 1000;
+      return TRUE;
+    }
+  }
+}
+
+/* Starts x-set-keys of `argv', to which --device-file of a new test
+ * keyboard is added, and waits for it to handle a key */
+gboolean test_keyboard_start(TestKeyboard *keyboard, gchar *argv[])
+{
+  GPtrArray *child_argv = g_ptr_array_new_with_free_func(g_free);
+  gchar **existing_filenames;
+  gchar *event_filepath;
+  GError *error = NULL;
+  gboolean result;
+  gint index;
+
+  keyboard->output_fd = -1;
+  keyboard->pid = 0;
+  keyboard->fd = test_keyboard_create(&event_filepath);
+  if (keyboard->fd < 0) {
+    g_ptr_array_free(child_argv, TRUE);
+    return FALSE;
+  }
+  g_ptr_array_add(child_argv, g_strdup(argv[0]));
+  g_ptr_array_add(child_argv, g_strconcat("--device-file=",
+                                          event_filepath,
+                                          NULL));
+  g_free(event_filepath);
+  for (index = 1; argv[index]; index++) {
+    g_ptr_array_add(child_argv, g_strdup(argv[index]));
+  }
+  g_ptr_array_add(child_argv, NULL);
+  existing_filenames = _list_event_filenames();
+  result = g_spawn_async(NULL,
+                         (gchar **)child_argv->pdata,
+                         NULL,
+                         G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_STDOUT_TO_DEV_NULL,
+                         NULL,
+                         NULL,
+                         &keyboard->pid,
+                         &error);
+  g_ptr_array_free(child_argv, TRUE);
+  if (!result) {
+    g_printerr("Failed to start %s: %s\n", argv[0], error->message);
+    g_error_free(error);
+    g_strfreev(existing_filenames);
+    keyboard->pid = 0;
+    test_keyboard_stop(keyboard);
+    return FALSE;
+  }
+
+  /* Created after the keyboard device is grabbed.  Another x-set-keys
+     running has a device of the same name, which is not the one listed
+     before. */
+  keyboard->output_fd = test_keyboard_open_device("x-set-keys",
+                                                  existing_filenames);
+  g_strfreev(existing_filenames);
+  if (keyboard->output_fd < 0 || !test_keyboard_sync(keyboard)) {
+    test_keyboard_stop(keyboard);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* Types an unbound key, whose release tells that x-set-keys has handled
+ * everything typed before */
+gboolean test_keyboard_sync(TestKeyboard *keyboard)
+{
+  gint64 time;
+
+  if (!test_keyboard_type(keyboard->fd, KEY_F12, 1) ||
+      !test_keyboard_type(keyboard->fd, KEY_F12, 0)) {
+    return FALSE;
+  }
+  if (!test_keyboard_wait_for_key(keyboard->output_fd,
+                                  KEY_F12,
+                                  0,
+                                  TEST_KEYBOARD_TIMEOUT,
+                                  &time)) {
+    g_printerr("x-set-keys did not catch up\n");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+void test_keyboard_stop(TestKeyboard *keyboard)
+{
+  if (keyboard->pid) {
+    kill(keyboard->pid, SIGTERM);
+    waitpid(keyboard->pid, NULL, 0);
+    g_spawn_close_pid(keyboard->pid);
+    keyboard->pid = 0;
+  }
+  if (keyboard->output_fd >= 0) {
+    close(keyboard->output_fd);
+    keyboard->output_fd = -1;
+  }
+  if (keyboard->fd >= 0) {
+    test_keyboard_destroy(keyboard->fd);
+    keyboard->fd = -1;
+  }
+}
+
+/* Sorts the latencies in nanoseconds, and prints a row of p50, p99, p99.9
+ * and max in microseconds */
+void test_keyboard_print_percentiles(const gchar *name,
+                                     gint64 *latencies,
+                                     gint count)
+{
+  qsort(latencies, count, sizeof (*latencies), _compare_latency);
+  g_print("%-12s %8.1f %8.1f %8.1f %8.1f\n",
+          name,
+          test_keyboard_get_percentile(latencies, count, 0.5),
+          test_keyboard_get_percentile(latencies, count, 0.99),
+          test_keyboard_get_percentile(latencies, count, 0.999),
+          latencies[count - 1] / 1000.0);
+}
+
+static gchar **_list_event_filenames()
+{
+  GPtrArray *filenames = g_ptr_array_new();
+  GDir *directory = g_dir_open("/dev/input", 0, NULL);
+  const gchar *filename;
+
+  while (directory && (filename = g_dir_read_name(directory))) {
+    if (g_str_has_prefix(filename, "event")) {
+      g_ptr_array_add(filenames, g_strdup(filename));
+    }
+  }
+  if (directory) {
+    g_dir_close(directory);
+  }
+  g_ptr_array_add(filenames, NULL);
+  return (gchar **)g_ptr_array_free(filenames, FALSE);
+}
+
+static gint _compare_latency(gconstpointer a, gconstpointer b)
+{
+  gint64 latency1 = *(const gint64 *)a;
+  gint64 latency2 = *(const gint64 *)b;
+
+  return latency1 < latency2 ? -1 : latency1 > latency2;
+}
+
+/* In microseconds, of latencies sorted by test_keyboard_print_percentiles() */
+gdouble test_keyboard_get_percentile(const gint64 *latencies,
+                                     gint count,
+                                     gdouble quantile)
+{
+  return latencies[MIN((gint)(count * quantile), count - 1)] / 1000.0;
+}
+
+/* The event device is the only event* entry in the directory of the
+ * input device in sysfs, and is created by udev shortly after */
+static gchar *_get_event_filepath(gint fd)
+{
+  gchar sysname[64] = { 0 };
+  gchar *directory_path;
+  GDir *directory;
+  const gchar *name;
+  gchar *result = NULL;
+  gint retry;
+
+  if (ioctl(fd, UI_GET_SYSNAME(sizeof (sysname) - 1), sysname) < 0) {
+    print_error("Failed to get the name of test keyboard");
+    return NULL;
+  }
+  directory_path = g_strconcat("/sys/devices/virtual/input/", sysname, NULL);
+  directory = g_dir_open(directory_path, 0, NULL);
+  g_free(directory_path);
+  if (!directory) {
+    g_critical("Can not find the input device of test keyboard");
+    return NULL;
+  }
+  while (!result && (name = g_dir_read_name(directory))) {
+    if (g_str_has_prefix(name, "event")) {
+      result = g_strconcat("/dev/input/", name, NULL);
+    }
+  }
+  g_dir_close(directory);
+  if (!result) {
+    g_critical("Can not find the event device of test keyboard");
+    return NULL;
+  }
+  for (retry = 0; retry < 50 && access(result, R_OK | W_OK); retry++) {
+    g_usleep(G_USEC_PER_SEC / 10);
+  }
+  return result;
+}
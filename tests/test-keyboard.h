@@ -0,0 +1,61 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+#ifndef _TEST_KEYBOARD_H
+#define _TEST_KEYBOARD_H
+
+#include <glib.h>
+
+/* Virtual keyboard made by uinput, which x-set-keys reads as its keyboard
+ * device by --device-file.  Needs write access to /dev/uinput. */
+
+gint test_keyboard_create(gchar **event_filepath);
+gboolean test_keyboard_write(gint fd, guint16 type, guint16 code, gint32 value);
+gboolean test_keyboard_type(gint fd, guint16 code, gint32 value);
+void test_keyboard_destroy(gint fd);
+gint test_keyboard_open_device(const gchar *name,
+                               gchar **existing_filenames);
+gboolean test_keyboard_wait_for_key(gint fd,
+                                    guint16 code,
+                                    gint32 value,
+                                    gint timeout,
+                                    gint64 *time);
+
+/* x-set-keys started on a test keyboard, whose uinput device is read back
+ * through evdev, since Xvfb reads no input device */
+typedef struct TestKeyboard_ {
+  gint fd;
+  GPid pid;
+  gint output_fd;
+} TestKeyboard;
+
+/* Milliseconds to wait for x-set-keys */
+#define TEST_KEYBOARD_TIMEOUT 1000
+
+gboolean test_keyboard_start(TestKeyboard *keyboard, gchar *argv[]);
+gboolean test_keyboard_sync(TestKeyboard *keyboard);
+void test_keyboard_stop(TestKeyboard *keyboard);
+void test_keyboard_print_percentiles(const gchar *name,
+                                     gint64 *latencies,
+                                     gint count);
+gdouble test_keyboard_get_percentile(const gint64 *latencies,
+                                     gint count,
+                                     gdouble quantile);
+
+#endif /* _TEST_KEYBOARD_H */
@@ -0,0 +1,206 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+/* Writes a record file of input events only, typing a stream of strokes
+ * with emacslike.conf over and over, with the keyboard mapping of X server
+ * and its default repeat controls.  Key events are 40 milliseconds apart
+ * like autorepeat, see allocation.sh and replay-bench.sh */
+
+#define MAIN
+
+#include <stdlib.h>
+
+#include "common.h"
+#include "recorder.h"
+
+#define _DEFAULT_NUM_EVENTS 1000000
+/* In milliseconds, the defaults of X server */
+#define _REPEAT_DELAY 660
+#define _REPEAT_INTERVAL 40
+
+typedef struct _Stroke_ {
+  guint16 code;
+  gint32 value;
+  gint count;
+} _Stroke;
+
+#define _press(code) { (code), 1, 1 }
+#define _repeat(code) { (code), 2, 1 }
+#define _repeats(code, count) { (code), 2, (count) }
+#define _release(code) { (code), 0, 1 }
+
+/* Every key is released at the end of each stream */
+static const _Stroke _typing_strokes[] = {
+  /* Unbound key */
+  _press(KEY_A), _release(KEY_A),
+  /* C-f :: Right, with key repeat */
+  _press(KEY_LEFTCTRL), _press(KEY_F), _repeat(KEY_F), _repeat(KEY_F),
+  _release(KEY_F), _release(KEY_LEFTCTRL),
+  /* C-x C-s :: C-s */
+  _press(KEY_LEFTCTRL), _press(KEY_X), _release(KEY_X),
+  _press(KEY_S), _release(KEY_S), _release(KEY_LEFTCTRL),
+  /* C-x canceled by an unbound key */
+  _press(KEY_LEFTCTRL), _press(KEY_X), _release(KEY_X),
+  _release(KEY_LEFTCTRL), _press(KEY_A), _release(KEY_A),
+  /* C-space :: $select, C-n :: Down selecting, canceled by an unbound key */
+  _press(KEY_LEFTCTRL), _press(KEY_SPACE), _release(KEY_SPACE),
+  _press(KEY_N), _release(KEY_N), _release(KEY_LEFTCTRL),
+  _press(KEY_A), _release(KEY_A),
+};
+
+/* Held keys, of which repeats after the delay run the action */
+static const _Stroke _repeat_strokes[] = {
+  /* C-f :: Right */
+  _press(KEY_LEFTCTRL), _press(KEY_F), _repeats(KEY_F, 100),
+  _release(KEY_F), _release(KEY_LEFTCTRL),
+  /* Unbound key */
+  _press(KEY_A), _repeats(KEY_A, 100), _release(KEY_A),
+};
+
+static const _Stroke _multi_strokes[] = {
+  /* C-x C-s :: C-s */
+  _press(KEY_LEFTCTRL), _press(KEY_X), _release(KEY_X),
+  _press(KEY_S), _release(KEY_S), _release(KEY_LEFTCTRL),
+  /* C-x k :: C-w */
+  _press(KEY_LEFTCTRL), _press(KEY_X), _release(KEY_X), _release(KEY_LEFTCTRL),
+  _press(KEY_K), _release(KEY_K),
+  /* C-x C-f :: C-o */
+  _press(KEY_LEFTCTRL), _press(KEY_X), _release(KEY_X),
+  _press(KEY_F), _release(KEY_F), _release(KEY_LEFTCTRL),
+  /* C-bracketleft S-period :: C-End */
+  _press(KEY_LEFTCTRL), _press(KEY_LEFTBRACE), _release(KEY_LEFTBRACE),
+  _release(KEY_LEFTCTRL), _press(KEY_LEFTSHIFT), _press(KEY_DOT),
+  _release(KEY_DOT), _release(KEY_LEFTSHIFT),
+};
+
+static const _Stroke _selection_strokes[] = {
+  /* C-space :: $select, then moving with the selection */
+  _press(KEY_LEFTCTRL), _press(KEY_SPACE), _release(KEY_SPACE),
+  _press(KEY_N), _release(KEY_N), _press(KEY_N), _release(KEY_N),
+  _press(KEY_F), _release(KEY_F), _press(KEY_E), _release(KEY_E),
+  _release(KEY_LEFTCTRL),
+  /* A-f :: C-Right selecting, A-w :: C-c */
+  _press(KEY_LEFTALT), _press(KEY_F), _release(KEY_F),
+  _press(KEY_W), _release(KEY_W), _release(KEY_LEFTALT),
+  /* Canceled by an unbound key */
+  _press(KEY_A), _release(KEY_A),
+};
+
+typedef struct _Stream_ {
+  const gchar *name;
+  const _Stroke *strokes;
+  gint num_strokes;
+} _Stream;
+
+#define _stream(name, strokes) { (name), (strokes), array_num(strokes) }
+
+static const _Stream _streams[] = {
+  _stream("typing", _typing_strokes),
+  _stream("repeat", _repeat_strokes),
+  _stream("multi", _multi_strokes),
+  _stream("selection", _selection_strokes),
+};
+
+static gint64 _time = G_USEC_PER_SEC;
+
+static const _Stream *_find_stream(const gchar *name);
+static void _record(guint16 type, guint16 code, gint32 value);
+
+gint main(gint argc, gchar *argv[])
+{
+  Display *display;
+  KIKeyboardMapping mapping;
+  const _Stream *stream = &_streams[0];
+  glong num_events = _DEFAULT_NUM_EVENTS;
+  glong count = 0;
+  gint index;
+  gint repeat;
+
+  if (argc < 2) {
+    g_printerr("Usage: %s <recordfile> [<events> [<stream>]]\n"
+               "Streams: typing (default), repeat, multi, selection\n",
+               argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (argc > 2) {
+    num_events = atol(argv[2]);
+  }
+  if (argc > 3) {
+    stream = _find_stream(argv[3]);
+    if (!stream) {
+      g_printerr("Unknown stream: %s\n", argv[3]);
+      return EXIT_FAILURE;
+    }
+  }
+  display = XOpenDisplay(NULL);
+  if (!display) {
+    g_printerr("Can not open display\n");
+    return 77;
+  }
+  if (!ki_get_server_keyboard_mapping(display, &mapping)) {
+    return EXIT_FAILURE;
+  }
+  if (!recorder_initialize(argv[1])) {
+    return EXIT_FAILURE;
+  }
+  recorder_keep_keyboard_mapping(&mapping);
+  recorder_keep_repeat_controls(_REPEAT_DELAY, _REPEAT_INTERVAL);
+
+  /* Each key event is followed by a report like keyboards do */
+  while (count < num_events) {
+    for (index = 0; index < stream->num_strokes; index++) {
+      const _Stroke *stroke = &stream->strokes[index];
+
+      for (repeat = 0; repeat < stroke->count; repeat++) {
+        _record(EV_KEY, stroke->code, stroke->value);
+        _record(EV_SYN, SYN_REPORT, 0);
+        _time += _REPEAT_INTERVAL * 1000;
+        count += 2;
+      }
+    }
+  }
+
+  recorder_finalize();
+  ki_free_keyboard_mapping(&mapping);
+  XCloseDisplay(display);
+  g_print("events: %ld\n", count);
+  return EXIT_SUCCESS;
+}
+
+static const _Stream *_find_stream(const gchar *name)
+{
+  gint index;
+
+  for (index = 0; index < array_num(_streams); index++) {
+    if (!strcmp(_streams[index].name, name)) {
+      return &_streams[index];
+    }
+  }
+  return NULL;
+}
+
+static void _record(guint16 type, guint16 code, gint32 value)
+{
+  struct input_event event = { .type = type, .code = code, .value = value };
+
+  event.time.tv_sec = _time / G_USEC_PER_SEC;
+  event.time.tv_usec = _time % G_USEC_PER_SEC;
+  recorder_record(RECORDER_DIRECTION_INPUT, &event);
+  recorder_flush();
+}
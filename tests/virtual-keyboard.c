@@ -0,0 +1,54 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+/* Creates a test keyboard, prints its event device file and keeps it until
+ * SIGINT or SIGTERM, see reload.sh */
+
+#define MAIN
+
+#include <stdlib.h>
+#include <signal.h>
+
+#include "common.h"
+#include "test-keyboard.h"
+
+gint main(gint argc, gchar *argv[])
+{
+  sigset_t signals;
+  gchar *event_filepath;
+  gint signal_number;
+  gint fd;
+
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigprocmask(SIG_BLOCK, &signals, NULL);
+
+  fd = test_keyboard_create(&event_filepath);
+  if (fd < 0) {
+    return EXIT_FAILURE;
+  }
+  g_print("%s\n", event_filepath);
+  fflush(stdout);
+  g_free(event_filepath);
+
+  sigwait(&signals, &signal_number);
+  test_keyboard_destroy(fd);
+  return EXIT_SUCCESS;
+}
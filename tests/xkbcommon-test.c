@@ -0,0 +1,158 @@
+/***************************************************************************
+ *
+ * Copyright (C) 2017-2018 Tomoyuki KAWAO
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+
+/* Checks that the keymap compiled with libxkbcommon resolves key names the
+ * same as the keyboard mapping of X server, see xkbcommon.sh */
+
+#define MAIN
+
+#include <stdlib.h>
+
+#include "common.h"
+#include "key-information.h"
+#include "metrics.h"
+
+static const gchar *_modifier_prefixes[] = {
+  "", "A-", "C-", "H-", "M-", "S-", "s-", "C-M-", "C-S-"
+};
+
+static const gchar *_key_names[] = {
+  "a", "b", "f", "g", "k", "q", "x", "z", "0", "9",
+  "space", "comma", "period", "slash", "bracketleft", "bracketright",
+  "less", "greater", "question", "underscore", "at", "exclam",
+  "BackSpace", "Delete", "Escape", "Return", "Tab",
+  "Left", "Right", "Up", "Down", "Home", "End", "Page_Up", "Page_Down",
+  "Insert", "F1", "F4", "F12",
+  "Shift_L", "Control_L", "Alt_L", "Meta_L", "Super_L", "Hyper_L",
+  "ISO_Level3_Shift", "Mode_switch", "Multi_key",
+  "KEY_A", "KEY_LEFTCTRL", "KEY_F1"
+};
+
+static gboolean _is_same_key_code_array(const KeyCodeArray *array1,
+                                        const KeyCodeArray *array2);
+
+gint main(gint argc, gchar *argv[])
+{
+  Display *display;
+  KIKeyboardMapping compiled;
+  KIKeyboardMapping server;
+  KeyInformation compiled_info;
+  KeyInformation server_info;
+  gint num_errors = 0;
+  gint prefix;
+  gint name;
+
+  display = XOpenDisplay(NULL);
+  if (!display) {
+    g_printerr("Can not open display\n");
+    return 77;
+  }
+  if (!ki_get_keyboard_mapping(display, &compiled) || !compiled.is_local) {
+    g_printerr("Keymap is not compiled\n");
+    return EXIT_FAILURE;
+  }
+  if (!ki_get_server_keyboard_mapping(display, &server)) {
+    return EXIT_FAILURE;
+  }
+  ki_initialize(&compiled_info, &compiled);
+  ki_initialize(&server_info, &server);
+
+  if (memcmp(&compiled_info, &server_info, sizeof (KeyInformation))) {
+    g_printerr("KeyInformation differs\n");
+    num_errors++;
+  }
+  for (prefix = 0; prefix < array_num(_modifier_prefixes); prefix++) {
+    for (name = 0; name < array_num(_key_names); name++) {
+      gchar *string = g_strconcat(_modifier_prefixes[prefix],
+                                  _key_names[name],
+                                  NULL);
+      KIKeySpec key_spec;
+      KeyCombination compiled_kc;
+      KeyCombination server_kc;
+      KeyCodeArray *compiled_keys;
+      KeyCodeArray *server_keys;
+
+      if (!ki_string_to_key_spec(string, &key_spec)) {
+        g_printerr("%s: unknown key name\n", string);
+        num_errors++;
+        g_free(string);
+        continue;
+      }
+      compiled_kc = ki_key_spec_to_key_combination(&compiled,
+                                                   &compiled_info,
+                                                   &key_spec);
+      server_kc = ki_key_spec_to_key_combination(&server,
+                                                 &server_info,
+                                                 &key_spec);
+      if (compiled_kc.i != server_kc.i) {
+        g_printerr("%s: input 0x%04x (compiled) != 0x%04x (server)\n",
+                   string, compiled_kc.i, server_kc.i);
+        num_errors++;
+      }
+      compiled_keys = ki_key_spec_to_key_code_array(&compiled,
+                                                    &compiled_info,
+                                                    &key_spec);
+      server_keys = ki_key_spec_to_key_code_array(&server,
+                                                  &server_info,
+                                                  &key_spec);
+      if (!_is_same_key_code_array(compiled_keys, server_keys)) {
+        g_printerr("%s: output differs\n", string);
+        num_errors++;
+      }
+      if (compiled_keys) {
+        key_code_array_free(compiled_keys);
+      }
+      if (server_keys) {
+        key_code_array_free(server_keys);
+      }
+      g_free(string);
+    }
+  }
+
+  ki_free_keyboard_mapping(&compiled);
+  ki_free_keyboard_mapping(&server);
+  XCloseDisplay(display);
+  if (num_errors) {
+    g_printerr("xkbcommon: %d differences\n", num_errors);
+    return EXIT_FAILURE;
+  }
+  g_print("xkbcommon: OK\n");
+  return EXIT_SUCCESS;
+}
+
+static gboolean _is_same_key_code_array(const KeyCodeArray *array1,
+                                        const KeyCodeArray *array2)
+{
+  gint index;
+
+  if (!array1 || !array2) {
+    return array1 == array2;
+  }
+  if (key_code_array_get_length(array1) !=
+      key_code_array_get_length(array2)) {
+    return FALSE;
+  }
+  for (index = 0; index < key_code_array_get_length(array1); index++) {
+    if (key_code_array_get_at(array1, index) !=
+        key_code_array_get_at(array2, index)) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
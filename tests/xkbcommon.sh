@@ -0,0 +1,7 @@
+#!/bin/sh
+# Runs xkbcommon-test on a virtual X server, whose keymap is compiled both
+# by the server and by libxkbcommon from the same rules
+
+[ -x ./xkbcommon-test ] || exit 77
+. ./xvfb.sh
+./xkbcommon-test
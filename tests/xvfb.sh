@@ -0,0 +1,14 @@
+# Sourced by the scripts needing an X server.  Starts Xvfb on DISPLAY,
+# which is killed on exit, or exits with 77 if Xvfb is not installed.
+
+command -v Xvfb > /dev/null || exit 77
+
+DISPLAY=:${XSK_TEST_DISPLAY:-97}
+export DISPLAY
+Xvfb $DISPLAY -nolisten tcp > /dev/null 2>&1 &
+xvfb_pid=$!
+trap 'kill $xvfb_pid 2> /dev/null' EXIT
+for i in 1 2 3 4 5 6 7 8 9 10; do
+  [ -e /tmp/.X11-unix/X${DISPLAY#:} ] && break
+  sleep 0.5
+done